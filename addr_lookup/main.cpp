@@ -0,0 +1,119 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <address_index.h>
+#include <chainparams.h>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <iostream>
+#include <unistd.h>
+
+using namespace btc_utils;
+
+void print_usage()
+{
+   std::cout << "Usage:" << std::endl;
+   std::cout << "addr_lookup [-m|-t|-r] [-v] -x index_file [address ...]" << std::endl;
+   std::cout << "where" << std::endl;
+   std::cout << "-m - addresses of BTC mainnet, default option" << std::endl;
+   std::cout << "-t - addresses of BTC testnet" << std::endl;
+   std::cout << "-r - addresses of BTC regtest" << std::endl;
+   std::cout << "-v - print query time" << std::endl;
+   std::cout << "index_file - address index built with addr_parser -x" << std::endl;
+   std::cout << "address - address to look up, addresses are read from stdin when none is given" << std::endl;
+   std::cout << "Every found address is printed with the blk_file:offset positions of the blocks paying to it" << std::endl;
+}
+
+bool lookup(const address_index_t& index, const std::string& address, bool verbose)
+{
+   tx_destination_t dest;
+   if (!decode_destination(address, dest))
+   {
+      std::cerr << "Invalid address " << address << std::endl;
+      return false;
+   }
+   auto start = std::chrono::steady_clock::now();
+   std::vector<uint64_t> positions = index.find(dest);
+   auto elapsed = std::chrono::steady_clock::now() - start;
+
+   std::string line = address;
+   char buf[64];
+   for (uint64_t pos: positions)
+   {
+      snprintf(buf, sizeof(buf), " blk%05" PRIu64 ".dat:%" PRIu64, pos >> 32, pos & 0xffffffff);
+      line += buf;
+   }
+   std::cout << line << std::endl;
+   if (verbose)
+      std::cerr << address << ": " << positions.size() << " blocks, "
+                << std::chrono::duration<double, std::micro>(elapsed).count() << " us" << std::endl;
+   return true;
+}
+
+int main(int argc, char* argv[])
+{
+   std::string index_file;
+   bool verbose = false;
+   int c;
+
+   while ((c = getopt(argc, argv, "mtrvx:?")) != -1)
+   {
+     switch (c)
+     {
+         case 'm':
+            btc_utils::g_network = btc_utils::network_t::mainnet;
+            break;
+         case 't':
+            btc_utils::g_network = btc_utils::network_t::testnet;
+            break;
+         case 'r':
+            btc_utils::g_network = btc_utils::network_t::regtest;
+            break;
+         case 'v':
+            verbose = true;
+            break;
+         case 'x':
+            if (!optarg)
+            {
+               std::cout << "x option requires argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            index_file = optarg;
+            break;
+         default:
+            print_usage();
+            return 1;
+      }
+   }
+   if (index_file.empty())
+   {
+      print_usage();
+      return 1;
+   }
+
+   try {
+      address_index_t index(index_file);
+      bool ok = true;
+      if (optind < argc)
+      {
+         for (int i = optind; i < argc; i++)
+            ok = lookup(index, argv[i], verbose) && ok;
+      }
+      else
+      {
+         std::string address;
+         while (std::getline(std::cin, address))
+         {
+            if (!address.empty())
+               ok = lookup(index, address, verbose) && ok;
+         }
+      }
+      return ok ? 0 : 1;
+   } catch (const std::exception& e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+   }
+}
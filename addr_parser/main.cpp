@@ -3,18 +3,41 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <address_balances.h>
+#include <address_cache.h>
+#include <address_index.h>
+#include <address_stats.h>
 #include <block.h>
+#include <block_reader.h>
 #include <chainparams.h>
+#include <columnar.h>
 #include <crypto.h>
+#include <output_writer.h>
+#include <pub_key_cache.h>
+#include <task_scheduler.h>
+#include <watchlist.h>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_set>
+#include <getopt.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include "tinyformat.h"
 
 using namespace btc_utils;
 
-static const unsigned int MAX_SIZE = 0x02000000;
-
 template <typename... Args>
 static inline void log_printf(const char* fmt, const Args&... args)
 {
@@ -25,363 +48,1159 @@ static inline void log_printf(const char* fmt, const Args&... args)
          /* Original format string will have newline so don't add one here */
          log_msg = "Error \"" + std::string(fmterr.what()) + "\" while formatting log message: " + fmt;
      }
+     static std::mutex log_mutex;
+     std::lock_guard<std::mutex> lock(log_mutex);
      std::cout << log_msg << std::endl;
 }
 
-std::string compose_block_file_path(std::string db_path, uint32_t index)
+//! most output files the address list of a directory is partitioned into
+static const unsigned int MAX_SHARDS = 256;
+//! smallest output buffer of a shard
+static const size_t MIN_SHARD_BUFFER_SIZE = 256 << 10;
+
+/** Block directory to parse, the network of its blocks and the file to write the results to */
+struct parse_job_t
 {
-   std::string fname = strprintf("%s%05u.dat", "blk", index);
-   if(db_path.empty())
-      return fname;
-   if(db_path.back() == '/')
-      return db_path + fname;
-   return db_path + "/" + fname;
-}
+   std::string db_path;
+   network_t network = network_t::mainnet;
+   std::string out_file = "addresses.txt";
+   unsigned int shards = 1;           //!< output files the addresses are partitioned into
+   std::string label;                 //!< log prefix, empty when there is a single directory
 
-/** Non-refcounted RAII wrapper around a FILE* that implements a ring buffer to
- *  deserialize from. It guarantees the ability to rewind a given number of bytes.
- *
- *  Will automatically close the file when it goes out of scope if not null.
- *  If you need to close the file early, use file.fclose() instead of fclose(file).
+   //! output file of the shard, addresses.<k>.txt for addresses.txt
+   std::string shard_file(unsigned int shard) const
+   {
+      if (shards == 1)
+         return out_file;
+      size_t name = out_file.find_last_of('/');
+      name = name == std::string::npos ? 0 : name + 1;
+      size_t dot = out_file.find('.', name + 1);
+      if (dot == std::string::npos)
+         return out_file + "." + std::to_string(shard);
+      return out_file.substr(0, dot) + "." + std::to_string(shard) + out_file.substr(dot);
+   }
+};
+
+/** Page cache hints while reading the block files */
+struct input_options_t
+{
+   unsigned int readahead = 2;        //!< block files read ahead by the kernel
+   bool drop_cache = true;            //!< drop the pages of the block files read, unless they were cached before
+   bool chain_order = false;          //!< read the blocks of the best chain in height order
+   unsigned int chain_depth = 6;      //!< blocks on top of a block before it is read in chain order
+};
+
+/** Buffers and compression of the output writer */
+struct output_options_t
+{
+   size_t buffer_size = 4u << 20;
+   size_t buffers = 4;
+   bool direct = false;               //!< bypass the page cache with O_DIRECT
+   output_format_t format = OUTPUT_PLAIN;
+   int level = 0;                     //!< 0 is the default level of the format
+   unsigned int compress_threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+};
+
+/** Address balances computed from the UTXO set built while walking the blocks.
+ *  Blocks are applied in chain order, the blocks of stale branches are left out.
+ *  A bare multisig output is credited to the address of its first key.
  */
-class buffered_file_t
+class balances_t
 {
 private:
-    FILE *src;            //!< source file
-    uint64_t nSrcPos;     //!< how many bytes have been read from source
-    uint64_t nReadPos;    //!< how many bytes have been read from this
-    uint64_t nReadLimit;  //!< up to which position we're allowed to read
-    uint64_t nRewind;     //!< how many bytes we guarantee to rewind
-    std::vector<char> vchBuf; //!< the buffer
-
-protected:
-    //! read data from the source to fill the buffer
-    bool Fill() {
-        unsigned int pos = nSrcPos % vchBuf.size();
-        unsigned int readNow = vchBuf.size() - pos;
-        unsigned int nAvail = vchBuf.size() - (nSrcPos - nReadPos) - nRewind;
-        if (nAvail < readNow)
-            readNow = nAvail;
-        if (readNow == 0)
-            return false;
-        size_t nBytes = fread((void*)&vchBuf[pos], 1, readNow, src);
-        if (nBytes == 0) {
-            throw std::ios_base::failure(feof(src) ? "CBufferedFile::Fill: end of file" : "CBufferedFile::Fill: fread failed");
-        }
-        nSrcPos += nBytes;
-        return true;
-    }
+    address_balances_t balances;
+    network_t network;
+    std::chrono::steady_clock::time_point start;
 
 public:
-    buffered_file_t(FILE *fileIn, uint64_t nBufSize, uint64_t nRewindIn) :
-        nSrcPos(0), nReadPos(0), nReadLimit(std::numeric_limits<uint64_t>::max()), nRewind(nRewindIn), vchBuf(nBufSize, 0)
+    balances_t(const std::string& spill_path, network_t networkIn) :
+        balances(spill_path), network(networkIn), start(std::chrono::steady_clock::now())
     {
-        if (nRewindIn >= nBufSize)
-            throw std::ios_base::failure("Rewind limit must be less than buffer size");
-        src = fileIn;
     }
 
-    ~buffered_file_t()
+    void process(const block_t& block)
     {
-        fclose();
+        balances.process(block.txes_.data(), block.txes_.data() + block.txes_.size());
     }
 
-    // Disallow copies
-    buffered_file_t(const buffered_file_t&) = delete;
-    buffered_file_t& operator=(const buffered_file_t&) = delete;
-
-    void fclose()
+    //! write "address balance" lines for all addresses with unspent outputs
+    void write(output_writer_t& out) const
     {
-        if (src) {
-            ::fclose(src);
-            src = nullptr;
-        }
+        balances.for_each([this, &out](const address_key_t& key, uint64_t balance) {
+            std::string line = strprintf("%s %u\n", encode_destination(key.destination(), network), balance);
+            out.write(line);
+        });
     }
 
-    //! check whether we're at the end of the source file
-    bool eof() const {
-        return nReadPos == nSrcPos && feof(src);
+    void log_stats() const
+    {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        log_printf("UTXO set: %u outpoints added, %u spent, %u spends of unknown outpoints, %u unspent",
+                   balances.added(), balances.spent(), balances.missing(), balances.unspent());
+        log_printf("UTXO set: %u multisig outputs credited to their first key",
+                   balances.shared_outputs());
+        log_printf("UTXO set: %.0f outpoints/s, table %u MB, %u addresses, peak memory %u MB",
+                   seconds > 0 ? double(balances.added() + balances.spent()) / seconds : 0.0,
+                   balances.memory_usage() >> 20, balances.addresses(), usage.ru_maxrss >> 10);
     }
+};
 
-    //! read a number of bytes
-    void read(unsigned char *pch, size_t nSize) {
-        if (nSize + nReadPos > nReadLimit)
-            throw std::ios_base::failure("Read attempted past buffer limit");
-        while (nSize > 0) {
-            if (nReadPos == nSrcPos)
-                Fill();
-            unsigned int pos = nReadPos % vchBuf.size();
-            size_t nNow = nSize;
-            if (nNow + pos > vchBuf.size())
-                nNow = vchBuf.size() - pos;
-            if (nNow + nReadPos > nSrcPos)
-                nNow = nSrcPos - nReadPos;
-            memcpy(pch, &vchBuf[pos], nNow);
-            nReadPos += nNow;
-            pch += nNow;
-            nSize -= nNow;
-        }
-    }
+/** Resolve the height range of the filter, and the block heights when asked for, from the block headers of the directory */
+void IndexBlockHeaders(const parse_job_t& job, block_filter_t& filter, block_height_map_t* heights = nullptr)
+{
+   auto start = std::chrono::steady_clock::now();
+   header_index_stats_t index = index_block_headers(job.db_path, job.network, filter, heights);
+   double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   log_printf("%sIndexed %u block headers of %u files in %.2f s, %u blocks in %u files are in the range, "
+              "%u blocks are stale, %u blocks have no known chain", job.label, index.headers, index.files, seconds,
+              filter.blocks.size(), std::count(filter.files.begin(), filter.files.end(), true), index.stale,
+              index.orphans);
+}
 
-    uint8_t readdata8()
-    {
-       uint8_t obj;
-       read(&obj, 1);
-       return obj;
-    }
+/** Log how the blocks were put in chain order */
+void LogChainOrder(const std::string& label, const chain_linker_stats_t& chain)
+{
+   log_printf("%sChain order: %u blocks, %u stale and %u unlinked blocks dropped, %u duplicates, %u blocks emitted "
+              "early", label, chain.blocks, chain.stale, chain.unlinked, chain.duplicates, chain.early);
+   log_printf("%sChain order buffer: up to %u blocks of %.1f MB, a block waited for %.1f blocks on average, "
+              "at most %u blocks and %.2f s", label, chain.peak_blocks, double(chain.peak_bytes) / (1 << 20),
+              chain.blocks ? double(chain.total_delay) / double(chain.blocks) : 0.0, chain.max_delay,
+              chain.max_seconds);
+}
 
-    uint16_t readdata16()
-    {
-       uint16_t obj;
-       read((unsigned char*)&obj, 2);
-       return le16toh(obj);
-    }
+/** Outputs and addresses written for every output type */
+struct output_stats_t
+{
+   std::array<uint64_t, TX_WITNESS_V1_TAPROOT + 1> outputs{};
+   std::array<uint64_t, TX_WITNESS_V1_TAPROOT + 1> addresses{};
+   std::array<uint64_t, TX_WITNESS_V1_TAPROOT + 1> cache_hits{};
+   std::array<uint64_t, TX_WITNESS_V1_TAPROOT + 1> cache_misses{};
+   uint64_t without_address = 0;
+   uint64_t skipped_blocks = 0;       //!< blocks out of the range of the filter
 
-    uint32_t readdata32()
-    {
-       uint32_t obj;
-       read((unsigned char*)&obj, 4);
-       return le32toh(obj);
-    }
+   void add(const output_stats_t& other)
+   {
+      for (size_t type = 0; type < outputs.size(); type++)
+      {
+         outputs[type] += other.outputs[type];
+         addresses[type] += other.addresses[type];
+         cache_hits[type] += other.cache_hits[type];
+         cache_misses[type] += other.cache_misses[type];
+      }
+      without_address += other.without_address;
+      skipped_blocks += other.skipped_blocks;
+   }
 
-    uint64_t readdata64()
-    {
-       uint64_t obj;
-       read((unsigned char*)&obj, 8);
-       return le64toh(obj);
-    }
+   //! take the lookups of an address cache that is no longer used
+   void add_cache(const address_cache_t& cache)
+   {
+      for (size_t type = 0; type < outputs.size(); type++)
+      {
+         cache_hits[type] += cache.hits(static_cast<txnouttype>(type));
+         cache_misses[type] += cache.misses(static_cast<txnouttype>(type));
+      }
+   }
 
-    uint64_t read_compact_int()
-    {
-        uint8_t ci_size = readdata8();
-        uint64_t res = 0;
-        if (ci_size < 253)
-        {
-            res = ci_size;
-        }
-        else if (ci_size == 253)
-        {
-            res = readdata16();
-            if (res < 253)
-                throw std::runtime_error("non-canonical compact int");
-        }
-        else if (ci_size == 254)
-        {
-            res = readdata32();
-            if (res < 0x10000u)
-                throw std::runtime_error("non-canonical compact int");
-        }
-        else
-        {
-            res = readdata64();
-            if (res < 0x100000000ULL)
-                throw std::runtime_error("non-canonical compact int");
-        }
-        if (res > (uint64_t)MAX_SIZE)
-            throw std::runtime_error("compact int is too large");
-        return res;
-    }
+   void log(const std::string& label) const
+   {
+      for (size_t type = 0; type < outputs.size(); type++)
+      {
+         if (!outputs[type])
+            continue;
+         uint64_t lookups = cache_hits[type] + cache_misses[type];
+         log_printf("%s%s: %u outputs, %u addresses, %.1f%% of the addresses cached", label,
+                    get_txn_output_type(static_cast<txnouttype>(type)), outputs[type], addresses[type],
+                    lookups ? 100.0 * double(cache_hits[type]) / double(lookups) : 0.0);
+      }
+      log_printf("%s%u outputs without address", label, without_address);
+      if (skipped_blocks)
+         log_printf("%s%u blocks out of the range skipped", label, skipped_blocks);
+   }
+};
 
-    void unserialize(unsigned char& val)
-    {
-       val = readdata8();
-    }
+/**
+ * Append the address lines of the transactions to addrout, which has a string for every shard of
+ * the output. An address goes to the shard picked by the hash of its key, so every shard holds
+ * all the lines of its addresses.
+ */
+template<typename Params>
+void WriteAddresses(const transaction_t* begin, const transaction_t* end, std::vector<std::string>& addrout,
+                    bool with_outpoints, address_cache_t& cache, destination_batch_t& batch, output_stats_t& stats)
+{
+   batch.assign(begin, end);
+   size_t output = 0;
+   for(const transaction_t* tx = begin; tx != end; ++tx)
+   {
+      std::string txid;
+      if (with_outpoints)
+         txid = uint256_to_hex(tx->txid);
+      for(size_t n = 0; n < tx->vout.size(); n++)
+      {
+         destination_range_t dests = batch[output++];
+         if (dests.empty())
+            stats.without_address++;
+         else
+            stats.outputs[dests.begin()->type_]++;
+         for(const auto& dest: dests)
+         {
+            std::string_view addr = cache.encode<Params>(dest);
+            if (addr.empty())
+               continue;
+            stats.addresses[dest.type_]++;
+            std::string& shard = addrout.size() == 1 ? addrout[0] :
+                                 addrout[address_shard(address_key_t(dest), static_cast<unsigned int>(addrout.size()))];
+            shard.append(addr.data(), addr.size());
+            if (with_outpoints)
+            {
+               shard += ' ';
+               shard += txid;
+               shard += ':';
+               shard += std::to_string(n);
+            }
+            shard += '\n';
+         }
+      }
+   }
+}
 
-    void unserialize(uint32_t& val)
-    {
-       val = readdata32();
-    }
+template<typename Params>
+void WriteAddresses(const block_t& block, std::vector<std::string>& addrout, bool with_outpoints, address_cache_t& cache,
+                    destination_batch_t& batch, output_stats_t& stats)
+{
+   const transaction_t* txes = block.txes_.data();
+   WriteAddresses<Params>(txes, txes + block.txes_.size(), addrout, with_outpoints, cache, batch, stats);
+}
 
-    void unserialize(uint64_t& val)
-    {
-       val = readdata64();
-    }
+/** Addresses of a run of transactions of a block */
+struct address_piece_t
+{
+   std::vector<std::string> out;      //!< a string for every shard
+   output_stats_t stats;
+};
 
-    template<typename T, typename A>
-    void unserialize(std::vector<T, A>& v)
-    {
-       v.clear();
-       uint64_t v_size = read_compact_int();
-       v.resize(v_size);
-       for (uint64_t i = 0; i < v_size; i++)
-           v[i].unserialize(*this);
-    }
+/** Part of a block file parsed by one task */
+struct block_file_chunk_t
+{
+   //! block parsed from the chunk
+   struct block_range_t
+   {
+      uint64_t header;     //!< position of the message start
+      uint64_t next;       //!< position where the search for the next block starts
+      size_t pieces_end;   //!< end of the addresses of the block in pieces
+      bool skipped;        //!< out of the range of the filter
+   };
 
-    void unserialize(std::vector<unsigned char>& v)
-    {
-       v.clear();
-       uint64_t v_size = read_compact_int();
-       v.resize(v_size);
-       for (uint64_t i = 0; i < v_size; i++)
-           unserialize(v[i]);
-    }
+   std::string path;
+   uint32_t file = 0;
+   uint64_t begin = 0;     //!< blocks with a header in [begin, end)
+   uint64_t end = 0;
+   bool done = false;
+   std::vector<block_range_t> blocks;
+   std::deque<address_piece_t> pieces;   //!< in file order, filled in by the tasks formatting the blocks
+   std::atomic<size_t> pending{1};       //!< the parsing task and the formatting tasks not finished yet
+};
 
-    void unserialize(std::vector<std::vector<unsigned char> >& v)
-    {
-       v.clear();
-       uint64_t v_size = read_compact_int();
-       v.resize(v_size);
-       for (uint64_t i = 0; i < v_size; i++)
-           unserialize(v[i]);
-    }
+//! size of the block file chunks parsed in parallel
+static const uint64_t BLOCK_FILE_CHUNK_SIZE = 16 << 20;
 
-    void unserialize(uint256_t& val)
-    {
-       read(val.data(), val.size());
-    }
+/**
+ * Write the address list of the block files with the tasks of the scheduler. A task parses a chunk
+ * of a block file and every block of it is formatted by tasks of at most grain transactions, which
+ * idle workers steal. The chunks are joined in file order: a chunk continues from where the search
+ * for a block ended in the chunk before it, blocks of the chunk before that position were found
+ * inside a block that crossed the boundary and are dropped. When no block of the chunk continues
+ * from that position the chunk is parsed again from there, so the output is the same as a serial run.
+ */
+template<typename Params>
+void WriteAddressesParallel(const parse_job_t& job, std::vector<std::unique_ptr<output_writer_t>>& outs,
+                            bool with_outpoints, task_scheduler_t& scheduler, size_t grain, const block_filter_t* filter,
+                            const input_options_t& input, output_stats_t& stats)
+{
+   block_file_cache_t cache(job.db_path, input.readahead, input.drop_cache, filter);
+   std::mutex mutex;
+   std::condition_variable cv;
+   // one address cache for every worker, made when it first formats addresses of this directory
+   std::vector<std::unique_ptr<address_cache_t>> caches(scheduler.threads());
+   std::vector<destination_batch_t> batches(scheduler.threads());
+   // the transactions a worker decodes, their vectors keep their storage for the next run
+   std::vector<std::vector<transaction_t>> decoded(scheduler.threads());
+   const tx_hashes_t hashes = with_outpoints ? TX_HASHES_TXID : TX_HASHES_NONE;
 
-    //! return the current reading position
-    uint64_t GetPos() const {
-        return nReadPos;
-    }
+   auto finish = [&](block_file_chunk_t& chunk) {
+      if (--chunk.pending == 0) {
+         std::lock_guard<std::mutex> lock(mutex);
+         chunk.done = true;
+         cv.notify_all();
+      }
+   };
+   auto parse = [&](block_file_chunk_t& chunk) {
+      FILE* file = fopen(chunk.path.c_str(), "rb");
+      if (!file) {
+         log_printf("Error: Unable to open file %s\n", chunk.path);
+         finish(chunk);
+         return;
+      }
+      read_block_file_range(file, job.network, chunk.begin, chunk.end,
+                          [filter](const block_header_view_t& header) { return !filter || filter->accepts(header); },
+                          [&](std::vector<unsigned char>& block, uint64_t nBlockPos, uint64_t nNext) {
+         // the tasks decode their own transactions out of the serialized block
+         std::shared_ptr<const std::vector<unsigned char>> shared =
+            std::make_shared<const std::vector<unsigned char>>(std::move(block));
+         block_view_t view(shared->data(), shared->size(), hashes, 0, nBlockPos, 0);
+         uint64_t txes = view.transactions();
+         uint64_t i = 0;
+         view.for_each_transaction([&](const transaction_view_t& tx) {
+            if (i++ % grain != 0)
+               return;
+            address_piece_t* piece = &chunk.pieces.emplace_back();
+            piece->out.resize(outs.size());
+            chunk.pending++;
+            size_t count = static_cast<size_t>(std::min<uint64_t>(grain, txes - i + 1));
+            scheduler.submit([&, shared, piece, count, data = tx.data(), chunk_ptr = &chunk]() {
+               unsigned int worker = scheduler.current_worker();
+               std::unique_ptr<address_cache_t>& cache = caches[worker];
+               if (!cache)
+                  cache.reset(new address_cache_t());
+               std::vector<transaction_t>& run = decoded[worker];
+               run.resize(std::max(run.size(), count));
+               const unsigned char* p = data;
+               for (size_t k = 0; k < count; k++) {
+                  transaction_view_t next(p);
+                  next.decode(run[k], hashes);
+                  p += next.size();
+               }
+               WriteAddresses<Params>(run.data(), run.data() + count, piece->out, with_outpoints,
+                                      *cache, batches[worker], piece->stats);
+               finish(*chunk_ptr);
+            });
+         });
+         chunk.blocks.push_back({nBlockPos - MESSAGE_START_SIZE - sizeof(uint32_t), nNext, chunk.pieces.size(), false});
+      }, [&chunk](uint64_t nBlockPos, uint64_t nNext) {
+         chunk.blocks.push_back({nBlockPos - MESSAGE_START_SIZE - sizeof(uint32_t), nNext, chunk.pieces.size(), true});
+      }, [&job, &chunk](const std::string& message) {
+         log_printf("%s%s: %s", job.label, chunk.path, message);
+      });
+      finish(chunk);
+   };
+   auto schedule = [&](std::unique_ptr<block_file_chunk_t>& chunk) {
+      block_file_chunk_t* ptr = chunk.get();
+      scheduler.submit([&parse, ptr]() { parse(*ptr); });
+   };
 
-    //! rewind to a given reading position
-    bool SetPos(uint64_t nPos) {
-        size_t bufsize = vchBuf.size();
-        if (nPos + bufsize < nSrcPos) {
-            // rewinding too far, rewind as far as possible
-            nReadPos = nSrcPos - bufsize;
-            return false;
-        }
-        if (nPos > nSrcPos) {
-            // can't go this far forward, go as far as possible
-            nReadPos = nSrcPos;
-            return false;
-        }
-        nReadPos = nPos;
-        return true;
-    }
+   // at most a few chunks per worker wait to be written
+   const size_t nWindow = 2 * scheduler.threads();
+   std::deque<std::unique_ptr<block_file_chunk_t>> chunks; //!< in file order, the first one is written next
+   uint32_t nFile = 0;
+   std::string block_file;
+   uint64_t nFileSize = 0;
+   uint64_t nScheduled = 0;  //!< part of the file cut into chunks
+   bool fCutting = false;    //!< nFile is being cut into chunks
+   bool fFilesLeft = true;
+   uint64_t nNext = 0;       //!< where the serial search for the next block starts
+   while (true) {
+      while (fFilesLeft && chunks.size() < nWindow) {
+         if (!fCutting) {
+            block_file = get_block_file_path(job.db_path, nFile);
+            FILE* file = fopen(block_file.c_str(), "rb");
+            if (!file) {
+               log_printf("%sError: Unable to open file %s\n", job.label, block_file.c_str());
+               fFilesLeft = false;
+               break;
+            }
+            fseeko(file, 0, SEEK_END);
+            off_t size = ftello(file);
+            fclose(file);
+            nFileSize = size > 0 ? static_cast<uint64_t>(size) : 0;
+            if (filter && !filter->accepts_file(nFile)) {
+               log_printf("%sSkipping block file blk%05u.dat, no block in the range", job.label, nFile);
+               nFile++;
+               continue;
+            }
+            nScheduled = 0;
+            fCutting = true;
+            cache.begin(nFile);
+            log_printf("%sProcessing block file blk%05u.dat...", job.label, nFile);
+         }
+         std::unique_ptr<block_file_chunk_t> chunk(new block_file_chunk_t());
+         chunk->path = block_file;
+         chunk->file = nFile;
+         chunk->begin = nScheduled;
+         chunk->end = nScheduled = std::min(nFileSize, nScheduled + BLOCK_FILE_CHUNK_SIZE);
+         if (nScheduled == nFileSize) {
+            // the last chunk takes whatever the file has grown by
+            chunk->end = std::numeric_limits<uint64_t>::max();
+            fCutting = false;
+            nFile++;
+         }
+         schedule(chunk);
+         chunks.push_back(std::move(chunk));
+      }
+      if (chunks.empty())
+         break;
+      std::unique_ptr<block_file_chunk_t> chunk = std::move(chunks.front());
+      chunks.pop_front();
+      {
+         std::unique_lock<std::mutex> lock(mutex);
+         cv.wait(lock, [&]() { return chunk->done; });
+      }
 
-    bool Seek(uint64_t nPos) {
-        long nLongPos = nPos;
-        if (nPos != (uint64_t)nLongPos)
-            return false;
-        if (fseek(src, nLongPos, SEEK_SET))
-            return false;
-        nLongPos = ftell(src);
-        nSrcPos = nLongPos;
-        nReadPos = nLongPos;
-        return true;
-    }
+      if (chunk->begin == 0)
+         nNext = 0;
+      size_t first = 0;
+      while (first < chunk->blocks.size() && chunk->blocks[first].header < nNext)
+         first++;
+      // the blocks found from the chunk boundary do not continue from the last written one
+      if (first > 0 && chunk->blocks[first - 1].next > nNext) {
+         std::unique_ptr<block_file_chunk_t> reparsed(new block_file_chunk_t());
+         reparsed->path = chunk->path;
+         reparsed->file = chunk->file;
+         reparsed->begin = nNext;
+         reparsed->end = chunk->end;
+         chunk = std::move(reparsed);
+         schedule(chunk);
+         std::unique_lock<std::mutex> lock(mutex);
+         cv.wait(lock, [&]() { return chunk->done; });
+         first = 0;
+      }
+      if (first < chunk->blocks.size()) {
+         for (size_t i = first ? chunk->blocks[first - 1].pieces_end : 0; i < chunk->pieces.size(); i++) {
+            for (size_t shard = 0; shard < outs.size(); shard++)
+               outs[shard]->write(chunk->pieces[i].out[shard]);
+            stats.add(chunk->pieces[i].stats);
+         }
+         for (size_t i = first; i < chunk->blocks.size(); i++)
+            stats.skipped_blocks += chunk->blocks[i].skipped;
+         nNext = chunk->blocks.back().next;
+      }
+      if (chunk->end == std::numeric_limits<uint64_t>::max()) {
+         // a compressed frame does not span block files
+         for (auto& out: outs)
+            out->end_frame();
+         cache.end(chunk->file);
+      }
+   }
+   for (const auto& cache: caches)
+      if (cache)
+         stats.add_cache(*cache);
+}
 
-    //! prevent reading beyond a certain position
-    //! no argument removes the limit
-    bool SetLimit(uint64_t nPos = std::numeric_limits<uint64_t>::max()) {
-        if (nPos < nReadPos)
-            return false;
-        nReadLimit = nPos;
-        return true;
-    }
+/** Output of a block checked against the watchlist */
+struct watch_candidate_t
+{
+   const transaction_t* tx;
+   uint32_t n;
+   tx_destination_t dest;
+   address_key_t key;
+   uint64_t hash;
+};
 
-    template<typename T>
-    buffered_file_t& operator>>(T&& obj) {
-        // Unserialize from this stream
-        obj.unserialize(*this);
-        return (*this);
-    }
+/**
+ * Write the outputs of the block paying to watched addresses. Destinations
+ * of the whole block are hashed and prefetched before the filter is probed,
+ * only matches are encoded as addresses.
+ */
+void WriteWatchedOutputs(const block_t& block, output_writer_t& out, network_t network, const watchlist_t& watchlist,
+                         destination_batch_t& dests, std::vector<watch_candidate_t>& batch, uint32_t nFile,
+                         uint64_t nBlockPos)
+{
+   batch.clear();
+   dests.assign(block.txes_.data(), block.txes_.data() + block.txes_.size());
+   size_t output = 0;
+   for(const auto& tx: block.txes_)
+      for(uint32_t n = 0; n < tx.vout.size(); n++)
+         for(const auto& dest: dests[output++])
+         {
+            batch.push_back({&tx, n, dest, address_key_t(dest), 0});
+            batch.back().hash = batch.back().key.hash();
+            watchlist.prefetch(batch.back().hash);
+         }
+   for(const auto& item: batch)
+   {
+      if (!watchlist.may_contain(item.hash) || !watchlist.contains(item.key, item.hash))
+         continue;
+      std::string line = strprintf("%s %s:%u blk%05u.dat:%u\n", encode_destination(item.dest, network),
+                                   uint256_to_hex(item.tx->txid), item.n, nFile, nBlockPos);
+      out.write(line);
+   }
+}
 
-    //! search for a given byte in the stream, and remain positioned on it
-    void FindByte(char ch) {
-        while (true) {
-            if (nReadPos == nSrcPos)
-                Fill();
-            if (vchBuf[nReadPos % vchBuf.size()] == ch)
-                break;
-            nReadPos++;
-        }
-    }
+/** Visitor logging the block files as they are opened and the blocks that could not be read */
+class logging_visitor_t : public block_visitor_t
+{
+public:
+   explicit logging_visitor_t(const std::string& label) : label_(label) {}
+
+   void begin_file(uint32_t file, unsigned int /* thread */) override
+   {
+      log_printf("%sProcessing block file blk%05u.dat...", label_, file);
+   }
+
+   void on_error(uint32_t file, const std::string& message) override
+   {
+      log_printf("%sblk%05u.dat: %s", label_, file, message);
+   }
+
+protected:
+   std::string label_;
+};
+
+/** Visitor passing the blocks of a directory to a function, the output frames end with the block files */
+template<typename F>
+class directory_visitor_t : public logging_visitor_t
+{
+public:
+   directory_visitor_t(const std::string& label, std::vector<std::unique_ptr<output_writer_t>>& outs, F on_block) :
+      logging_visitor_t(label), outs_(outs), on_block_(on_block)
+   {
+   }
+
+   void end_file(uint32_t /* file */, unsigned int /* thread */) override
+   {
+      // a compressed frame does not span block files
+      for (auto& out: outs_)
+         out->end_frame();
+   }
+
+   void on_block(const block_view_t& view) override { on_block_(view); }
+
+private:
+   std::vector<std::unique_ptr<output_writer_t>>& outs_;
+   F on_block_;
+};
+
+/** Visitor collecting the destinations of every block file, which is added to the index as one run */
+class address_index_visitor_t : public logging_visitor_t
+{
+public:
+   address_index_visitor_t(address_index_writer_t& writer, unsigned int threads) :
+      logging_visitor_t(""), writer_(writer), postings_(threads)
+   {
+   }
+
+   void begin_file(uint32_t file, unsigned int thread) override
+   {
+      logging_visitor_t::begin_file(file, thread);
+      postings_[thread].clear();
+   }
+
+   void end_file(uint32_t /* file */, unsigned int thread) override { writer_.add_run(postings_[thread]); }
+
+   void on_output(const block_view_t& view, const transaction_view_t& /* tx */, uint32_t /* n */,
+                  const tx_out_view_t& out) override
+   {
+      uint64_t pos = make_block_pos(view.file, static_cast<uint32_t>(view.pos));
+      for(const auto& dest: extract_destinations(out.script()))
+         postings_[view.thread].emplace_back(dest, pos);
+   }
+
+private:
+   address_index_writer_t& writer_;
+   std::vector<std::vector<address_posting_t>> postings_;   //!< postings of the file of every thread
+};
+
+/** Visitor adding the outputs paying to addresses to a columnar file */
+class columnar_visitor_t : public logging_visitor_t
+{
+public:
+   explicit columnar_visitor_t(columnar_writer_t& writer) : logging_visitor_t(""), writer_(writer) {}
+
+   void on_output(const block_view_t& view, const transaction_view_t& tx, uint32_t n, const tx_out_view_t& out) override
+   {
+      uint64_t pos = make_block_pos(view.file, static_cast<uint32_t>(view.pos));
+      for(const auto& dest: extract_destinations(out.script()))
+         writer_.add(pos, tx.txid(), n, dest, out.value());
+   }
+
+private:
+   columnar_writer_t& writer_;
+};
+
+/** Visitor adding the outputs of the blocks of the best chain, which have a height, to the address statistics */
+class address_stats_visitor_t : public logging_visitor_t
+{
+public:
+   address_stats_visitor_t(const std::string& label, address_aggregator_t& aggregator, const block_height_map_t& heights,
+                           unsigned int threads) :
+      logging_visitor_t(label), aggregator_(aggregator), heights_(heights), batches_(threads), outputs_(0),
+      without_height_(0)
+   {
+   }
+
+   void on_block(const block_view_t& view) override
+   {
+      auto it = heights_.find(view.header().hash());
+      if (it == heights_.end())
+      {
+         without_height_++;
+         return;
+      }
+      const std::vector<transaction_t>& txes = view.block().txes_;
+      destination_batch_t& batch = batches_[view.thread];
+      batch.assign(txes.data(), txes.data() + txes.size());
+      size_t output = 0;
+      for (const auto& tx: txes)
+         for (const auto& out: tx.vout)
+            for (const auto& dest: batch[output++])
+            {
+               aggregator_.add(view.thread, dest, it->second, out.nValue);
+               outputs_++;
+            }
+   }
+
+   //! outputs added for every address they pay to
+   uint64_t outputs() const { return outputs_; }
+   //! blocks of stale branches or not linked to the first block, left out
+   uint64_t without_height() const { return without_height_; }
+
+private:
+   address_aggregator_t& aggregator_;
+   const block_height_map_t& heights_;
+   std::vector<destination_batch_t> batches_;   //!< one for every reader thread
+   std::atomic<uint64_t> outputs_;
+   std::atomic<uint64_t> without_height_;
 };
 
-void ParseBlockFile(FILE* f, int& nLoaded, FILE* addrout)
+int BuildAddressIndex(const parse_job_t& job, const std::string& index_file, unsigned int nThreads,
+                      const input_options_t& input)
 {
    try {
-       // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-       buffered_file_t blkdat(f, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8);
-       uint64_t nRewind = blkdat.GetPos();
-       while (!blkdat.eof()) {
-           blkdat.SetPos(nRewind);
-           nRewind++; // start one byte further next time, in case of failure
-           blkdat.SetLimit(); // remove former limit
-           unsigned int nSize = 0;
-           try {
-               // locate a header
-               std::array<unsigned char, MESSAGE_START_SIZE> buf;
-               blkdat.FindByte(message_start()[0]);
-               nRewind = blkdat.GetPos()+1;
-               blkdat.read(buf.data(), MESSAGE_START_SIZE);
-               if (memcmp(buf.data(), message_start(), MESSAGE_START_SIZE))
-                   continue;
-               // read size
-               blkdat.read((unsigned char*)&nSize,  sizeof(nSize));
-               if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
-                   continue;
-           } catch (const std::exception&) {
-               // no valid block header found; don't complain
-               break;
-           }
-           try {
-               // read block
-               uint64_t nBlockPos = blkdat.GetPos();
-               blkdat.SetLimit(nBlockPos + nSize);
-               blkdat.SetPos(nBlockPos);
-               block_t block;
-               blkdat >> block;
-               nRewind = blkdat.GetPos();
-
-               for(const auto& tx: block.txes_)
-               {
-                  for(const auto& out: tx.vout)
-                  {
-                     std::vector<std::string> addrs = out.addresses();
-                     for(const auto& addr: addrs)
-                     {
-                        fwrite(addr.c_str(), 1, addr.size(), addrout);
-                        fwrite("\n", 1, 1, addrout);
-                     }
-                  }
-               }
-               if(nLoaded % 100 == 1)
-                  log_printf("Block %i is read", nLoaded++);
-           } catch (const std::exception& e) {
-               log_printf("%s: Deserialize or I/O error - %s", __func__, e.what());
-           }
+      address_index_writer_t writer(index_file);
+      block_reader_options_t options;
+      options.network = job.network;
+      options.threads = nThreads;
+      options.readahead = input.readahead;
+      options.drop_cache = input.drop_cache;
+      block_reader_t reader(job.db_path, options);
+      address_index_visitor_t visitor(writer, nThreads);
+      reader.read(visitor);
+
+      log_printf("Merging address index...");
+      uint64_t keys = writer.finish();
+      log_printf("Address index %s: %u addresses", index_file, keys);
+   } catch (const std::exception& e) {
+      log_printf("Error: %s", e.what());
+      return 1;
+   }
+   return 0;
+}
+
+/** Write the outputs paying to addresses as a columnar file instead of the address list */
+int WriteColumnarFile(const parse_job_t& job, int zstd_level, const input_options_t& input)
+{
+   try {
+      columnar_writer_t writer(job.out_file, zstd_level);
+      block_reader_options_t options;
+      options.network = job.network;
+      options.readahead = input.readahead;
+      options.drop_cache = input.drop_cache;
+      options.chain_order = input.chain_order;
+      options.chain_depth = input.chain_depth;
+      block_reader_t reader(job.db_path, options);
+      columnar_visitor_t visitor(writer);
+      reader.read(visitor);
+      writer.close();
+      if (input.chain_order)
+         LogChainOrder(job.label, reader.chain_stats());
+      log_printf("Columnar output %s: %u rows, %u bytes of columns stored in %u bytes",
+                 job.out_file, writer.rows(), writer.raw_size(), writer.stored_size());
+   } catch (const std::exception& e) {
+      log_printf("Error: %s", e.what());
+      return 1;
+   }
+   return 0;
+}
+
+/**
+ * Write "address first_height last_height outputs received" lines, one for every address paid in the
+ * block directory, instead of the address list. The block files are read by nThreads threads.
+ */
+int WriteAddressStats(const parse_job_t& job, unsigned int nThreads, size_t memory_limit, const input_options_t& input,
+                      const output_options_t& output, const block_filter_t& range)
+{
+   try {
+      output_writer_t out(job.out_file, output.buffer_size, output.buffers, output.direct, output.format, output.level,
+                          output.compress_threads);
+      block_reader_options_t options;
+      options.network = job.network;
+      options.threads = nThreads;
+      options.readahead = input.readahead;
+      options.drop_cache = input.drop_cache;
+      options.filter = range;
+      // the heights come from the block headers, which also resolve a height range
+      block_height_map_t heights;
+      IndexBlockHeaders(job, options.filter, &heights);
+
+      auto start = std::chrono::steady_clock::now();
+      address_aggregator_t aggregator(job.out_file, memory_limit, nThreads);
+      block_reader_t reader(job.db_path, options);
+      address_stats_visitor_t visitor(job.label, aggregator, heights, nThreads);
+      reader.read(visitor);
+      if (reader.skipped_blocks())
+         log_printf("%u blocks out of the range skipped", reader.skipped_blocks());
+      if (visitor.without_height())
+         log_printf("%u blocks off the best chain skipped", visitor.without_height());
+      log_printf("Merging the statistics of %u outputs...", visitor.outputs());
+
+      std::string line;
+      uint64_t addresses = with_network_params(job.network, [&](auto params) {
+         return aggregator.finish([&](const address_key_t& key, const address_stats_t& stats) {
+            char address[MAX_ADDRESS_SIZE];
+            size_t len = encode_destination<decltype(params)>(key.destination(), address);
+            if (len == 0)
+               return;
+            line.assign(address, len);
+            line += ' ';
+            line += std::to_string(stats.first_height);
+            line += ' ';
+            line += std::to_string(stats.last_height);
+            line += ' ';
+            line += std::to_string(stats.outputs);
+            line += ' ';
+            line += std::to_string(stats.received);
+            line += '\n';
+            out.write(line);
+         });
+      });
+      out.close();
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      log_printf("Address statistics %s: %u addresses in %.2f s, %u run files, tables up to %u MB, peak memory %u MB",
+                 job.out_file, addresses, seconds, aggregator.runs(), aggregator.peak_memory() >> 20,
+                 usage.ru_maxrss >> 10);
+   } catch (const std::exception& e) {
+      log_printf("Error: %s", e.what());
+      return 1;
+   }
+   return 0;
+}
+
+/**
+ * Write the address list, the balances or the watched outputs of a block directory to its output
+ * file. The address list is written by the tasks of the scheduler when there is one.
+ */
+int ParseBlockDirectory(const parse_job_t& job, bool with_outpoints, bool with_balances, const std::string& spill_file,
+                        const watchlist_t* watchlist, task_scheduler_t* scheduler, size_t grain,
+                        const input_options_t& input, const output_options_t& output, const block_filter_t& range)
+{
+   // every shard has its own buffers and writer thread, the shards share the buffer size
+   std::vector<std::unique_ptr<output_writer_t>> outs(job.shards);
+   size_t buffer_size = std::max(output.buffer_size / job.shards, MIN_SHARD_BUFFER_SIZE);
+   try {
+       for (unsigned int shard = 0; shard < job.shards; shard++)
+           outs[shard].reset(new output_writer_t(job.shard_file(shard), buffer_size, output.buffers,
+                                                 output.direct, output.format, output.level,
+                                                 std::max(1u, output.compress_threads / job.shards)));
+   } catch (const std::exception& e) {
+       log_printf("Error: %s\n", e.what());
+       return 1;
+   }
+   output_writer_t* out = outs[0].get();
+   std::unique_ptr<balances_t> balances;
+   if (with_balances)
+       balances.reset(new balances_t(spill_file, job.network));
+   std::vector<watch_candidate_t> batch;
+   destination_batch_t dests;
+   address_cache_t cache;
+   output_stats_t stats;
+   std::vector<std::string> addrout(job.shards);
+   block_filter_t filter = range;
+   if (filter.by_height())
+       IndexBlockHeaders(job, filter);
+   const block_filter_t* pFilter = filter.active() ? &filter : nullptr;
+   if (!balances && !watchlist && scheduler && !input.chain_order)
+   {
+       auto start = std::chrono::steady_clock::now();
+       with_network_params(job.network, [&](auto params) {
+           WriteAddressesParallel<decltype(params)>(job, outs, with_outpoints, *scheduler, grain, pFilter, input,
+                                                    stats);
+       });
+       double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+       stats.log(job.label);
+       uint64_t outputs = stats.without_address;
+       for (uint64_t n: stats.outputs)
+           outputs += n;
+       log_printf("%sParsed in %.2f s with %u threads, %.0f outputs/s", job.label, seconds, scheduler->threads(),
+                  seconds > 0 ? double(outputs) / seconds : 0.0);
+   }
+   else
+   {
+       block_reader_options_t options;
+       options.network = job.network;
+       options.hashes = balances || watchlist || with_outpoints ? TX_HASHES_TXID : TX_HASHES_NONE;
+       options.readahead = input.readahead;
+       options.drop_cache = input.drop_cache;
+       options.filter = std::move(filter);
+       // a spend may come before the output it spends in the block files, which also hold stale blocks
+       options.chain_order = input.chain_order || balances;
+       options.chain_depth = input.chain_depth;
+       block_reader_t reader(job.db_path, options);
+       if (balances)
+       {
+           directory_visitor_t visitor(job.label, outs, [&balances](const block_view_t& view) {
+               balances->process(view.block());
+           });
+           reader.read(visitor);
+       }
+       else if (watchlist)
+       {
+           directory_visitor_t visitor(job.label, outs, [&](const block_view_t& view) {
+               WriteWatchedOutputs(view.block(), *out, job.network, *watchlist, dests, batch, view.file, view.pos);
+           });
+           reader.read(visitor);
        }
-   } catch (const std::runtime_error& e) {
-       log_printf("System error: %s", e.what());
+       else
+       {
+           with_network_params(job.network, [&](auto params) {
+               directory_visitor_t visitor(job.label, outs, [&](const block_view_t& view) {
+                   for (auto& shard: addrout)
+                       shard.clear();
+                   WriteAddresses<decltype(params)>(view.block(), addrout, with_outpoints, cache, dests, stats);
+                   for (size_t shard = 0; shard < outs.size(); shard++)
+                       outs[shard]->write(addrout[shard]);
+               });
+               reader.read(visitor);
+           });
+       }
+       stats.skipped_blocks = reader.skipped_blocks();
+       if (options.chain_order)
+           LogChainOrder(job.label, reader.chain_stats());
+       if (reader.skipped_files())
+           log_printf("%sSkipped %u block files without blocks in the range", job.label, reader.skipped_files());
+       if (balances)
+       {
+           balances->write(*out);
+           balances->log_stats();
+       }
+       else if (!watchlist)
+       {
+           stats.add_cache(cache);
+           stats.log(job.label);
+       }
+       else if (stats.skipped_blocks)
+       {
+           log_printf("%s%u blocks out of the range skipped", job.label, stats.skipped_blocks);
+       }
+   }
+   int res = 0;
+   uint64_t bytes = 0, file_size = 0, smallest = std::numeric_limits<uint64_t>::max(), largest = 0;
+   size_t frames = 0;
+   double compress_seconds = 0, stall_seconds = 0;
+   for (auto& shard: outs) {
+       try {
+           shard->close();
+       } catch (const std::exception& e) {
+           log_printf("%sError: %s", job.label, e.what());
+           res = 1;
+       }
+       bytes += shard->bytes();
+       file_size += shard->file_size();
+       smallest = std::min(smallest, shard->bytes());
+       largest = std::max(largest, shard->bytes());
+       frames += shard->frames();
+       compress_seconds += shard->compress_seconds();
+       stall_seconds += shard->stall_seconds();
    }
+   if (res)
+       return res;
+   if (out->format() == OUTPUT_PLAIN)
+       log_printf("%sOutput: %.1f MB written%s, %.2f s waiting for the writer", job.label,
+                  double(bytes) / (1 << 20), out->direct() ? " with O_DIRECT" : "", stall_seconds);
+   else
+       log_printf("%sOutput: %.1f MB written as %.1f MB %s in %u frames, ratio %.2f, %.1f MB/s per compression thread "
+                  "with %u threads, %.2f s waiting for the writer", job.label, double(bytes) / (1 << 20),
+                  double(file_size) / (1 << 20), get_output_format_name(out->format()), frames,
+                  file_size ? double(bytes) / double(file_size) : 0.0,
+                  compress_seconds > 0 ? double(bytes) / (1 << 20) / compress_seconds : 0.0,
+                  out->compress_threads(), stall_seconds);
+   if (outs.size() > 1)
+       log_printf("%sOutput: %u shards of %.1f MB to %.1f MB", job.label, outs.size(), double(smallest) / (1 << 20),
+                  double(largest) / (1 << 20));
+   return 0;
+}
+
+//! bounds below it are heights, from it on UNIX times, as with nLockTime
+static const uint32_t LOCKTIME_THRESHOLD = 500000000;
+
+/**
+ * Set a bound of the block range from a height, a UNIX time or a UTC date YYYY-MM-DD; a date as
+ * the upper bound takes in the whole day.
+ */
+bool ParseRangeBound(const char* arg, bool upper, block_filter_t& filter)
+{
+   std::string value = arg;
+   uint32_t bound;
+   bool is_time = true;
+   if (value.find('-') != std::string::npos)
+   {
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      const char* end = strptime(arg, "%Y-%m-%d", &tm);
+      time_t time = end && *end == 0 ? timegm(&tm) : -1;
+      if (time < 0 || time > std::numeric_limits<uint32_t>::max() - 86399)
+         return false;
+      bound = static_cast<uint32_t>(time) + (upper ? 86399 : 0);
+   }
+   else
+   {
+      if (value.empty() || value.size() > 10 || value.find_first_not_of("0123456789") != std::string::npos ||
+          std::stoull(value) > std::numeric_limits<uint32_t>::max())
+         return false;
+      bound = static_cast<uint32_t>(std::stoull(value));
+      is_time = bound >= LOCKTIME_THRESHOLD;
+   }
+   if (is_time)
+      (upper ? filter.to_time : filter.from_time) = bound;
+   else
+      (upper ? filter.to_height : filter.from_height) = bound;
+   return true;
 }
 
 void print_usage()
 {
    std::cout << "Usage:" << std::endl;
-   std::cout << "addr_parser [-m|-t|-r] [-p db_path] [-o output_file]" << std::endl;
+   std::cout << "addr_parser [-j threads] [-g grain] [--readahead depth] [--keep-cache] [-b buffer_mb] [-n buffers] [-d] [-f format [-z level] [-k compress_threads]] [--from bound] [--to bound] [--chain-order confirmations] [-i] [[-m|-t|-r] -p db_path [-o output_file]] ..." << std::endl;
+   std::cout << "addr_parser [-m|-t|-r] [-i|-u [-s spill_file]] [--chain-order confirmations] [--readahead depth] [--keep-cache] [-b buffer_mb] [-n buffers] [-d] [-f format [-z level] [-k compress_threads]] [-p db_path] [-o output_file]" << std::endl;
+   std::cout << "addr_parser [-m|-t|-r] -x index_file [-j threads] [--readahead depth] [--keep-cache] [-p db_path]" << std::endl;
+   std::cout << "addr_parser [-m|-t|-r] -c [-z level] [--chain-order confirmations] [--readahead depth] [--keep-cache] [-p db_path] [-o output_file]" << std::endl;
+   std::cout << "addr_parser [-m|-t|-r] -w|--watch watch_file [--from bound] [--to bound] [--chain-order confirmations] [--readahead depth] [--keep-cache] [-p db_path] [-o output_file]" << std::endl;
+   std::cout << "addr_parser [-m|-t|-r] -a [-j threads] [--memory mb] [--from bound] [--to bound] [--readahead depth] [--keep-cache] [-b buffer_mb] [-n buffers] [-d] [-f format [-z level] [-k compress_threads]] [-p db_path] [-o output_file]" << std::endl;
    std::cout << "where" << std::endl;
    std::cout << "-m - parse BTC mainnet data, default option" << std::endl;
    std::cout << "-t - parse BTC testnet data" << std::endl;
    std::cout << "-r - parse BTC regtest data" << std::endl;
+   std::cout << "-i - write txid:vout of the output after each address" << std::endl;
+   std::cout << "-u - build the UTXO set from the blocks in chain order and write final \"address balance\" lines instead of the address list, a bare multisig output is credited to the address of its first key;" << std::endl;
+   std::cout << "     confirmations is 6 unless given" << std::endl;
+   std::cout << "spill_file - file to map the UTXO set to when RAM is short, removed on exit" << std::endl;
+   std::cout << "index_file - build the address index to query with addr_lookup instead of the address list" << std::endl;
+   std::cout << "-a - write \"address first_height last_height outputs received\" lines, one for every address, instead of the address list" << std::endl;
+   std::cout << "mb - memory of the address tables of -a in MB, beyond it they are spilled to run files next to the output file, default 1024" << std::endl;
+   std::cout << "threads - number of block files parsed in parallel while building the index or the address statistics, or of threads parsing the address lists in chunks of the block files, default is the number of CPUs" << std::endl;
+   std::cout << "grain - most transactions of a block formatted by one task of the threads parsing the address lists, default 256" << std::endl;
+   std::cout << "depth - number of block files after the one being parsed that the kernel reads into the page cache in the background, default 2" << std::endl;
+   std::cout << "--keep-cache - keep the block files read in the page cache; by default their pages are dropped unless they were cached before" << std::endl;
+   std::cout << "buffer_mb - size of the output buffers in MB, default 4" << std::endl;
+   std::cout << "buffers - number of output buffers, full buffers are written by a background thread, default 4" << std::endl;
+   std::cout << "-d - write the output with O_DIRECT, bypassing the page cache, not used for compressed output" << std::endl;
+   std::cout << "format - compress the output as zstd or lz4 frames of at most one buffer and one block file, with a seek table at the end;" << std::endl;
+   std::cout << "         .zst or .lz4 is appended to the output file names" << std::endl;
+   std::cout << "compress_threads - number of threads compressing the output, default is half the number of CPUs" << std::endl;
+   std::cout << "bound - first (--from) or last (--to) block to parse: a height, a UNIX time from 500000000 on or a YYYY-MM-DD date in UTC;" << std::endl;
+   std::cout << "        a height range reads the block headers of the directory first, block files without blocks in the range are skipped" << std::endl;
+   std::cout << "confirmations - read only the blocks of the chain with the most work, in height order, each once this many blocks are" << std::endl;
+   std::cout << "                on top of it; blocks out of order are buffered, blocks of stale branches are dropped, the block files" << std::endl;
+   std::cout << "                are read by one thread" << std::endl;
+   std::cout << "-c - write block position, txid, vout, type, witness version, program and value of the outputs as a columnar file" << std::endl;
+   std::cout << "level - zstd compression level of the columns, default is no compression, or the compression level of the output" << std::endl;
+   std::cout << "        format, default is the default level of the format" << std::endl;
+   std::cout << "watch_file - addresses to watch, one per line; only outputs paying to them are written as \"address txid:vout blk_file:offset\" lines" << std::endl;
    std::cout << "db_path - path to the directory with block files (e.g. ${HOME}/.bitcoin/blocks),  default value is current directory" << std::endl;
-   std::cout << "output_file - file to write parsed addresses, default value addresses.txt" << std::endl;
+   std::cout << "output_file - file to write parsed addresses, default value addresses.txt; output_file:shards, up to 256 shards," << std::endl;
+   std::cout << "              partitions the address list by the address hash into output files like addresses.<k>.txt sharing" << std::endl;
+   std::cout << "              the buffer size" << std::endl;
+   std::cout << "The address list of several directories is written in one run: a network option applies to the directories" << std::endl;
+   std::cout << "given after it, an output file to the directory given before it, every directory needs its own output file" << std::endl;
 }
 
 int main(int argc, char* argv[])
 {
-   std::string db_path;
-   std::string out_file = "addresses.txt";
-   char c;
-   bool option_found = false;
+   std::vector<parse_job_t> jobs(1);
+   bool db_path_set = false;
+   network_t network = network_t::mainnet;
+   int c;
+   bool with_outpoints = false;
+   bool with_balances = false;
+   std::string spill_file;
+   std::string index_file;
+   bool columnar = false;
+   int zstd_level = 0;
+   std::string watch_file;
+   bool with_stats = false;
+   size_t stats_memory = size_t(1024) << 20;
+   bool stats_memory_set = false;
+   unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+   size_t grain = 256;
+   input_options_t input;
+   output_options_t output;
+   block_filter_t range;
 
-   while ((c = getopt(argc, argv, "mtrp:o:?")) != -1)
+   enum { OPT_FROM = 256, OPT_TO, OPT_READAHEAD, OPT_KEEP_CACHE, OPT_MEMORY, OPT_CHAIN_ORDER };
+   static const struct option long_options[] = {
+      {"from", required_argument, nullptr, OPT_FROM},
+      {"to", required_argument, nullptr, OPT_TO},
+      {"readahead", required_argument, nullptr, OPT_READAHEAD},
+      {"keep-cache", no_argument, nullptr, OPT_KEEP_CACHE},
+      {"memory", required_argument, nullptr, OPT_MEMORY},
+      {"chain-order", required_argument, nullptr, OPT_CHAIN_ORDER},
+      {"watch", required_argument, nullptr, 'w'},
+      {nullptr, 0, nullptr, 0}
+   };
+   while ((c = getopt_long(argc, argv, "mtriuacdp:o:s:x:j:g:b:n:f:k:z:w:?", long_options, nullptr)) != -1)
    {
      switch (c)
      {
          case 'm':
-            btc_utils::g_network = btc_utils::network_t::mainnet;
+            network = network_t::mainnet;
+            break;
+         case OPT_FROM:
+         case OPT_TO:
+            if (!optarg || !ParseRangeBound(optarg, c == OPT_TO, range))
+            {
+               std::cout << (c == OPT_TO ? "to" : "from") << " option requires a height, a UNIX time or a YYYY-MM-DD date" << std::endl;
+               print_usage();
+               return 1;
+            }
+            break;
+         case OPT_READAHEAD:
+            if (!optarg || !*optarg || strspn(optarg, "0123456789") != strlen(optarg) || atoi(optarg) > 64)
+            {
+               std::cout << "readahead option requires argument from 0 to 64" << std::endl;
+               print_usage();
+               return 1;
+            }
+            input.readahead = static_cast<unsigned int>(atoi(optarg));
+            break;
+         case OPT_KEEP_CACHE:
+            input.drop_cache = false;
+            break;
+         case OPT_CHAIN_ORDER:
+            if (!optarg || !*optarg || strspn(optarg, "0123456789") != strlen(optarg) || atoi(optarg) > 1000)
+            {
+               std::cout << "chain-order option requires argument from 0 to 1000" << std::endl;
+               print_usage();
+               return 1;
+            }
+            input.chain_order = true;
+            input.chain_depth = static_cast<unsigned int>(atoi(optarg));
+            break;
+         case OPT_MEMORY:
+            if (!optarg || atoi(optarg) <= 0)
+            {
+               std::cout << "memory option requires positive argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            stats_memory = static_cast<size_t>(atoi(optarg)) << 20;
+            stats_memory_set = true;
             break;
          case 't':
-            btc_utils::g_network = btc_utils::network_t::testnet;
+            network = network_t::testnet;
             break;
          case 'r':
-            btc_utils::g_network = btc_utils::network_t::regtest;
+            network = network_t::regtest;
+            break;
+         case 'i':
+            with_outpoints = true;
+            break;
+         case 'u':
+            with_balances = true;
+            break;
+         case 'a':
+            with_stats = true;
+            break;
+         case 's':
+            if (!optarg)
+            {
+               std::cout << "s option requires argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            spill_file = optarg;
+            break;
+         case 'c':
+            columnar = true;
+            break;
+         case 'z':
+            if (!optarg || atoi(optarg) <= 0)
+            {
+               std::cout << "z option requires positive argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            zstd_level = atoi(optarg);
+            break;
+         case 'w':
+            if (!optarg)
+            {
+               std::cout << "w option requires argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            watch_file = optarg;
+            break;
+         case 'x':
+            if (!optarg)
+            {
+               std::cout << "x option requires argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            index_file = optarg;
+            break;
+         case 'j':
+            if (!optarg || atoi(optarg) <= 0)
+            {
+               std::cout << "j option requires positive argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            threads = static_cast<unsigned int>(atoi(optarg));
+            break;
+         case 'b':
+            if (!optarg || atoi(optarg) <= 0)
+            {
+               std::cout << "b option requires positive argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            output.buffer_size = static_cast<size_t>(atoi(optarg)) << 20;
+            break;
+         case 'n':
+            if (!optarg || atoi(optarg) < 2)
+            {
+               std::cout << "n option requires argument of at least 2" << std::endl;
+               print_usage();
+               return 1;
+            }
+            output.buffers = static_cast<size_t>(atoi(optarg));
+            break;
+         case 'd':
+            output.direct = true;
+            break;
+         case 'f':
+            if (!optarg || (strcmp(optarg, "zstd") != 0 && strcmp(optarg, "lz4") != 0))
+            {
+               std::cout << "f option requires zstd or lz4 argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            output.format = strcmp(optarg, "zstd") == 0 ? OUTPUT_ZSTD : OUTPUT_LZ4;
+            if (!output_format_supported(output.format))
+            {
+               std::cout << "addr_parser is built without " << optarg << std::endl;
+               return 1;
+            }
+            break;
+         case 'k':
+            if (!optarg || atoi(optarg) <= 0)
+            {
+               std::cout << "k option requires positive argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            output.compress_threads = static_cast<unsigned int>(atoi(optarg));
+            break;
+         case 'g':
+            if (!optarg || atoi(optarg) <= 0)
+            {
+               std::cout << "g option requires positive argument" << std::endl;
+               print_usage();
+               return 1;
+            }
+            grain = static_cast<size_t>(atoi(optarg));
             break;
          case 'p':
             if (!optarg)
@@ -390,7 +1209,11 @@ int main(int argc, char* argv[])
                print_usage();
                return 1;
             }
-            db_path = optarg;
+            if (db_path_set)
+               jobs.emplace_back();
+            db_path_set = true;
+            jobs.back().db_path = optarg;
+            jobs.back().network = network;
             break;
          case 'o':
            if (!optarg)
@@ -399,7 +1222,25 @@ int main(int argc, char* argv[])
               print_usage();
               return 1;
            }
-            out_file = optarg;
+            jobs.back().out_file = optarg;
+            jobs.back().shards = 1;
+            {
+               // a shard count after the output file name
+               std::string arg = optarg;
+               size_t colon = arg.find_last_of(':');
+               std::string count = colon == std::string::npos ? std::string() : arg.substr(colon + 1);
+               if (colon > 0 && !count.empty() && count.find_first_not_of("0123456789") == std::string::npos)
+               {
+                  if (count.size() > 3 || atoi(count.c_str()) <= 0 || atoi(count.c_str()) > int(MAX_SHARDS))
+                  {
+                     std::cout << "o option requires shard count from 1 to " << MAX_SHARDS << std::endl;
+                     print_usage();
+                     return 1;
+                  }
+                  jobs.back().shards = static_cast<unsigned int>(atoi(count.c_str()));
+                  jobs.back().out_file = arg.substr(0, colon);
+               }
+            }
             break;
          case '?':
             print_usage();
@@ -409,32 +1250,102 @@ int main(int argc, char* argv[])
             return 1;
       }
    }
-   if (optind < argc)
+   // with a single directory the network option may also follow it
+   if (jobs.size() == 1)
+      jobs[0].network = network;
+   if (output.format != OUTPUT_PLAIN)
+   {
+      output.level = zstd_level;
+      std::string extension = output.format == OUTPUT_ZSTD ? ".zst" : ".lz4";
+      for (auto& job: jobs)
+         if (job.out_file.size() < extension.size() ||
+             job.out_file.compare(job.out_file.size() - extension.size(), extension.size(), extension) != 0)
+            job.out_file += extension;
+   }
+   std::set<std::string> out_files;
+   size_t shards = 0;
+   for (const auto& job: jobs)
+      for (unsigned int shard = 0; shard < job.shards; shard++, shards++)
+         out_files.insert(job.shard_file(shard));
+   if (optind < argc || (!spill_file.empty() && !with_balances) || (stats_memory_set && !with_stats) ||
+       (!index_file.empty() && (with_balances || with_outpoints || columnar)) ||
+       (columnar && (with_balances || with_outpoints)) || (with_balances && with_outpoints) || (zstd_level && !columnar && output.format == OUTPUT_PLAIN) ||
+       (output.format != OUTPUT_PLAIN && (columnar || !index_file.empty())) ||
+       (!watch_file.empty() && (with_balances || with_outpoints || columnar || !index_file.empty())) ||
+       (jobs.size() > 1 && (with_balances || columnar || !index_file.empty() || !watch_file.empty())) ||
+       (shards > jobs.size() && (with_balances || columnar || !index_file.empty() || !watch_file.empty())) ||
+       (range.active() && (with_balances || columnar || !index_file.empty())) ||
+       (input.chain_order && (with_stats || !index_file.empty())) ||
+       (with_stats && (with_balances || with_outpoints || columnar || !index_file.empty() || !watch_file.empty() ||
+                       jobs.size() > 1 || shards > jobs.size())) ||
+       out_files.size() != shards)
    {
       print_usage();
       return 1;
    }
-
-   unsigned int nFile = 0;
-   int blocks = 0;
-   FILE* out = fopen(out_file.c_str(), "w");
-   if (!out) {
-       log_printf("Error: Unable to open file %s\n", out_file);
-       return 1;
+   if (!index_file.empty())
+   {
+      int res = BuildAddressIndex(jobs[0], index_file, threads, input);
+      log_printf("Processing finished");
+      return res;
    }
-   while (true) {
-       std::string block_file = compose_block_file_path(db_path, nFile);
-       FILE* file = fopen(block_file.c_str(), "rb");
-       if (!file) {
-           log_printf("Error: Unable to open file %s\n", block_file.c_str());
-           break;
+   if (columnar)
+   {
+      int res = WriteColumnarFile(jobs[0], zstd_level, input);
+      log_printf("Processing finished");
+      return res;
+   }
+   if (with_stats)
+   {
+      int res = WriteAddressStats(jobs[0], threads, stats_memory, input, output, range);
+      log_printf("Processing finished");
+      return res;
+   }
+   std::unique_ptr<watchlist_t> watchlist;
+   if (!watch_file.empty())
+   {
+       try {
+           size_t invalid = 0;
+           watchlist.reset(new watchlist_t(watchlist_t::load(watch_file, jobs[0].network, invalid)));
+           log_printf("Watching %u addresses, %u invalid lines skipped, %u bytes", watchlist->size(),
+                      invalid, watchlist->memory_usage());
+       } catch (const std::exception& e) {
+           log_printf("Error: %s", e.what());
+           return 1;
        }
-       log_printf("Processing block file blk%05u.dat...", nFile);
-       ParseBlockFile(file, blocks, out);
-       nFile++;
-       fflush(out);
    }
-   fclose(out);
+   if (jobs.size() > 1)
+      for (auto& job: jobs)
+         job.label = strprintf("%s (%s): ", job.db_path, get_network_name(job.network));
+
+   // with several threads the address lists of all directories are parsed by the tasks of one
+   // scheduler, a thread per directory writes its output; the public key cache is shared by all
+   std::unique_ptr<task_scheduler_t> scheduler;
+   if (threads > 1 && !with_balances && !watchlist && !input.chain_order)
+      scheduler.reset(new task_scheduler_t(threads));
+   std::atomic<int> res(0);
+   auto parse = [&](const parse_job_t& job) {
+      if (ParseBlockDirectory(job, with_outpoints, with_balances, spill_file, watchlist.get(), scheduler.get(), grain,
+                              input, output, range))
+         res = 1;
+   };
+   if (scheduler)
+   {
+      std::vector<std::thread> writers;
+      for (const auto& job: jobs)
+         writers.emplace_back(parse, std::cref(job));
+      for (auto& thread: writers)
+         thread.join();
+      log_printf("Scheduler: %u tasks, %u stolen", scheduler->executed(), scheduler->steals());
+   }
+   else
+   {
+      for (const auto& job: jobs)
+         parse(job);
+   }
+   if (!with_balances && !watchlist)
+      log_printf("Public key cache: %u hits, %u misses, %u MB", g_pub_key_cache.hits(),
+                 g_pub_key_cache.misses(), g_pub_key_cache.memory_usage() >> 20);
    log_printf("Processing finished");
-   return 0;
+   return res;
 }
@@ -6,6 +6,10 @@
 #include <address.h>
 #include <chainparams.h>
 #include <bech32.h>
+#include <pub_key_cache.h>
+#include <transaction.h>
+
+#include <cstring>
 
 namespace btc_utils
 {
@@ -24,7 +28,7 @@ std::string encode_destination(const pk_hash_tx_destination_t& dest)
 
 std::string encode_destination(const script_hash_tx_destination_t& dest)
 {
-   std::vector<unsigned char> data = base_58_pubkey_address_prefix();
+   std::vector<unsigned char> data = base_58_script_address_prefix();
    data.insert(data.end(), dest.data_.begin(), dest.data_.end());
    return encode_base58_check(data);
 }
@@ -37,7 +41,7 @@ std::string encode_destination(const witness_v0_key_hash_tx_destination_t& dest)
             [&data](unsigned char c){ data.push_back(c); },
             dest.data_.begin(), dest.data_.end()
    );
-   return bech32::Encode(bech32_hrp(), data);
+   return bech32::Encode(bech32::Encoding::BECH32, bech32_hrp(), data);
 }
 
 std::string encode_destination(const witness_v0_script_hash_tx_destination_t& dest)
@@ -47,7 +51,17 @@ std::string encode_destination(const witness_v0_script_hash_tx_destination_t& de
    ConvertBits<8, 5, true>(
             [&data](unsigned char c) { data.push_back(c); },
             dest.data_.begin(), dest.data_.end());
-   return bech32::Encode(bech32_hrp(), data);
+   return bech32::Encode(bech32::Encoding::BECH32, bech32_hrp(), data);
+}
+
+std::string encode_destination(const witness_v1_taproot_tx_destination_t& dest)
+{
+   std::vector<unsigned char> data = {1};
+   data.reserve(53);
+   ConvertBits<8, 5, true>(
+            [&data](unsigned char c) { data.push_back(c); },
+            dest.data_.begin(), dest.data_.end());
+   return bech32::Encode(bech32::Encoding::BECH32M, bech32_hrp(), data);
 }
 
 std::string encode_destination(const witness_unknown_tx_destination_t& dest)
@@ -60,7 +74,306 @@ std::string encode_destination(const witness_unknown_tx_destination_t& dest)
    ConvertBits<8, 5, true>(
             [&data](unsigned char c) { data.push_back(c); },
             dest.program_.data(), dest.program_.data() + dest.length_);
-   return bech32::Encode(bech32_hrp(), data);
+   return bech32::Encode(bech32::Encoding::BECH32M, bech32_hrp(), data);
+}
+
+std::vector<tx_destination_t> extract_destinations(const std::vector<unsigned char>& script)
+{
+   std::vector<tx_destination_t> res;
+   tx_destination_t dest;
+   dest.version_ = 0;
+
+   // the keys of bare multisig outputs are hashed straight from the script
+   multisig_keys_t multisig;
+   if (match_multisig(script, multisig))
+   {
+       dest.type_ = TX_MULTISIG;
+       dest.length_ = 20;
+       res.reserve(multisig.count);
+       for (unsigned int i = 0; i < multisig.count; i++)
+       {
+           key_id_t id = g_pub_key_cache.get_id(multisig.keys[i], multisig.sizes[i]);
+           std::copy(id.begin(), id.end(), dest.program_.begin());
+           res.push_back(dest);
+       }
+       return res;
+   }
+
+   std::vector<std::vector<unsigned char>> keys;
+   txnouttype out_type = solver(script, keys);
+   dest.type_ = out_type;
+   if (out_type == TX_PUBKEY)
+   {
+       key_id_t id = g_pub_key_cache.get_id(keys[0].data(), keys[0].size());
+       dest.length_ = static_cast<unsigned char>(id.size());
+       std::copy(id.begin(), id.end(), dest.program_.begin());
+       res.push_back(dest);
+   }
+   else if (out_type == TX_PUBKEYHASH || out_type == TX_SCRIPTHASH ||
+            out_type == TX_WITNESS_V0_KEYHASH || out_type == TX_WITNESS_V0_SCRIPTHASH)
+   {
+       dest.length_ = static_cast<unsigned char>(keys[0].size());
+       std::copy(keys[0].begin(), keys[0].end(), dest.program_.begin());
+       res.push_back(dest);
+   }
+   else if (out_type == TX_WITNESS_V1_TAPROOT)
+   {
+       dest.version_ = 1;
+       dest.length_ = static_cast<unsigned char>(keys[0].size());
+       std::copy(keys[0].begin(), keys[0].end(), dest.program_.begin());
+       res.push_back(dest);
+   }
+   else if (out_type == TX_WITNESS_UNKNOWN)
+   {
+       dest.version_ = keys[0][0];
+       dest.length_ = static_cast<unsigned char>(keys[1].size());
+       std::copy(keys[1].begin(), keys[1].end(), dest.program_.begin());
+       res.push_back(dest);
+   }
+   return res;
+}
+
+void destination_batch_t::assign(const transaction_t* begin, const transaction_t* end)
+{
+   scripts_.clear();
+   sizes_.clear();
+   for (const transaction_t* tx = begin; tx != end; ++tx)
+      for (const auto& out: tx->vout)
+      {
+         scripts_.push_back(out.scriptPubKey.data());
+         sizes_.push_back(static_cast<uint32_t>(out.scriptPubKey.size()));
+      }
+   size_t count = scripts_.size();
+   types_.resize(count);
+   classify_scripts(scripts_.data(), sizes_.data(), count, types_.data());
+
+   // a slot for every template output, what the solver finds for the others
+   offsets_.resize(count + 1);
+   dests_.clear();
+   for (auto& outputs: outputs_)
+      outputs.clear();
+   size_t i = 0;
+   for (const transaction_t* tx = begin; tx != end; ++tx)
+      for (const auto& out: tx->vout)
+      {
+         offsets_[i] = static_cast<uint32_t>(dests_.size());
+         txnouttype type = types_[i];
+         if (type == TX_PUBKEY && !pub_key_t::valid_size(scripts_[i] + 1, sizes_[i] - 2))
+            type = TX_NONSTANDARD;
+         if (type != TX_NONSTANDARD)
+         {
+            outputs_[type].push_back(static_cast<uint32_t>(i));
+            dests_.emplace_back();
+         }
+         else
+         {
+            for (const auto& dest: extract_destinations(out.scriptPubKey))
+               dests_.push_back(dest);
+         }
+         i++;
+      }
+   offsets_[count] = static_cast<uint32_t>(dests_.size());
+
+   decode_programs<3, 20>(TX_PUBKEYHASH, 0);
+   decode_programs<2, 20>(TX_SCRIPTHASH, 0);
+   decode_programs<2, 20>(TX_WITNESS_V0_KEYHASH, 0);
+   decode_programs<2, 32>(TX_WITNESS_V0_SCRIPTHASH, 0);
+   decode_programs<2, 32>(TX_WITNESS_V1_TAPROOT, 1);
+   for (uint32_t output: outputs_[TX_PUBKEY])
+   {
+      tx_destination_t& dest = dests_[offsets_[output]];
+      key_id_t id = g_pub_key_cache.get_id(scripts_[output] + 1, sizes_[output] - 2);
+      dest.type_ = TX_PUBKEY;
+      dest.version_ = 0;
+      dest.length_ = static_cast<unsigned char>(id.size());
+      std::copy(id.begin(), id.end(), dest.program_.begin());
+   }
+}
+
+//! the hash or witness program of the template outputs of the type is LENGTH bytes at OFFSET of the script
+template<size_t OFFSET, size_t LENGTH>
+void destination_batch_t::decode_programs(txnouttype type, unsigned char version)
+{
+   for (uint32_t output: outputs_[type])
+   {
+      tx_destination_t& dest = dests_[offsets_[output]];
+      dest.type_ = type;
+      dest.version_ = version;
+      dest.length_ = LENGTH;
+      memcpy(dest.program_.data(), scripts_[output] + OFFSET, LENGTH);
+   }
+}
+
+namespace
+{
+
+template<typename Params>
+size_t encode_base58_destination(unsigned char prefix, const tx_destination_t& dest, char* out)
+{
+   unsigned char payload[21];
+   payload[0] = prefix;
+   std::copy(dest.program_.begin(), dest.program_.begin() + 20, payload + 1);
+   return encode_base58_check(payload, sizeof(payload), out);
+}
+
+template<typename Params>
+size_t encode_witness_destination(bech32::Encoding encoding, const tx_destination_t& dest, char* out)
+{
+   uint8_t values[1 + (40 * 8 + 4) / 5];
+   size_t size = 0;
+   values[size++] = dest.version_;
+   ConvertBits<8, 5, true>([&values, &size](unsigned char c) { values[size++] = c; },
+                           dest.program_.begin(), dest.program_.begin() + dest.length_);
+   return bech32::Encode(encoding, Params::BECH32_HRP, Params::BECH32_HRP_STATE, values, size, out);
+}
+
+}
+
+template<typename Params>
+size_t encode_destination(const tx_destination_t& dest, char* out)
+{
+   switch (dest.type_)
+   {
+   case TX_PUBKEY:
+   case TX_PUBKEYHASH:
+   case TX_MULTISIG:
+       return encode_base58_destination<Params>(Params::PUBKEY_ADDRESS_PREFIX, dest, out);
+   case TX_SCRIPTHASH:
+       return encode_base58_destination<Params>(Params::SCRIPT_ADDRESS_PREFIX, dest, out);
+   case TX_WITNESS_V0_KEYHASH:
+   case TX_WITNESS_V0_SCRIPTHASH:
+       return encode_witness_destination<Params>(bech32::Encoding::BECH32, dest, out);
+   case TX_WITNESS_V1_TAPROOT:
+   case TX_WITNESS_UNKNOWN:
+       if (dest.version_ < 1 || dest.version_ > 16 || dest.length_ < 2 || dest.length_ > 40)
+           return 0;
+       return encode_witness_destination<Params>(bech32::Encoding::BECH32M, dest, out);
+   default:
+       return 0;
+   }
+}
+
+template size_t encode_destination<mainnet_params_t>(const tx_destination_t& dest, char* out);
+template size_t encode_destination<testnet_params_t>(const tx_destination_t& dest, char* out);
+template size_t encode_destination<regtest_params_t>(const tx_destination_t& dest, char* out);
+
+std::string encode_destination(const tx_destination_t& dest, network_t network)
+{
+   char buf[MAX_ADDRESS_SIZE];
+   size_t len = with_network_params(network, [&dest, &buf](auto params) {
+      return encode_destination<decltype(params)>(dest, buf);
+   });
+   return std::string(buf, len);
+}
+
+address_key_t::address_key_t(const tx_destination_t& dest)
+{
+   if (dest.type_ == TX_PUBKEY || dest.type_ == TX_PUBKEYHASH || dest.type_ == TX_MULTISIG)
+      data_[0] = 0;
+   else if (dest.type_ == TX_SCRIPTHASH)
+      data_[0] = 1;
+   else
+      data_[0] = static_cast<unsigned char>(2 + dest.version_);
+   len_ = static_cast<unsigned char>(dest.length_ + 1);
+   std::copy(dest.program_.begin(), dest.program_.begin() + dest.length_, data_.begin() + 1);
+}
+
+tx_destination_t address_key_t::destination() const
+{
+   tx_destination_t dest;
+   dest.version_ = 0;
+   dest.length_ = static_cast<unsigned char>(len_ - 1);
+   std::copy(data_.begin() + 1, data_.begin() + len_, dest.program_.begin());
+   if (data_[0] == 0)
+      dest.type_ = TX_PUBKEYHASH;
+   else if (data_[0] == 1)
+      dest.type_ = TX_SCRIPTHASH;
+   else
+   {
+      dest.version_ = static_cast<unsigned char>(data_[0] - 2);
+      if (dest.version_ == 0 && dest.length_ == 20)
+         dest.type_ = TX_WITNESS_V0_KEYHASH;
+      else if (dest.version_ == 0 && dest.length_ == 32)
+         dest.type_ = TX_WITNESS_V0_SCRIPTHASH;
+      else if (dest.version_ == 1 && dest.length_ == 32)
+         dest.type_ = TX_WITNESS_V1_TAPROOT;
+      else
+         dest.type_ = TX_WITNESS_UNKNOWN;
+   }
+   return dest;
+}
+
+uint64_t address_key_t::hash() const
+{
+   // FNV-1a with a final avalanche, so the top bits are usable too
+   uint64_t h = 0xcbf29ce484222325ULL;
+   for (size_t i = 0; i < len_; i++)
+      h = (h ^ data_[i]) * 0x100000001b3ULL;
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   return h;
+}
+
+bool address_key_t::operator==(const address_key_t& other) const
+{
+   return len_ == other.len_ && memcmp(data_.data(), other.data_.data(), len_) == 0;
+}
+
+bool address_key_t::operator<(const address_key_t& other) const
+{
+   if (len_ != other.len_)
+      return len_ < other.len_;
+   return memcmp(data_.data(), other.data_.data(), len_) < 0;
+}
+
+bool decode_destination(const std::string& address, tx_destination_t& dest, network_t network)
+{
+   dest.version_ = 0;
+   std::vector<unsigned char> data;
+   if (decode_base58_check(address, data))
+   {
+       std::vector<unsigned char> pubkey_prefix = base_58_pubkey_address_prefix(network);
+       std::vector<unsigned char> script_prefix = base_58_script_address_prefix(network);
+       if (data.size() == 20 + pubkey_prefix.size() &&
+           std::equal(pubkey_prefix.begin(), pubkey_prefix.end(), data.begin()))
+           dest.type_ = TX_PUBKEYHASH;
+       else if (data.size() == 20 + script_prefix.size() &&
+                std::equal(script_prefix.begin(), script_prefix.end(), data.begin()))
+           dest.type_ = TX_SCRIPTHASH;
+       else
+           return false;
+       dest.length_ = 20;
+       std::copy(data.end() - 20, data.end(), dest.program_.begin());
+       return true;
+   }
+
+   auto bech = bech32::Decode(address);
+   if (bech.hrp != bech32_hrp(network) || bech.data.empty() || bech.data[0] > 16)
+       return false;
+   // witness v0 uses bech32, later versions bech32m
+   if (bech.encoding != (bech.data[0] == 0 ? bech32::Encoding::BECH32 : bech32::Encoding::BECH32M))
+       return false;
+   std::vector<unsigned char> program;
+   if (!ConvertBits<5, 8, false>([&program](unsigned char c) { program.push_back(c); },
+                                 bech.data.begin() + 1, bech.data.end()))
+       return false;
+   if (program.size() < 2 || program.size() > 40)
+       return false;
+   dest.version_ = bech.data[0];
+   if (dest.version_ == 0 && program.size() == 20)
+       dest.type_ = TX_WITNESS_V0_KEYHASH;
+   else if (dest.version_ == 0 && program.size() == 32)
+       dest.type_ = TX_WITNESS_V0_SCRIPTHASH;
+   else if (dest.version_ == 1 && program.size() == 32)
+       dest.type_ = TX_WITNESS_V1_TAPROOT;
+   else if (dest.version_ != 0)
+       dest.type_ = TX_WITNESS_UNKNOWN;
+   else
+       return false;
+   dest.length_ = static_cast<unsigned char>(program.size());
+   std::copy(program.begin(), program.end(), dest.program_.begin());
+   return true;
 }
 
 }
@@ -0,0 +1,93 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <address_balances.h>
+
+#include <cstring>
+
+namespace btc_utils
+{
+
+address_balances_t::address_balances_t(const std::string& spill_path)
+   : utxos_(spill_path), slots_(1u << 16, EMPTY), added_(0), spent_(0), missing_(0), shared_(0)
+{
+}
+
+address_key_t address_balances_t::key(uint32_t id) const
+{
+   address_key_t key;
+   const unsigned char* data = &arena_[offsets_[id]];
+   key.len_ = data[0];
+   memcpy(key.data_.data(), data + 1, key.len_);
+   return key;
+}
+
+bool address_balances_t::equal(uint32_t id, const address_key_t& key) const
+{
+   const unsigned char* data = &arena_[offsets_[id]];
+   return data[0] == key.len_ && memcmp(data + 1, key.data_.data(), key.len_) == 0;
+}
+
+uint32_t address_balances_t::owner(const address_key_t& key)
+{
+   size_t mask = slots_.size() - 1;
+   size_t i = static_cast<size_t>(key.hash()) & mask;
+   for (; slots_[i] != EMPTY; i = (i + 1) & mask) {
+      if (equal(slots_[i], key))
+         return slots_[i];
+   }
+   uint32_t id = static_cast<uint32_t>(offsets_.size());
+   if (id == EMPTY)
+      throw std::runtime_error("Too many addresses for the balances");
+   offsets_.push_back(arena_.size());
+   arena_.push_back(key.len_);
+   arena_.insert(arena_.end(), key.data_.begin(), key.data_.begin() + key.len_);
+   slots_[i] = id;
+   if (offsets_.size() * 4 > slots_.size() * 3)
+      grow();
+   return id;
+}
+
+void address_balances_t::grow()
+{
+   std::vector<uint32_t> slots(slots_.size() * 2, EMPTY);
+   size_t mask = slots.size() - 1;
+   for (uint32_t id = 0; id < offsets_.size(); id++) {
+      size_t i = static_cast<size_t>(key(id).hash()) & mask;
+      while (slots[i] != EMPTY)
+         i = (i + 1) & mask;
+      slots[i] = id;
+   }
+   slots_.swap(slots);
+}
+
+void address_balances_t::process(const transaction_t* begin, const transaction_t* end)
+{
+   dests_.assign(begin, end);
+   size_t output = 0;
+   for (const transaction_t* tx = begin; tx != end; tx++) {
+      for (const auto& in: tx->vin) {
+         if (in.prevout.n == 0xffffffff)
+            continue; // coinbase
+         utxo_t coin;
+         if (utxos_.spend(in.prevout, coin))
+            spent_++;
+         else
+            missing_++;
+      }
+      out_point_t outpoint;
+      outpoint.hash = tx->txid;
+      for (outpoint.n = 0; outpoint.n < tx->vout.size(); outpoint.n++) {
+         destination_range_t dests = dests_[output++];
+         if (dests.empty())
+            continue;
+         if (dests.last - dests.first > 1)
+            shared_++;
+         utxos_.add(outpoint, utxo_t{owner(address_key_t(*dests.first)), tx->vout[outpoint.n].nValue});
+         added_++;
+      }
+   }
+}
+
+}
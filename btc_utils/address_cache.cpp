@@ -0,0 +1,111 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <address_cache.h>
+#include <chainparams.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace btc_utils
+{
+
+address_cache_t::address_cache_t(size_t capacity) : hand_(0), hits_(), misses_()
+{
+   capacity = std::max<size_t>(capacity, 1);
+   size_t slots = 2;
+   while (slots < 2 * capacity)
+      slots <<= 1;
+   entries_.resize(capacity, entry_t{address_key_t(), 0, 0, false});
+   arena_.resize(capacity * MAX_ADDRESS_SIZE);
+   index_.resize(slots, EMPTY);
+}
+
+template<typename Params>
+std::string_view address_cache_t::encode(const tx_destination_t& dest)
+{
+   address_key_t key(dest);
+   uint64_t hash = key.hash();
+   size_t mask = index_.size() - 1;
+   for (size_t i = home(hash); index_[i] != EMPTY; i = (i + 1) & mask) {
+      entry_t& entry = entries_[index_[i]];
+      if (entry.hash == hash && entry.key == key) {
+         hits_[dest.type_]++;
+         entry.referenced = true;
+         return std::string_view(&arena_[index_[i] * MAX_ADDRESS_SIZE], entry.len);
+      }
+   }
+
+   misses_[dest.type_]++;
+   char address[MAX_ADDRESS_SIZE];
+   size_t len = encode_destination<Params>(dest, address);
+   if (len == 0)
+      return std::string_view();
+
+   // the clock hand clears reference bits until it finds an entry to replace
+   while (entries_[hand_].referenced) {
+      entries_[hand_].referenced = false;
+      hand_ = (hand_ + 1) % entries_.size();
+   }
+   uint32_t victim = static_cast<uint32_t>(hand_);
+   hand_ = (hand_ + 1) % entries_.size();
+   if (entries_[victim].len)
+      erase(victim);
+
+   entry_t& entry = entries_[victim];
+   entry.key = key;
+   entry.hash = hash;
+   entry.len = static_cast<unsigned char>(len);
+   entry.referenced = false;
+   char* slot = &arena_[victim * MAX_ADDRESS_SIZE];
+   memcpy(slot, address, len);
+   size_t i = home(hash);
+   while (index_[i] != EMPTY)
+      i = (i + 1) & mask;
+   index_[i] = victim;
+   return std::string_view(slot, entry.len);
+}
+
+template std::string_view address_cache_t::encode<mainnet_params_t>(const tx_destination_t& dest);
+template std::string_view address_cache_t::encode<testnet_params_t>(const tx_destination_t& dest);
+template std::string_view address_cache_t::encode<regtest_params_t>(const tx_destination_t& dest);
+
+std::string_view address_cache_t::encode(const tx_destination_t& dest, network_t network)
+{
+   return with_network_params(network, [this, &dest](auto params) {
+      return encode<decltype(params)>(dest);
+   });
+}
+
+void address_cache_t::erase(uint32_t entry)
+{
+   size_t mask = index_.size() - 1;
+   size_t i = home(entries_[entry].hash);
+   while (index_[i] != entry)
+      i = (i + 1) & mask;
+
+   // shift back the following entries of the cluster so lookups never
+   // need tombstones
+   size_t j = i;
+   while (true) {
+      j = (j + 1) & mask;
+      if (index_[j] == EMPTY)
+         break;
+      size_t k = home(entries_[index_[j]].hash);
+      // move slot j to the hole at i unless its home lies in (i, j]
+      if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+         index_[i] = index_[j];
+         i = j;
+      }
+   }
+   index_[i] = EMPTY;
+   entries_[entry].len = 0;
+}
+
+size_t address_cache_t::memory_usage() const
+{
+   return entries_.size() * sizeof(entry_t) + arena_.size() + index_.size() * sizeof(uint32_t);
+}
+
+}
@@ -0,0 +1,348 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <address_index.h>
+#include <coding.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace btc_utils
+{
+
+static const char INDEX_MAGIC[8] = {'B', 'T', 'C', 'A', 'D', 'I', 'X', '1'};
+static constexpr size_t HEADER_SIZE = 32;
+//! maximum number of runs merged at once, keeps the number of open files low
+static constexpr size_t MAX_MERGE_FANIN = 64;
+static constexpr size_t RUN_BUFFER_SIZE = 1 << 20;
+
+address_posting_t::address_posting_t(const tx_destination_t& dest, uint64_t block_pos)
+   : hash(0), pos(block_pos), key(dest)
+{
+   hash = key.hash();
+}
+
+bool address_posting_t::operator<(const address_posting_t& other) const
+{
+   if (hash != other.hash)
+      return hash < other.hash;
+   if (!(key == other.key))
+      return key < other.key;
+   return pos < other.pos;
+}
+
+bool address_posting_t::same_key(const address_posting_t& other) const
+{
+   return hash == other.hash && key == other.key;
+}
+
+namespace
+{
+
+typedef std::unique_ptr<FILE, decltype(&fclose)> file_ptr_t;
+
+file_ptr_t open_file(const std::string& path, const char* mode)
+{
+   file_ptr_t f(fopen(path.c_str(), mode), &fclose);
+   if (!f)
+      throw std::runtime_error("Unable to open file " + path);
+   setvbuf(f.get(), nullptr, _IOFBF, RUN_BUFFER_SIZE);
+   return f;
+}
+
+void write_posting(FILE* f, const address_posting_t& posting)
+{
+   unsigned char buf[17];
+   write_le64(buf, posting.hash);
+   write_le64(buf + 8, posting.pos);
+   buf[16] = posting.key.len_;
+   if (fwrite(buf, 1, sizeof(buf), f) != sizeof(buf) ||
+       fwrite(posting.key.data_.data(), 1, posting.key.len_, f) != posting.key.len_)
+      throw std::runtime_error("Unable to write address index run");
+}
+
+/** Sequential reader of a sorted run file */
+class run_reader_t
+{
+public:
+   explicit run_reader_t(const std::string& path) : file_(open_file(path, "rb")) {}
+
+   bool next(address_posting_t& posting)
+   {
+      unsigned char buf[17];
+      size_t n = fread(buf, 1, sizeof(buf), file_.get());
+      if (n == 0)
+         return false;
+      if (n != sizeof(buf) || buf[16] == 0 || buf[16] > posting.key.data_.size() ||
+          fread(posting.key.data_.data(), 1, buf[16], file_.get()) != buf[16])
+         throw std::runtime_error("Corrupted address index run");
+      posting.hash = read_le64(buf);
+      posting.pos = read_le64(buf + 8);
+      posting.key.len_ = buf[16];
+      return true;
+   }
+
+private:
+   file_ptr_t file_;
+};
+
+/** K-way merge of sorted runs */
+class run_merger_t
+{
+public:
+   explicit run_merger_t(const std::vector<std::string>& paths)
+   {
+      for (const auto& path: paths) {
+         readers_.emplace_back(new run_reader_t(path));
+         heads_.emplace_back();
+         if (readers_.back()->next(heads_.back()))
+            queue_.push(readers_.size() - 1);
+      }
+   }
+
+   bool next(address_posting_t& posting)
+   {
+      if (queue_.empty())
+         return false;
+      size_t i = queue_.top();
+      queue_.pop();
+      posting = heads_[i];
+      if (readers_[i]->next(heads_[i]))
+         queue_.push(i);
+      return true;
+   }
+
+private:
+   struct greater_t
+   {
+      const std::vector<address_posting_t>* heads;
+      bool operator()(size_t a, size_t b) const { return (*heads)[b] < (*heads)[a]; }
+   };
+
+   std::vector<std::unique_ptr<run_reader_t>> readers_;
+   std::vector<address_posting_t> heads_;
+   std::priority_queue<size_t, std::vector<size_t>, greater_t> queue_{greater_t{&heads_}};
+};
+
+void remove_runs(const std::vector<std::string>& runs)
+{
+   for (const auto& run: runs)
+      unlink(run.c_str());
+}
+
+} // namespace
+
+address_index_writer_t::address_index_writer_t(const std::string& path)
+   : path_(path), postings_(0), next_run_(0)
+{
+}
+
+address_index_writer_t::~address_index_writer_t()
+{
+   remove_runs(runs_);
+}
+
+std::string address_index_writer_t::run_path()
+{
+   std::lock_guard<std::mutex> lock(mutex_);
+   return path_ + ".run" + std::to_string(next_run_++);
+}
+
+void address_index_writer_t::add_run(std::vector<address_posting_t>& postings)
+{
+   std::sort(postings.begin(), postings.end());
+   postings.erase(std::unique(postings.begin(), postings.end(),
+                              [](const address_posting_t& a, const address_posting_t& b) {
+                                 return a.pos == b.pos && a.same_key(b);
+                              }),
+                  postings.end());
+   if (postings.empty())
+      return;
+   std::string path = run_path();
+   {
+      file_ptr_t f = open_file(path, "wb");
+      for (const auto& posting: postings)
+         write_posting(f.get(), posting);
+      if (fflush(f.get()) != 0)
+         throw std::runtime_error("Unable to write address index run");
+   }
+   std::lock_guard<std::mutex> lock(mutex_);
+   runs_.push_back(path);
+   postings_ += postings.size();
+}
+
+uint64_t address_index_writer_t::finish()
+{
+   // merge passes until the rest fits into a single merge
+   while (runs_.size() > MAX_MERGE_FANIN) {
+      std::vector<std::string> merged;
+      for (size_t i = 0; i < runs_.size(); i += MAX_MERGE_FANIN) {
+         std::vector<std::string> group(runs_.begin() + static_cast<long>(i),
+                                        runs_.begin() + static_cast<long>(std::min(i + MAX_MERGE_FANIN, runs_.size())));
+         std::string path = run_path();
+         {
+            run_merger_t merger(group);
+            file_ptr_t f = open_file(path, "wb");
+            address_posting_t posting;
+            while (merger.next(posting))
+               write_posting(f.get(), posting);
+            if (fflush(f.get()) != 0)
+               throw std::runtime_error("Unable to write address index run");
+         }
+         merged.push_back(path);
+         remove_runs(group);
+      }
+      runs_.swap(merged);
+   }
+
+   // about 8 postings per bucket, the table of the mainnet index stays below 512MB
+   unsigned int bits = 4;
+   while (bits < 26 && (uint64_t(1) << bits) < postings_ / 8)
+      bits++;
+   std::vector<uint64_t> table((size_t(1) << bits) + 1, 0);
+
+   file_ptr_t f = open_file(path_, "wb");
+   unsigned char header[HEADER_SIZE] = {};
+   if (fwrite(header, 1, sizeof(header), f.get()) != sizeof(header))
+      throw std::runtime_error("Unable to write address index " + path_);
+
+   run_merger_t merger(runs_);
+   uint64_t offset = HEADER_SIZE;
+   uint64_t keys = 0;
+   size_t next_bucket = 0;
+   std::vector<unsigned char> entry;
+   std::vector<unsigned char> positions;
+   address_posting_t posting;
+   bool more = merger.next(posting);
+   while (more) {
+      address_posting_t current = posting;
+      uint64_t count = 0;
+      uint64_t last = 0;
+      positions.clear();
+      do {
+         if (count == 0 || posting.pos != last) {
+            write_varint(positions, posting.pos - last);
+            last = posting.pos;
+            count++;
+         }
+         more = merger.next(posting);
+      } while (more && posting.same_key(current));
+
+      size_t bucket = static_cast<size_t>(current.hash >> (64 - bits));
+      while (next_bucket <= bucket)
+         table[next_bucket++] = offset;
+
+      entry.clear();
+      entry.push_back(current.key.len_);
+      entry.insert(entry.end(), current.key.data_.begin(), current.key.data_.begin() + current.key.len_);
+      std::vector<unsigned char> count_buf;
+      write_varint(count_buf, count);
+      write_varint(entry, count_buf.size() + positions.size());
+      entry.insert(entry.end(), count_buf.begin(), count_buf.end());
+      entry.insert(entry.end(), positions.begin(), positions.end());
+      if (fwrite(entry.data(), 1, entry.size(), f.get()) != entry.size())
+         throw std::runtime_error("Unable to write address index " + path_);
+      offset += entry.size();
+      keys++;
+   }
+   while (next_bucket < table.size())
+      table[next_bucket++] = offset;
+
+   std::vector<unsigned char> buf(table.size() * 8);
+   for (size_t i = 0; i < table.size(); i++)
+      write_le64(&buf[i * 8], table[i]);
+   if (fwrite(buf.data(), 1, buf.size(), f.get()) != buf.size())
+      throw std::runtime_error("Unable to write address index " + path_);
+
+   memcpy(header, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+   uint32_t le_bits = htole32(bits);
+   memcpy(header + 8, &le_bits, sizeof(le_bits));
+   write_le64(header + 16, keys);
+   write_le64(header + 24, offset);
+   if (fseek(f.get(), 0, SEEK_SET) != 0 ||
+       fwrite(header, 1, sizeof(header), f.get()) != sizeof(header) ||
+       fflush(f.get()) != 0)
+      throw std::runtime_error("Unable to write address index " + path_);
+
+   remove_runs(runs_);
+   runs_.clear();
+   return keys;
+}
+
+address_index_t::address_index_t(const std::string& path) : data_(nullptr), len_(0), bits_(0), keys_(0), table_(nullptr)
+{
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0)
+      throw std::runtime_error("Unable to open address index " + path);
+   struct stat st;
+   void* mem = MAP_FAILED;
+   if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(HEADER_SIZE)) {
+      len_ = static_cast<size_t>(st.st_size);
+      mem = mmap(nullptr, len_, PROT_READ, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if (mem == MAP_FAILED)
+      throw std::runtime_error("Unable to map address index " + path);
+   data_ = static_cast<const unsigned char*>(mem);
+
+   uint32_t le_bits;
+   memcpy(&le_bits, data_ + 8, sizeof(le_bits));
+   bits_ = le32toh(le_bits);
+   keys_ = read_le64(data_ + 16);
+   uint64_t table_offset = read_le64(data_ + 24);
+   if (memcmp(data_, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || bits_ == 0 || bits_ > 32 ||
+       table_offset > len_ || (len_ - table_offset) / 8 != (uint64_t(1) << bits_) + 1) {
+      munmap(const_cast<unsigned char*>(data_), len_);
+      throw std::runtime_error("Invalid address index " + path);
+   }
+   table_ = data_ + table_offset;
+}
+
+address_index_t::~address_index_t()
+{
+   munmap(const_cast<unsigned char*>(data_), len_);
+}
+
+std::vector<uint64_t> address_index_t::find(const tx_destination_t& dest) const
+{
+   address_posting_t key(dest, 0);
+   size_t bucket = static_cast<size_t>(key.hash >> (64 - bits_));
+   const unsigned char* p = data_ + read_le64(table_ + bucket * 8);
+   const unsigned char* end = data_ + read_le64(table_ + (bucket + 1) * 8);
+   if (p > end || end > table_)
+      throw std::runtime_error("Corrupted address index");
+
+   std::vector<uint64_t> res;
+   while (p < end) {
+      unsigned char key_len = *p++;
+      const unsigned char* entry_key = p;
+      p += key_len;
+      uint64_t size = read_varint(p, end);
+      if (p > end || size > static_cast<uint64_t>(end - p))
+         throw std::runtime_error("Corrupted address index");
+      const unsigned char* postings_end = p + size;
+      if (key_len == key.key.len_ && memcmp(entry_key, key.key.data_.data(), key_len) == 0) {
+         uint64_t count = read_varint(p, postings_end);
+         uint64_t pos = 0;
+         res.reserve(count);
+         for (uint64_t i = 0; i < count; i++) {
+            pos += read_varint(p, postings_end);
+            res.push_back(pos);
+         }
+         return res;
+      }
+      p = postings_end;
+   }
+   return res;
+}
+
+}
@@ -0,0 +1,281 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <address_stats.h>
+#include <coding.h>
+
+#include <cstdio>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace btc_utils
+{
+
+namespace
+{
+
+//! partitions of the hash range merged one at a time
+constexpr size_t PARTITIONS = size_t(1) << address_aggregator_t::PARTITION_BITS;
+//! run record: key hash, statistics, key length, then the key
+constexpr size_t RECORD_HEADER_SIZE = 8 + fixed_width<address_stats_t>::value + 1;
+constexpr size_t RUN_BUFFER_SIZE = 1 << 20;
+//! smallest share of the memory limit of a thread, the slots of a new table take 2 MB
+constexpr size_t MIN_THREAD_MEMORY = 8 << 20;
+
+typedef std::unique_ptr<FILE, decltype(&fclose)> file_ptr_t;
+
+//! buffered for the writes, a partition is read at once
+file_ptr_t open_file(const std::string& path, const char* mode, bool buffered)
+{
+   file_ptr_t f(fopen(path.c_str(), mode), &fclose);
+   if (!f)
+      throw std::runtime_error("Unable to open file " + path);
+   setvbuf(f.get(), nullptr, buffered ? _IOFBF : _IONBF, buffered ? RUN_BUFFER_SIZE : 0);
+   return f;
+}
+
+unsigned int partition(uint64_t hash)
+{
+   return static_cast<unsigned int>(hash >> (64 - address_aggregator_t::PARTITION_BITS));
+}
+
+} // namespace
+
+address_stats_table_t::address_stats_table_t(size_t max_memory, size_t capacity)
+   : max_memory_(max_memory), size_(0), shift_(64)
+{
+   size_t slots = 16;
+   while (slots < capacity)
+      slots <<= 1;
+   slots_.resize(slots, slot_t{0, 0, EMPTY, 0, 0, 0});
+   while ((size_t(1) << (64 - shift_)) < slots)
+      shift_--;
+}
+
+size_t address_stats_table_t::find(const address_key_t& key, uint64_t hash) const
+{
+   size_t mask = slots_.size() - 1;
+   size_t i = static_cast<size_t>(hash >> shift_);
+   while (slots_[i].key != EMPTY && !(slots_[i].hash == hash && equal(slots_[i], key)))
+      i = (i + 1) & mask;
+   return i;
+}
+
+bool address_stats_table_t::merge(const address_key_t& key, uint64_t hash, const address_stats_t& stats)
+{
+   size_t i = find(key, hash);
+   if (slots_[i].key != EMPTY) {
+      slot_t& slot = slots_[i];
+      slot.first_height = std::min(slot.first_height, stats.first_height);
+      slot.last_height = std::max(slot.last_height, stats.last_height);
+      slot.outputs = static_cast<uint32_t>(std::min<uint64_t>(slot.outputs + stats.outputs, 0xffffffff));
+      slot.received += stats.received;
+      return true;
+   }
+
+   // a new address, the table grows at a load of 70%
+   size_t key_size = 1 + key.len_;
+   bool grow_first = (size_ + 1) * 10 > slots_.size() * 7;
+   size_t slots = grow_first ? 2 * slots_.size() : slots_.size();
+   if (slots * sizeof(slot_t) + arena_.size() + key_size > max_memory_ || arena_.size() + key_size >= EMPTY)
+      return false;
+   if (grow_first) {
+      grow();
+      i = find(key, hash);
+   }
+   slot_t& slot = slots_[i];
+   slot.hash = hash;
+   slot.received = stats.received;
+   slot.key = static_cast<uint32_t>(arena_.size());
+   slot.first_height = stats.first_height;
+   slot.last_height = stats.last_height;
+   slot.outputs = static_cast<uint32_t>(std::min<uint64_t>(stats.outputs, 0xffffffff));
+   arena_.push_back(key.len_);
+   arena_.insert(arena_.end(), key.data_.begin(), key.data_.begin() + key.len_);
+   size_++;
+   return true;
+}
+
+void address_stats_table_t::grow()
+{
+   std::vector<slot_t> old(slots_.size() * 2, slot_t{0, 0, EMPTY, 0, 0, 0});
+   old.swap(slots_);
+   shift_--;
+   size_t mask = slots_.size() - 1;
+   for (const auto& slot: old) {
+      if (slot.key == EMPTY)
+         continue;
+      size_t i = static_cast<size_t>(slot.hash >> shift_);
+      while (slots_[i].key != EMPTY)
+         i = (i + 1) & mask;
+      slots_[i] = slot;
+   }
+}
+
+void address_stats_table_t::clear()
+{
+   for (auto& slot: slots_)
+      slot.key = EMPTY;
+   arena_.clear();
+   size_ = 0;
+}
+
+address_key_t address_stats_table_t::key(const slot_t& slot) const
+{
+   address_key_t key;
+   key.len_ = arena_[slot.key];
+   memcpy(key.data_.data(), &arena_[slot.key + 1], key.len_);
+   return key;
+}
+
+void address_stats_table_t::for_each_sorted(
+   const std::function<void(const address_key_t&, uint64_t, const address_stats_t&)>& f) const
+{
+   std::vector<uint32_t> order;
+   order.reserve(size_);
+   for (size_t i = 0; i < slots_.size(); i++)
+      if (slots_[i].key != EMPTY)
+         order.push_back(static_cast<uint32_t>(i));
+   std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+      const slot_t& x = slots_[a];
+      const slot_t& y = slots_[b];
+      if (x.hash != y.hash)
+         return x.hash < y.hash;
+      return key(x) < key(y);
+   });
+   for (uint32_t i: order) {
+      const slot_t& slot = slots_[i];
+      f(key(slot), slot.hash, address_stats_t{slot.first_height, slot.last_height, slot.outputs, slot.received});
+   }
+}
+
+address_aggregator_t::address_aggregator_t(const std::string& run_path, size_t memory_limit, unsigned int threads)
+   : run_path_(run_path), thread_limit_(std::max(memory_limit / std::max(threads, 1u), MIN_THREAD_MEMORY)),
+     tables_(std::max(threads, 1u)), next_run_(0), peak_memory_(0)
+{
+}
+
+address_aggregator_t::~address_aggregator_t()
+{
+   for (const auto& run: runs_)
+      unlink(run.path.c_str());
+}
+
+void address_aggregator_t::add(unsigned int thread, const tx_destination_t& dest, uint32_t height, uint64_t value)
+{
+   std::unique_ptr<address_stats_table_t>& table = tables_[thread];
+   if (!table)
+      table.reset(new address_stats_table_t(thread_limit_));
+   address_key_t key(dest);
+   uint64_t hash = key.hash();
+   address_stats_t stats{height, height, 1, value};
+   if (table->merge(key, hash, stats))
+      return;
+   spill(*table);
+   table->clear();
+   if (!table->merge(key, hash, stats))
+      throw std::runtime_error("Memory limit of the address statistics is too small");
+}
+
+void address_aggregator_t::spill(address_stats_table_t& table)
+{
+   run_t run;
+   {
+      std::lock_guard<std::mutex> lock(mutex_);
+      run.path = run_path_ + ".run" + std::to_string(next_run_++);
+      peak_memory_ = std::max(peak_memory_, table.memory_usage());
+   }
+   run.offsets.resize(PARTITIONS + 1);
+   {
+      file_ptr_t f = open_file(run.path, "wb", true);
+      uint64_t pos = 0;
+      size_t next = 0;     // partitions before it have their offset
+      table.for_each_sorted([&](const address_key_t& key, uint64_t hash, const address_stats_t& stats) {
+         while (next <= partition(hash))
+            run.offsets[next++] = pos;
+         unsigned char buf[RECORD_HEADER_SIZE];
+         write_le64(buf, hash);
+         encode_fixed(stats, buf + 8);
+         buf[RECORD_HEADER_SIZE - 1] = key.len_;
+         if (fwrite(buf, 1, sizeof(buf), f.get()) != sizeof(buf) ||
+             fwrite(key.data_.data(), 1, key.len_, f.get()) != key.len_)
+            throw std::runtime_error("Unable to write address statistics run");
+         pos += sizeof(buf) + key.len_;
+      });
+      while (next <= PARTITIONS)
+         run.offsets[next++] = pos;
+      if (fflush(f.get()) != 0)
+         throw std::runtime_error("Unable to write address statistics run");
+   }
+   std::lock_guard<std::mutex> lock(mutex_);
+   runs_.push_back(std::move(run));
+}
+
+uint64_t address_aggregator_t::finish(const std::function<void(const address_key_t&, const address_stats_t&)>& f)
+{
+   for (const auto& table: tables_)
+      if (table)
+         peak_memory_ = std::max(peak_memory_, table->memory_usage());
+   uint64_t addresses = 0;
+   auto emit = [&](const address_key_t& key, uint64_t, const address_stats_t& stats) {
+      f(key, stats);
+      addresses++;
+   };
+
+   // a single table holds every address already
+   size_t used = 0;
+   address_stats_table_t* single = nullptr;
+   for (const auto& table: tables_)
+      if (table && table->size()) {
+         used++;
+         single = table.get();
+      }
+   if (runs_.empty() && used <= 1) {
+      if (single)
+         single->for_each_sorted(emit);
+      return addresses;
+   }
+
+   for (auto& table: tables_) {
+      if (table && table->size())
+         spill(*table);
+      table.reset();
+   }
+   address_stats_table_t merged;
+   std::vector<unsigned char> data;
+   for (size_t p = 0; p < PARTITIONS; p++) {
+      merged.clear();
+      for (const auto& run: runs_) {
+         uint64_t begin = run.offsets[p], end = run.offsets[p + 1];
+         if (begin == end)
+            continue;
+         file_ptr_t file = open_file(run.path, "rb", false);
+         data.resize(static_cast<size_t>(end - begin));
+         if (fseek(file.get(), static_cast<long>(begin), SEEK_SET) != 0 ||
+             fread(data.data(), 1, data.size(), file.get()) != data.size())
+            throw std::runtime_error("Unable to read address statistics run " + run.path);
+         address_key_t key;
+         address_stats_t stats;
+         for (size_t pos = 0; pos < data.size(); ) {
+            if (pos + RECORD_HEADER_SIZE > data.size())
+               throw std::runtime_error("Corrupted address statistics run " + run.path);
+            uint64_t hash = read_le64(&data[pos]);
+            decode_fixed(&data[pos + 8], stats);
+            key.len_ = data[pos + RECORD_HEADER_SIZE - 1];
+            if (key.len_ == 0 || key.len_ > key.data_.size() || pos + RECORD_HEADER_SIZE + key.len_ > data.size())
+               throw std::runtime_error("Corrupted address statistics run " + run.path);
+            memcpy(key.data_.data(), &data[pos + RECORD_HEADER_SIZE], key.len_);
+            merged.merge(key, hash, stats);
+            pos += RECORD_HEADER_SIZE + key.len_;
+         }
+      }
+      merged.for_each_sorted(emit);
+   }
+   for (const auto& run: runs_)
+      unlink(run.path.c_str());
+   runs_.clear();
+   return addresses;
+}
+
+}
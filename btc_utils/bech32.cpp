@@ -3,12 +3,16 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <bech32.h>
+#include <algorithm>
 #include <stdexcept>
 
 namespace
 {
 
 typedef std::vector<uint8_t> data;
+using btc_utils::bech32::Encoding;
+using btc_utils::bech32::PolyModStep;
+using btc_utils::bech32::PolyModHRP;
 
 /** The Bech32 character set for encoding. */
 const char* CHARSET = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
@@ -28,7 +32,7 @@ const int8_t CHARSET_REV[128] = {
 /** This function will compute what 6 5-bit values to XOR into the last 6 input values, in order to
  *  make the checksum 0. These 6 values are packed together in a single 30-bit integer. The higher
  *  bits correspond to earlier values. */
-uint32_t PolyMod(const data& v)
+uint32_t PolyMod(uint32_t c, const data& v)
 {
     // The input is interpreted as a list of coefficients of a polynomial over F = GF(32), with an
     // implicit 1 in front. If the input is [v0,v1,v2,v3,v4], that polynomial is v(x) =
@@ -54,35 +58,9 @@ uint32_t PolyMod(const data& v)
     // polynomial constructed from just the values of v that were processed so far, mod g(x). In
     // the above example, `c` initially corresponds to 1 mod g(x), and after processing 2 inputs of
     // v, it corresponds to x^2 + v0*x + v1 mod g(x). As 1 mod g(x) = 1, that is the starting value
-    // for `c`.
-    uint32_t c = 1;
+    // for `c`. Callers pass the state after the HRP, so the HRP is not expanded into a copy of v.
     for (const auto v_i : v) {
-        // We want to update `c` to correspond to a polynomial with one extra term. If the initial
-        // value of `c` consists of the coefficients of c(x) = f(x) mod g(x), we modify it to
-        // correspond to c'(x) = (f(x) * x + v_i) mod g(x), where v_i is the next input to
-        // process. Simplifying:
-        // c'(x) = (f(x) * x + v_i) mod g(x)
-        //         ((f(x) mod g(x)) * x + v_i) mod g(x)
-        //         (c(x) * x + v_i) mod g(x)
-        // If c(x) = c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5, we want to compute
-        // c'(x) = (c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5) * x + v_i mod g(x)
-        //       = c0*x^6 + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i mod g(x)
-        //       = c0*(x^6 mod g(x)) + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i
-        // If we call (x^6 mod g(x)) = k(x), this can be written as
-        // c'(x) = (c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i) + c0*k(x)
-
-        // First, determine the value of c0:
-        uint8_t c0 = c >> 25;
-
-        // Then compute c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i:
-        c = ((c & 0x1ffffff) << 5) ^ v_i;
-
-        // Finally, for each set bit n in c0, conditionally add {2^n}k(x):
-        if (c0 & 1)  c ^= 0x3b6a57b2; //     k(x) = {29}x^5 + {22}x^4 + {20}x^3 + {21}x^2 + {29}x + {18}
-        if (c0 & 2)  c ^= 0x26508e6d; //  {2}k(x) = {19}x^5 +  {5}x^4 +     x^3 +  {3}x^2 + {19}x + {13}
-        if (c0 & 4)  c ^= 0x1ea119fa; //  {4}k(x) = {15}x^5 + {10}x^4 +  {2}x^3 +  {6}x^2 + {15}x + {26}
-        if (c0 & 8)  c ^= 0x3d4233dd; //  {8}k(x) = {30}x^5 + {20}x^4 +  {4}x^3 + {12}x^2 + {30}x + {29}
-        if (c0 & 16) c ^= 0x2a1462b3; // {16}k(x) = {21}x^5 +     x^4 +  {8}x^3 + {24}x^2 + {21}x + {19}
+        c = PolyModStep(c, v_i);
     }
     return c;
 }
@@ -93,54 +71,35 @@ inline unsigned char LowerCase(unsigned char c)
     return (c >= 'A' && c <= 'Z') ? (c - 'A') + 'a' : c;
 }
 
-/** Concatenate two vectors. */
-template<typename V>
-inline V Cat(V v1, const V& v2)
-{
-    v1.reserve(v1.size() + v2.size());
-    for (const auto& arg : v2) {
-        v1.push_back(arg);
-    }
-    return v1;
-}
-
-/** Expand a HRP for use in checksum computation. */
-data ExpandHRP(const std::string& hrp)
-{
-    data ret;
-    ret.reserve(hrp.size() + 90);
-    ret.resize(hrp.size() * 2 + 1);
-    for (size_t i = 0; i < hrp.size(); ++i) {
-        unsigned char c = hrp[i];
-        ret[i] = c >> 5;
-        ret[i + hrp.size() + 1] = c & 0x1f;
-    }
-    ret[hrp.size()] = 0;
-    return ret;
-}
+/** Checksum constants, the value PolyMod must return for a valid string. */
+constexpr uint32_t BECH32_CONST = 1;
+constexpr uint32_t BECH32M_CONST = 0x2bc830a3;
 
 /** Verify a checksum. */
-bool VerifyChecksum(const std::string& hrp, const data& values)
+Encoding VerifyChecksum(const std::string& hrp, const data& values)
 {
     // PolyMod computes what value to xor into the final values to make the checksum 0. However,
     // if we required that the checksum was 0, it would be the case that appending a 0 to a valid
     // list of values would result in a new valid list. For that reason, Bech32 requires the
-    // resulting checksum to be 1 instead.
-    return PolyMod(Cat(ExpandHRP(hrp), values)) == 1;
+    // resulting checksum to be 1 instead. In Bech32m, this constant was amended.
+    const uint32_t check = PolyMod(PolyModHRP(hrp), values);
+    if (check == BECH32_CONST) return Encoding::BECH32;
+    if (check == BECH32M_CONST) return Encoding::BECH32M;
+    return Encoding::INVALID;
 }
 
-/** Create a checksum. */
-data CreateChecksum(const std::string& hrp, const data& values)
+/** Create a checksum, hrp_state is PolyModHRP(hrp). */
+uint32_t CreateChecksum(Encoding encoding, uint32_t hrp_state, const uint8_t* values, size_t size)
 {
-    data enc = Cat(ExpandHRP(hrp), values);
-    enc.resize(enc.size() + 6); // Append 6 zeroes
-    uint32_t mod = PolyMod(enc) ^ 1; // Determine what to XOR into those 6 zeroes.
-    data ret(6);
-    for (size_t i = 0; i < 6; ++i) {
-        // Convert the 5-bit groups in mod to checksum values.
-        ret[i] = (mod >> (5 * (5 - i))) & 31;
+    uint32_t c = hrp_state;
+    for (size_t i = 0; i < size; ++i) {
+        c = PolyModStep(c, values[i]);
     }
-    return ret;
+    for (size_t i = 0; i < 6; ++i) { // Append 6 zeroes
+        c = PolyModStep(c, 0);
+    }
+    // Determine what to XOR into those 6 zeroes.
+    return c ^ (encoding == Encoding::BECH32 ? BECH32_CONST : BECH32M_CONST);
 }
 
 } // namespace
@@ -150,27 +109,39 @@ namespace btc_utils
 namespace bech32
 {
 
-/** Encode a Bech32 string. */
-std::string Encode(const std::string& hrp, const data& values) {
-    // First ensure that the HRP is all lowercase. BIP-173 requires an encoder
-    // to return a lowercase Bech32 string, but if given an uppercase HRP, the
+/** Encode a Bech32 or Bech32m string into a buffer. */
+size_t Encode(Encoding encoding, std::string_view hrp, uint32_t hrp_state, const uint8_t* values, size_t size, char* out) {
+    if (encoding == Encoding::INVALID)
+       throw std::runtime_error("Invalid bech32 encoding");
+    uint32_t checksum = CreateChecksum(encoding, hrp_state, values, size);
+    char* p = std::copy(hrp.begin(), hrp.end(), out);
+    *p++ = '1';
+    for (size_t i = 0; i < size; ++i) {
+        *p++ = CHARSET[values[i]];
+    }
+    for (size_t i = 0; i < 6; ++i) {
+        // Convert the 5-bit groups in the checksum to characters.
+        *p++ = CHARSET[(checksum >> (5 * (5 - i))) & 31];
+    }
+    return static_cast<size_t>(p - out);
+}
+
+/** Encode a Bech32 or Bech32m string. */
+std::string Encode(Encoding encoding, const std::string& hrp, const data& values) {
+    // First ensure that the HRP is all lowercase. BIP-173 and BIP350 require an encoder
+    // to return a lowercase Bech32/Bech32m string, but if given an uppercase HRP, the
     // result will always be invalid.
     for (const char& c : hrp) {
        if (c >= 'A' && c <= 'Z')
           throw std::runtime_error("Invalid HRP in bech32 address: " + hrp);
     }
-    data checksum = CreateChecksum(hrp, values);
-    data combined = Cat(values, checksum);
-    std::string ret = hrp + '1';
-    ret.reserve(ret.size() + combined.size());
-    for (const auto c : combined) {
-        ret += CHARSET[c];
-    }
+    std::string ret(hrp.size() + 1 + values.size() + 6, '\0');
+    Encode(encoding, hrp, PolyModHRP(hrp), values.data(), values.size(), &ret[0]);
     return ret;
 }
 
-/** Decode a Bech32 string. */
-std::pair<std::string, data> Decode(const std::string& str) {
+/** Decode a Bech32 or Bech32m string. */
+DecodeResult Decode(const std::string& str) {
     bool lower = false, upper = false;
     for (size_t i = 0; i < str.size(); ++i) {
         unsigned char c = str[i];
@@ -197,10 +168,11 @@ std::pair<std::string, data> Decode(const std::string& str) {
     for (size_t i = 0; i < pos; ++i) {
         hrp += LowerCase(str[i]);
     }
-    if (!VerifyChecksum(hrp, values)) {
+    Encoding result = VerifyChecksum(hrp, values);
+    if (result == Encoding::INVALID) {
         return {};
     }
-    return {hrp, data(values.begin(), values.end() - 6)};
+    return {result, std::move(hrp), data(values.begin(), values.end() - 6)};
 }
 
 } // namespace bech32
@@ -6,5 +6,25 @@
 
 namespace btc_utils {
 
+uint256_t block_header_t::hash() const
+{
+   unsigned char data[SIZE];
+   encode_fixed(*this, data);
+   return hash_sha256d(data, sizeof(data));
+}
+
+void block_t::decode(const unsigned char* data, tx_hashes_t hashes)
+{
+   decode_fixed(data, static_cast<block_header_t&>(*this));
+   uint64_t count;
+   const unsigned char* p = data + SIZE;
+   p += decode_compact_int(p, count);
+   txes_.resize(count);
+   for (auto& tx: txes_) {
+      transaction_view_t view(p);
+      view.decode(tx, hashes);
+      p += view.size();
+   }
+}
 
 }
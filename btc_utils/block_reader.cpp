@@ -0,0 +1,586 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <block_reader.h>
+
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace btc_utils
+{
+
+std::string get_block_file_path(const std::string& dir, uint32_t index)
+{
+   char fname[16];
+   snprintf(fname, sizeof(fname), "blk%05u.dat", index);
+   if (dir.empty())
+      return fname;
+   if (dir.back() == '/')
+      return dir + fname;
+   return dir + "/" + fname;
+}
+
+bool advise_block_file(const std::string& dir, uint32_t index, block_file_advice_t advice)
+{
+   int fd = open(get_block_file_path(dir, index).c_str(), O_RDONLY);
+   if (fd < 0)
+      return false;
+   int res = posix_fadvise(fd, 0, 0, advice == BLOCK_FILE_WILLNEED ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+   close(fd);
+   return res == 0;
+}
+
+double block_file_residency(const std::string& dir, uint32_t index)
+{
+   int fd = open(get_block_file_path(dir, index).c_str(), O_RDONLY);
+   if (fd < 0)
+      return 0;
+   struct stat st;
+   double residency = 0;
+   if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      size_t size = static_cast<size_t>(st.st_size);
+      void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (map != MAP_FAILED) {
+         size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+         std::vector<unsigned char> pages((size + page - 1) / page);
+         if (mincore(map, size, pages.data()) == 0)
+            residency = double(std::count_if(pages.begin(), pages.end(), [](unsigned char p) { return p & 1; })) /
+                        double(pages.size());
+         munmap(map, size);
+      }
+   }
+   close(fd);
+   return residency;
+}
+
+block_file_cache_t::block_file_cache_t(const std::string& dir, unsigned int readahead, bool drop,
+                                       const block_filter_t* filter)
+   : dir_(dir), readahead_(readahead), drop_(drop), filter_(filter), started_(false), checked_(0), prefetched_(0), dropped_(0)
+{
+}
+
+void block_file_cache_t::begin(uint32_t file)
+{
+   if (!readahead_ && !drop_)
+      return;
+   std::lock_guard<std::mutex> lock(mutex_);
+   if (!started_) {
+      // the files before the first one read are left alone
+      started_ = true;
+      checked_ = file;
+   }
+   if (drop_ && file < checked_ && !warm_.count(file))
+      warm_[file] = block_file_residency(dir_, file) >= 0.5;
+   for (; checked_ <= file + readahead_; checked_++) {
+      // what was cached is known before anything is read ahead
+      if (drop_)
+         warm_[checked_] = block_file_residency(dir_, checked_) >= 0.5;
+      if (checked_ > file && (!filter_ || filter_->accepts_file(checked_)) &&
+          advise_block_file(dir_, checked_, BLOCK_FILE_WILLNEED))
+         prefetched_++;
+   }
+}
+
+void block_file_cache_t::end(uint32_t file)
+{
+   if (!drop_)
+      return;
+   std::lock_guard<std::mutex> lock(mutex_);
+   auto it = warm_.find(file);
+   if (it != warm_.end() && !it->second && advise_block_file(dir_, file, BLOCK_FILE_DONTNEED))
+      dropped_++;
+}
+
+namespace
+{
+
+//! hashes expected for a block of the compact target, 2^256 / target
+double block_work(uint32_t bits)
+{
+   uint32_t mantissa = bits & 0x007fffff;
+   if (mantissa == 0 || (bits & 0x00800000))
+      return 0;
+   return std::ldexp(1.0 / mantissa, 256 - 8 * (static_cast<int>(bits >> 24) - 3));
+}
+
+}
+
+chain_linker_t::chain_linker_t(unsigned int depth, uint64_t max_memory, emit_t emit)
+   : depth_(depth), max_memory_(max_memory), emit_(std::move(emit)), root_(nullptr), tip_(nullptr), next_height_(0),
+     seq_(0), buffered_blocks_(0), buffered_bytes_(0)
+{
+}
+
+void chain_linker_t::add(std::vector<unsigned char>&& block, uint32_t file, uint64_t pos)
+{
+   std::unique_ptr<node_t> node(new node_t());
+   const block_header_view_t header(block.data());
+   node->hash = header.hash();
+   node->prev = header.prev_block_hash();
+   node->bits = header.bits();
+   node->size = block.size();
+   node->block = std::move(block);
+   node->file = file;
+   node->pos = pos;
+   insert(std::move(node));
+}
+
+void chain_linker_t::add_header(const block_header_t& header)
+{
+   std::unique_ptr<node_t> node(new node_t());
+   node->hash = header.hash();
+   node->prev = header.prev_block_hash_;
+   node->bits = header.bits_;
+   node->size = block_header_t::SIZE;
+   insert(std::move(node));
+}
+
+void chain_linker_t::insert(std::unique_ptr<node_t> owned)
+{
+   if (knows(owned->hash)) {
+      stats_.duplicates++;
+      return;
+   }
+   node_t* node = owned.get();
+   node->seq = seq_++;
+   node->added = std::chrono::steady_clock::now();
+   nodes_.emplace(node->hash, std::move(owned));
+   if (!node->block.empty())
+      buffered_blocks_++;
+   buffered_bytes_ += node->size;
+   stats_.peak_blocks = std::max(stats_.peak_blocks, buffered_blocks_);
+   stats_.peak_bytes = std::max(stats_.peak_bytes, buffered_bytes_);
+
+   // the blocks waiting for it become its children
+   auto waiting = orphans_.equal_range(node->hash);
+   for (auto it = waiting.first; it != waiting.second; ++it) {
+      it->second->parent = node;
+      node->children.push_back(it->second);
+   }
+   orphans_.erase(waiting.first, waiting.second);
+
+   auto parent = nodes_.find(node->prev);
+   if (node->prev == uint256_t{}) {
+      // there is a single chain
+      if (tip_)
+         drop(node, true);
+      else
+         link(node);
+   } else if (parent != nodes_.end()) {
+      node->parent = parent->second.get();
+      node->parent->children.push_back(node);
+      if (node->parent->linked)
+         link(node);
+   } else if (settled_.count(node->prev)) {
+      drop(node, true);
+   } else {
+      orphans_.emplace(node->prev, node);
+   }
+
+   while (tip_ && uint64_t(tip_->height) >= uint64_t(next_height_) + depth_)
+      emit_next();
+   while (buffered_bytes_ > max_memory_) {
+      if (tip_ && tip_->height >= next_height_) {
+         stats_.early++;
+         emit_next();
+         continue;
+      }
+      if (orphans_.empty())
+         break;
+      auto oldest = std::min_element(orphans_.begin(), orphans_.end(), [](const auto& a, const auto& b) {
+         return a.second->seq < b.second->seq;
+      });
+      drop(oldest->second, false);
+   }
+}
+
+void chain_linker_t::link(node_t* node)
+{
+   std::vector<node_t*> stack{node};
+   while (!stack.empty()) {
+      node_t* n = stack.back();
+      stack.pop_back();
+      n->linked = true;
+      n->height = n->parent ? n->parent->height + 1 : 0;
+      n->work = (n->parent ? n->parent->work : 0) + block_work(n->bits);
+      if (!tip_ || n->work > tip_->work)
+         tip_ = n;
+      stack.insert(stack.end(), n->children.begin(), n->children.end());
+   }
+}
+
+void chain_linker_t::emit_next()
+{
+   node_t* node = tip_;
+   while (node->height > next_height_)
+      node = node->parent;
+   if (root_) {
+      // the other branches forking at the last block emitted are stale
+      for (node_t* child: root_->children)
+         if (child != node)
+            drop(child, true);
+      uint256_t hash = root_->hash;
+      settle(hash);
+      nodes_.erase(hash);
+   }
+   node->parent = nullptr;
+   root_ = node;
+   next_height_++;
+   if (node->block.empty()) {
+      release(*node);
+      return;
+   }
+
+   uint64_t delay = seq_ - node->seq - 1;
+   stats_.blocks++;
+   stats_.total_delay += delay;
+   stats_.max_delay = std::max(stats_.max_delay, delay);
+   stats_.max_seconds = std::max(stats_.max_seconds,
+                                 std::chrono::duration<double>(std::chrono::steady_clock::now() - node->added).count());
+   std::vector<unsigned char> block = std::move(node->block);
+   node->block.clear();
+   buffered_blocks_--;
+   buffered_bytes_ -= node->size;
+   node->size = 0;
+   emit_(block, node->file, node->pos, node->height);
+}
+
+void chain_linker_t::settle(const uint256_t& hash)
+{
+   settled_.insert(hash);
+   settled_order_.push_back(hash);
+   if (settled_order_.size() > SETTLED_WINDOW) {
+      settled_.erase(settled_order_.front());
+      settled_order_.pop_front();
+   }
+}
+
+void chain_linker_t::drop(node_t* node, bool stale)
+{
+   if (!node->parent) {
+      auto waiting = orphans_.equal_range(node->prev);
+      for (auto it = waiting.first; it != waiting.second; ++it)
+         if (it->second == node) {
+            orphans_.erase(it);
+            break;
+         }
+   }
+   std::vector<node_t*> stack{node};
+   while (!stack.empty()) {
+      node_t* n = stack.back();
+      stack.pop_back();
+      stack.insert(stack.end(), n->children.begin(), n->children.end());
+      release(*n);
+      uint256_t hash = n->hash;
+      if (stale) {
+         stats_.stale++;
+         settle(hash);
+      } else {
+         stats_.unlinked++;
+      }
+      nodes_.erase(hash);
+   }
+}
+
+void chain_linker_t::release(node_t& node)
+{
+   buffered_bytes_ -= node.size;
+   node.size = 0;
+   if (!node.block.empty()) {
+      buffered_blocks_--;
+      std::vector<unsigned char>().swap(node.block);
+   }
+}
+
+void chain_linker_t::finish()
+{
+   while (tip_ && tip_->height >= next_height_)
+      emit_next();
+   for (auto& entry: nodes_) {
+      node_t& node = *entry.second;
+      if (&node == root_)
+         continue;
+      release(node);
+      if (node.linked)
+         stats_.stale++;
+      else
+         stats_.unlinked++;
+   }
+   nodes_.clear();
+   orphans_.clear();
+   root_ = tip_ = nullptr;
+}
+
+header_index_stats_t index_block_headers(const std::string& dir, network_t network, block_filter_t& filter,
+                                         block_height_map_t* block_heights)
+{
+   struct header_entry_t
+   {
+      uint256_t hash;
+      uint256_t prev;
+      uint32_t time;
+      uint32_t bits;
+      uint32_t file;
+   };
+   std::vector<header_entry_t> headers;
+   uint32_t nFile = 0;
+   for (;; nFile++) {
+      FILE* file = fopen(get_block_file_path(dir, nFile).c_str(), "rb");
+      if (!file)
+         break;
+      read_block_file_range(file, network, 0, std::numeric_limits<uint64_t>::max(),
+                            [&](const block_header_view_t& header) {
+                               headers.push_back({header.hash(), header.prev_block_hash(), header.time(), header.bits(), nFile});
+                               return false;
+                            },
+                            [](std::vector<unsigned char>&, uint64_t, uint64_t) {}, [](uint64_t, uint64_t) {},
+                            [](const std::string&) {}, HEADER_INDEX_BUFFER_SIZE);
+   }
+
+   std::unordered_map<uint256_t, size_t, block_hash_hasher_t> index;
+   index.reserve(headers.size());
+   for (size_t i = 0; i < headers.size(); i++)
+      index.emplace(headers[i].hash, i);
+   // -1 is not known yet, -2 has no path to a block without a previous one
+   std::vector<int64_t> heights(headers.size(), -1);
+   std::vector<double> work(headers.size(), 0);
+   std::vector<size_t> parents(headers.size(), headers.size());
+   std::vector<size_t> path;
+   const uint256_t null_hash{};
+   for (size_t i = 0; i < headers.size(); i++) {
+      // walk back to a block with a known height, then number the blocks on the way
+      int64_t height;
+      double chain_work = 0;
+      size_t j = i;
+      path.clear();
+      while (true) {
+         if (heights[j] != -1) {
+            height = heights[j];
+            chain_work = work[j];
+            break;
+         }
+         path.push_back(j);
+         if (headers[j].prev == null_hash) {
+            height = -1;
+            break;
+         }
+         auto it = index.find(headers[j].prev);
+         if (it == index.end() || path.size() > headers.size()) {
+            height = -2;
+            break;
+         }
+         parents[j] = it->second;
+         j = it->second;
+      }
+      for (auto k = path.rbegin(); k != path.rend(); ++k) {
+         heights[*k] = height == -2 ? height : ++height;
+         chain_work += block_work(headers[*k].bits);
+         work[*k] = chain_work;
+      }
+   }
+
+   // only the blocks of the chain with the most work keep their height, the first tip met wins a tie
+   size_t tip = headers.size();
+   for (size_t i = 0; i < headers.size(); i++)
+      if (heights[i] >= 0 && (tip == headers.size() || work[i] > work[tip]))
+         tip = i;
+   std::vector<bool> best(headers.size(), false);
+   for (size_t i = tip; i < headers.size(); i = parents[i])
+      best[i] = true;
+
+   header_index_stats_t stats;
+   stats.headers = headers.size();
+   stats.files = nFile;
+   filter.blocks.clear();
+   filter.files.assign(nFile, false);
+   if (block_heights) {
+      block_heights->clear();
+      block_heights->reserve(headers.size());
+   }
+   for (size_t i = 0; i < headers.size(); i++) {
+      if (heights[i] < 0) {
+         stats.orphans++;
+         continue;
+      }
+      if (!best[i]) {
+         stats.stale++;
+         continue;
+      }
+      const header_entry_t& header = headers[i];
+      if (block_heights)
+         block_heights->emplace(header.hash, static_cast<uint32_t>(heights[i]));
+      if (heights[i] >= filter.from_height && heights[i] <= filter.to_height &&
+          header.time >= filter.from_time && header.time <= filter.to_time) {
+         filter.blocks.insert(header.hash);
+         filter.files[header.file] = true;
+      }
+   }
+   return stats;
+}
+
+block_view_t::block_view_t(const unsigned char* data, size_t size, tx_hashes_t hashes, uint32_t fileIn,
+                           uint64_t posIn, unsigned int threadIn)
+   : file(fileIn), pos(posIn), thread(threadIn), data_(data), size_(size), hashes_(hashes)
+{
+}
+
+uint64_t block_view_t::transactions() const
+{
+   uint64_t count;
+   decode_compact_int(data_ + block_header_t::SIZE, count);
+   return count;
+}
+
+const block_t& block_view_t::block() const
+{
+   if (!block_) {
+      block_.reset(new block_t());
+      block_->decode(data_, hashes_);
+   }
+   return *block_;
+}
+
+block_reader_t::block_reader_t(const std::string& dir, const block_reader_options_t& options)
+   : dir_(dir), options_(options), files_(0), skipped_files_(0), blocks_(0), skipped_blocks_(0),
+     cancelled_(false)
+{
+}
+
+void block_reader_t::read(block_visitor_t& visitor)
+{
+   block_filter_t& filter = options_.filter;
+   if (filter.by_height() && filter.files.empty())
+      index_stats_ = index_block_headers(dir_, options_.network, filter);
+   const block_filter_t* active = filter.active() ? &filter : nullptr;
+
+   std::atomic<uint32_t> next_file(0);
+   std::atomic<bool> done(false);
+   std::atomic<uint32_t> files(0);
+   std::atomic<uint32_t> skipped_files(0);
+   std::atomic<uint64_t> blocks(0);
+   std::atomic<uint64_t> skipped_blocks(0);
+   std::exception_ptr error;
+   std::mutex error_mutex;
+   block_file_cache_t cache(dir_, options_.readahead, options_.drop_cache, active);
+
+   auto visit = [&](const std::vector<unsigned char>& block, uint32_t file, uint64_t pos, unsigned int thread) {
+      block_view_t view(block.data(), block.size(), options_.hashes, file, pos, thread);
+      visitor.on_block(view);
+      view.for_each_transaction([&](const transaction_view_t& tx) {
+         visitor.on_transaction(view, tx);
+         tx.for_each_output([&](uint32_t n, const tx_out_view_t& out) { visitor.on_output(view, tx, n, out); });
+      });
+      blocks++;
+   };
+   std::unique_ptr<chain_linker_t> linker;
+   if (options_.chain_order)
+      linker.reset(new chain_linker_t(options_.chain_depth, options_.chain_memory,
+                                      [&](const std::vector<unsigned char>& block, uint32_t file, uint64_t pos, uint32_t) {
+                                         try {
+                                            visit(block, file, pos, 0);
+                                         } catch (const std::exception& e) {
+                                            visitor.on_error(file, std::string("Error processing block - ") + e.what());
+                                         }
+                                      }));
+
+   auto worker = [&](unsigned int thread) {
+      try {
+         while (!done && !cancelled_) {
+            uint32_t file = next_file++;
+            FILE* f = fopen(get_block_file_path(dir_, file).c_str(), "rb");
+            if (!f) {
+               done = true;
+               break;
+            }
+            // the chain is linked by the headers of every file
+            if (active && !linker && !active->accepts_file(file)) {
+               fclose(f);
+               skipped_files++;
+               continue;
+            }
+            files++;
+            cache.begin(file);
+            visitor.begin_file(file, thread);
+            // the header of a block left unread links the chain, the header of a block that could not
+            // be read only when it continues a known block, not to buffer every false match of corrupted data
+            block_header_t header;
+            bool pending = false;
+            auto link_header = [&](bool unread) {
+               if (pending && (unread || linker->knows(header.prev_block_hash_)))
+                  linker->add_header(header);
+               pending = false;
+            };
+            read_block_file_range(f, options_.network, 0, std::numeric_limits<uint64_t>::max(),
+                                  [&](const block_header_view_t& h) {
+                                     if (cancelled_)
+                                        return false;
+                                     if (linker) {
+                                        header = h.decode();
+                                        pending = true;
+                                     }
+                                     return !active || active->accepts(h);
+                                  },
+                                  [&](std::vector<unsigned char>& block, uint64_t pos, uint64_t) {
+                                     if (!linker) {
+                                        visit(block, file, pos, thread);
+                                        return;
+                                     }
+                                     pending = false;
+                                     linker->add(std::move(block), file, pos);
+                                  },
+                                  [&](uint64_t, uint64_t) {
+                                     if (cancelled_)
+                                        return;
+                                     skipped_blocks++;
+                                     if (linker)
+                                        link_header(true);
+                                  },
+                                  [&](const std::string& message) {
+                                     if (linker)
+                                        link_header(false);
+                                     visitor.on_error(file, message);
+                                  },
+                                  options_.buffer_size);
+            visitor.end_file(file, thread);
+            cache.end(file);
+         }
+         if (linker && !cancelled_)
+            linker->finish();
+      } catch (...) {
+         done = true;
+         std::lock_guard<std::mutex> lock(error_mutex);
+         if (!error)
+            error = std::current_exception();
+      }
+   };
+
+   if (options_.threads <= 1 || linker) {
+      worker(0);
+   } else {
+      std::vector<std::thread> threads;
+      for (unsigned int i = 0; i < options_.threads; i++)
+         threads.emplace_back(worker, i);
+      for (auto& thread: threads)
+         thread.join();
+   }
+   files_ = files;
+   skipped_files_ = skipped_files;
+   blocks_ = blocks;
+   skipped_blocks_ = skipped_blocks;
+   if (linker)
+      chain_stats_ = linker->stats();
+   if (error)
+      std::rethrow_exception(error);
+}
+
+}
@@ -0,0 +1,235 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <btc_utils_c.h>
+
+#include <address_cache.h>
+#include <block_reader.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace btc_utils;
+
+static_assert(BTC_ADDRESS_SIZE > MAX_ADDRESS_SIZE, "no room for the longest address");
+static_assert(int(BTC_OUTPUT_P2PKH) == int(TX_PUBKEYHASH) && int(BTC_OUTPUT_MULTISIG) == int(TX_MULTISIG) &&
+              int(BTC_OUTPUT_P2WPKH) == int(TX_WITNESS_V0_KEYHASH) && int(BTC_OUTPUT_P2TR) == int(TX_WITNESS_V1_TAPROOT),
+              "output types differ from txnouttype");
+static_assert(sizeof(btc_output_record_t) == 160, "record layout changed");
+
+namespace
+{
+
+//! why the last btc_reader_open of the thread failed
+thread_local std::string t_last_error;
+
+//! records handed over from the reader thread at once
+constexpr size_t RECORD_CHUNK = 4096;
+//! chunks waiting to be fetched before the reader thread waits
+constexpr size_t MAX_CHUNKS = 16;
+
+} // namespace
+
+/** Visitor of the reader thread, filling the chunks btc_reader_next copies from */
+struct btc_reader : public block_visitor_t
+{
+   network_t network;
+   bool txids;
+   std::unique_ptr<block_reader_t> reader;
+   std::vector<std::unique_ptr<address_cache_t>> caches;   //!< one for every reader thread
+   std::vector<std::vector<btc_output_record_t>> pending;  //!< chunk filled by every reader thread
+   std::atomic<uint64_t> errors;
+
+   std::mutex mutex;
+   std::condition_variable cv;
+   std::deque<std::vector<btc_output_record_t>> chunks;   //!< in the order they were filled
+   size_t offset;          //!< records of the first chunk fetched already
+   bool finished;          //!< every chunk was handed over
+   bool closing;
+   std::string error;
+   std::thread thread;
+
+   btc_reader(const std::string& dir, const btc_reader_options_t& options) :
+      network(static_cast<network_t>(options.network)), txids(options.txids != 0), errors(0), offset(0), finished(false), closing(false)
+   {
+      block_reader_options_t reader_options;
+      reader_options.network = network;
+      reader_options.threads = std::max(1u, options.threads);
+      reader_options.filter.from_height = options.from_height;
+      reader_options.filter.to_height = options.to_height;
+      reader_options.filter.from_time = options.from_time;
+      reader_options.filter.to_time = options.to_time;
+      reader.reset(new block_reader_t(dir, reader_options));
+      caches.resize(reader_options.threads);
+      pending.resize(reader_options.threads);
+   }
+
+   void hand_over(unsigned int reader_thread)
+   {
+      std::vector<btc_output_record_t>& chunk = pending[reader_thread];
+      if (chunk.empty())
+         return;
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [this]() { return chunks.size() < MAX_CHUNKS || closing; });
+      if (!closing)
+         chunks.push_back(std::move(chunk));
+      chunk.clear();
+      cv.notify_all();
+   }
+
+   void run()
+   {
+      try {
+         reader->read(*this);
+      } catch (const std::exception& e) {
+         std::lock_guard<std::mutex> lock(mutex);
+         error = e.what();
+      }
+      for (unsigned int i = 0; i < pending.size(); i++)
+         hand_over(i);
+      std::lock_guard<std::mutex> lock(mutex);
+      finished = true;
+      cv.notify_all();
+   }
+
+   void end_file(uint32_t /* file */, unsigned int reader_thread) override { hand_over(reader_thread); }
+
+   void on_output(const block_view_t& view, const transaction_view_t& tx, uint32_t n, const tx_out_view_t& out) override
+   {
+      std::unique_ptr<address_cache_t>& cache = caches[view.thread];
+      if (!cache)
+         cache.reset(new address_cache_t());
+      for (const auto& dest: extract_destinations(out.script())) {
+         std::string_view addr = cache->encode(dest, network);
+         if (addr.empty())
+            continue;
+         std::vector<btc_output_record_t>& chunk = pending[view.thread];
+         if (chunk.empty())
+            chunk.reserve(RECORD_CHUNK);
+         btc_output_record_t& record = chunk.emplace_back();
+         memcpy(record.address, addr.data(), addr.size());
+         record.address[addr.size()] = 0;
+         if (txids)
+            memcpy(record.txid, tx.txid().data(), sizeof(record.txid));
+         else
+            memset(record.txid, 0, sizeof(record.txid));
+         record.value = out.value();
+         record.block_pos = view.pos;
+         record.file = view.file;
+         record.vout = n;
+         record.type = dest.type_;
+         record.reserved = 0;
+         if (chunk.size() == RECORD_CHUNK)
+            hand_over(view.thread);
+      }
+   }
+
+   void on_error(uint32_t /* file */, const std::string& /* message */) override { errors++; }
+};
+
+int btc_api_version(void)
+{
+   return BTC_UTILS_C_API_VERSION;
+}
+
+void btc_reader_options_init(btc_reader_options_t* options)
+{
+   if (!options)
+      return;
+   options->network = BTC_MAINNET;
+   options->threads = 1;
+   options->from_height = 0;
+   options->to_height = std::numeric_limits<uint32_t>::max();
+   options->from_time = 0;
+   options->to_time = std::numeric_limits<uint32_t>::max();
+   options->txids = 1;
+}
+
+btc_reader_t* btc_reader_open(const char* dir, const btc_reader_options_t* options)
+{
+   try {
+      btc_reader_options_t defaults;
+      btc_reader_options_init(&defaults);
+      if (!options)
+         options = &defaults;
+      if (!dir)
+         throw std::runtime_error("No block directory");
+      if (options->network < BTC_MAINNET || options->network > BTC_REGTEST)
+         throw std::runtime_error("Unknown network type");
+      std::string first = get_block_file_path(dir, 0);
+      FILE* file = fopen(first.c_str(), "rb");
+      if (!file)
+         throw std::runtime_error("Unable to open file " + first);
+      fclose(file);
+      std::unique_ptr<btc_reader_t> reader(new btc_reader_t(dir, *options));
+      reader->thread = std::thread(&btc_reader_t::run, reader.get());
+      return reader.release();
+   } catch (const std::exception& e) {
+      t_last_error = e.what();
+      return nullptr;
+   }
+}
+
+int64_t btc_reader_next(btc_reader_t* reader, btc_output_record_t* records, size_t capacity)
+{
+   if (!reader || (!records && capacity))
+      return -1;
+   size_t count = 0;
+   std::unique_lock<std::mutex> lock(reader->mutex);
+   while (count < capacity) {
+      reader->cv.wait(lock, [reader]() { return !reader->chunks.empty() || reader->finished; });
+      if (reader->chunks.empty())
+         break;
+      const std::vector<btc_output_record_t>& chunk = reader->chunks.front();
+      size_t n = std::min(capacity - count, chunk.size() - reader->offset);
+      memcpy(records + count, chunk.data() + reader->offset, n * sizeof(btc_output_record_t));
+      count += n;
+      reader->offset += n;
+      if (reader->offset == chunk.size()) {
+         reader->chunks.pop_front();
+         reader->offset = 0;
+         reader->cv.notify_all();
+      }
+   }
+   if (count == 0 && !reader->error.empty())
+      return -1;
+   return static_cast<int64_t>(count);
+}
+
+uint64_t btc_reader_errors(btc_reader_t* reader)
+{
+   return reader ? reader->errors.load() : 0;
+}
+
+const char* btc_reader_error(btc_reader_t* reader)
+{
+   if (!reader)
+      return "";
+   std::lock_guard<std::mutex> lock(reader->mutex);
+   return reader->error.c_str();
+}
+
+void btc_reader_close(btc_reader_t* reader)
+{
+   if (!reader)
+      return;
+   reader->reader->cancel();
+   {
+      std::lock_guard<std::mutex> lock(reader->mutex);
+      reader->closing = true;
+      reader->chunks.clear();
+   }
+   reader->cv.notify_all();
+   reader->thread.join();
+   delete reader;
+}
+
+const char* btc_last_error(void)
+{
+   return t_last_error.c_str();
+}
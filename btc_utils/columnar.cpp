@@ -0,0 +1,438 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <columnar.h>
+#include <coding.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace btc_utils
+{
+
+static const char COLUMNAR_MAGIC[8] = {'B', 'T', 'C', 'C', 'O', 'L', 'S', '1'};
+static constexpr size_t CHUNK_HEADER_SIZE = 18;
+
+struct column_desc_t
+{
+   const char* name;
+   column_value_t value;
+   column_encoding_t encoding;
+};
+
+static const column_desc_t COLUMNS[COLUMN_COUNT] = {
+   {"block_pos", VALUE_UINT, ENCODING_DELTA},
+   {"txid", VALUE_BYTES, ENCODING_DICTIONARY},
+   {"vout", VALUE_UINT, ENCODING_VARINT},
+   {"type", VALUE_UINT, ENCODING_DICTIONARY},
+   {"version", VALUE_UINT, ENCODING_DICTIONARY},
+   {"program", VALUE_BYTES, ENCODING_DICTIONARY},
+   {"value", VALUE_UINT, ENCODING_VARINT},
+};
+
+bool columnar_zstd_supported()
+{
+#ifdef HAVE_ZSTD
+   return true;
+#else
+   return false;
+#endif
+}
+
+namespace
+{
+
+template<typename T>
+void encode_varints(const std::vector<T>& values, std::vector<unsigned char>& out)
+{
+   for (const auto& val: values)
+      write_varint(out, val);
+}
+
+void encode_delta(const std::vector<uint64_t>& values, std::vector<unsigned char>& out)
+{
+   uint64_t prev = 0;
+   for (uint64_t val: values) {
+      write_varint(out, zigzag_encode(static_cast<int64_t>(val - prev)));
+      prev = val;
+   }
+}
+
+/** Dictionary coding, key_of turns a value into the byte string stored in the dictionary */
+template<typename T, typename F>
+void encode_dictionary(const std::vector<T>& values, F key_of, std::vector<unsigned char>& out)
+{
+   std::unordered_map<std::string, uint64_t> ids;
+   std::vector<const std::string*> dict;
+   std::vector<uint64_t> indexes;
+   indexes.reserve(values.size());
+   for (const auto& val: values) {
+      auto it = ids.emplace(key_of(val), dict.size()).first;
+      if (it->second == dict.size())
+         dict.push_back(&it->first);
+      indexes.push_back(it->second);
+   }
+   write_varint(out, dict.size());
+   for (const std::string* key: dict) {
+      write_varint(out, key->size());
+      out.insert(out.end(), key->begin(), key->end());
+   }
+   encode_varints(indexes, out);
+}
+
+template<typename T>
+void decode_varints(const unsigned char* p, const unsigned char* end, uint32_t rows, std::vector<T>& values)
+{
+   values.resize(rows);
+   for (uint32_t i = 0; i < rows; i++)
+      values[i] = static_cast<T>(read_varint(p, end));
+}
+
+void decode_delta(const unsigned char* p, const unsigned char* end, uint32_t rows, std::vector<uint64_t>& values)
+{
+   values.resize(rows);
+   uint64_t prev = 0;
+   for (uint32_t i = 0; i < rows; i++) {
+      prev += static_cast<uint64_t>(zigzag_decode(read_varint(p, end)));
+      values[i] = prev;
+   }
+}
+
+template<typename T, typename F>
+void decode_dictionary(const unsigned char* p, const unsigned char* end, uint32_t rows,
+                       F value_of, std::vector<T>& values)
+{
+   uint64_t count = read_varint(p, end);
+   if (count > static_cast<uint64_t>(end - p))
+      throw std::runtime_error("Corrupted columnar file");
+   std::vector<T> dict;
+   dict.reserve(count);
+   for (uint64_t i = 0; i < count; i++) {
+      uint64_t len = read_varint(p, end);
+      if (len > static_cast<uint64_t>(end - p))
+         throw std::runtime_error("Corrupted columnar file");
+      dict.push_back(value_of(p, static_cast<size_t>(len)));
+      p += len;
+   }
+   values.resize(rows);
+   for (uint32_t i = 0; i < rows; i++) {
+      uint64_t index = read_varint(p, end);
+      if (index >= count)
+         throw std::runtime_error("Corrupted columnar file");
+      values[i] = dict[index];
+   }
+}
+
+std::string byte_key(unsigned char c)
+{
+   return std::string(1, static_cast<char>(c));
+}
+
+unsigned char byte_value(const unsigned char* p, size_t len)
+{
+   if (len != 1)
+      throw std::runtime_error("Corrupted columnar file");
+   return *p;
+}
+
+} // namespace
+
+columnar_writer_t::columnar_writer_t(const std::string& path, int zstd_level, size_t row_group_size)
+   : file_(nullptr), zstd_level_(zstd_level), row_group_size_(std::max<size_t>(row_group_size, 1)),
+     offset_(0), rows_(0), raw_size_(0), stored_size_(0)
+{
+   if (zstd_level_ != 0 && !columnar_zstd_supported())
+      throw std::runtime_error("btc_utils is built without zstd");
+   file_ = fopen(path.c_str(), "wb");
+   if (!file_)
+      throw std::runtime_error("Unable to open file " + path);
+   write(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+}
+
+columnar_writer_t::~columnar_writer_t()
+{
+   if (file_)
+      fclose(file_);
+}
+
+void columnar_writer_t::write(const void* data, size_t len)
+{
+   if (fwrite(data, 1, len, file_) != len)
+      throw std::runtime_error("Unable to write columnar file");
+   offset_ += len;
+}
+
+void columnar_writer_t::add(uint64_t block_pos, const uint256_t& txid, uint32_t vout,
+                            const tx_destination_t& dest, uint64_t value)
+{
+   block_pos_.push_back(block_pos);
+   txid_.push_back(txid);
+   vout_.push_back(vout);
+   type_.push_back(static_cast<unsigned char>(dest.type_));
+   version_.push_back(dest.version_);
+   program_.emplace_back(dest.program_.begin(), dest.program_.begin() + dest.length_);
+   value_.push_back(value);
+   if (block_pos_.size() >= row_group_size_)
+      flush_row_group();
+}
+
+void columnar_writer_t::write_chunk(column_encoding_t encoding, const std::vector<unsigned char>& raw)
+{
+   const unsigned char* data = raw.data();
+   size_t size = raw.size();
+   column_compression_t compression = COMPRESSION_NONE;
+#ifdef HAVE_ZSTD
+   std::vector<unsigned char> compressed;
+   if (zstd_level_ != 0) {
+      compressed.resize(ZSTD_compressBound(raw.size()));
+      size_t res = ZSTD_compress(compressed.data(), compressed.size(), raw.data(), raw.size(), zstd_level_);
+      if (ZSTD_isError(res))
+         throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(res));
+      // keep chunks that do not shrink uncompressed
+      if (res < raw.size()) {
+         data = compressed.data();
+         size = res;
+         compression = COMPRESSION_ZSTD;
+      }
+   }
+#endif
+   unsigned char header[CHUNK_HEADER_SIZE];
+   header[0] = static_cast<unsigned char>(encoding);
+   header[1] = static_cast<unsigned char>(compression);
+   write_le64(header + 2, raw.size());
+   write_le64(header + 10, size);
+   write(header, sizeof(header));
+   write(data, size);
+   raw_size_ += raw.size();
+   stored_size_ += size;
+}
+
+void columnar_writer_t::flush_row_group()
+{
+   if (block_pos_.empty())
+      return;
+   row_groups_.push_back(offset_);
+   unsigned char rows[4];
+   uint32_t count = htole32(static_cast<uint32_t>(block_pos_.size()));
+   memcpy(rows, &count, sizeof(rows));
+   write(rows, sizeof(rows));
+
+   std::vector<unsigned char> raw;
+   encode_delta(block_pos_, raw);
+   write_chunk(COLUMNS[COLUMN_BLOCK_POS].encoding, raw);
+   raw.clear();
+   encode_dictionary(txid_, [](const uint256_t& h) {
+      return std::string(reinterpret_cast<const char*>(h.data()), h.size());
+   }, raw);
+   write_chunk(COLUMNS[COLUMN_TXID].encoding, raw);
+   raw.clear();
+   encode_varints(vout_, raw);
+   write_chunk(COLUMNS[COLUMN_VOUT].encoding, raw);
+   raw.clear();
+   encode_dictionary(type_, byte_key, raw);
+   write_chunk(COLUMNS[COLUMN_TYPE].encoding, raw);
+   raw.clear();
+   encode_dictionary(version_, byte_key, raw);
+   write_chunk(COLUMNS[COLUMN_VERSION].encoding, raw);
+   raw.clear();
+   encode_dictionary(program_, [](const std::string& p) { return p; }, raw);
+   write_chunk(COLUMNS[COLUMN_PROGRAM].encoding, raw);
+   raw.clear();
+   encode_varints(value_, raw);
+   write_chunk(COLUMNS[COLUMN_VALUE].encoding, raw);
+
+   rows_ += block_pos_.size();
+   block_pos_.clear();
+   txid_.clear();
+   vout_.clear();
+   type_.clear();
+   version_.clear();
+   program_.clear();
+   value_.clear();
+}
+
+void columnar_writer_t::close()
+{
+   if (!file_)
+      return;
+   flush_row_group();
+   uint64_t footer_offset = offset_;
+   std::vector<unsigned char> footer;
+   write_varint(footer, COLUMN_COUNT);
+   for (const auto& column: COLUMNS) {
+      std::string name(column.name);
+      write_varint(footer, name.size());
+      footer.insert(footer.end(), name.begin(), name.end());
+      footer.push_back(static_cast<unsigned char>(column.value));
+      footer.push_back(static_cast<unsigned char>(column.encoding));
+   }
+   write_varint(footer, row_groups_.size());
+   unsigned char buf[8];
+   for (uint64_t offset: row_groups_) {
+      write_le64(buf, offset);
+      footer.insert(footer.end(), buf, buf + sizeof(buf));
+   }
+   write_le64(buf, rows_);
+   footer.insert(footer.end(), buf, buf + sizeof(buf));
+   write_le64(buf, footer_offset);
+   footer.insert(footer.end(), buf, buf + sizeof(buf));
+   footer.insert(footer.end(), COLUMNAR_MAGIC, COLUMNAR_MAGIC + sizeof(COLUMNAR_MAGIC));
+   write(footer.data(), footer.size());
+   int res = fclose(file_);
+   file_ = nullptr;
+   if (res != 0)
+      throw std::runtime_error("Unable to write columnar file");
+}
+
+tx_destination_t columnar_row_group_t::destination(size_t row) const
+{
+   tx_destination_t dest;
+   dest.type_ = static_cast<txnouttype>(type[row]);
+   dest.version_ = version[row];
+   dest.length_ = static_cast<unsigned char>(std::min(program[row].size(), dest.program_.size()));
+   std::copy(program[row].begin(), program[row].begin() + dest.length_, dest.program_.begin());
+   return dest;
+}
+
+columnar_reader_t::columnar_reader_t(const std::string& path) : data_(nullptr), len_(0), rows_(0)
+{
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0)
+      throw std::runtime_error("Unable to open columnar file " + path);
+   struct stat st;
+   void* mem = MAP_FAILED;
+   if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(2 * sizeof(COLUMNAR_MAGIC) + 8)) {
+      len_ = static_cast<size_t>(st.st_size);
+      mem = mmap(nullptr, len_, PROT_READ, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if (mem == MAP_FAILED)
+      throw std::runtime_error("Unable to map columnar file " + path);
+   data_ = static_cast<const unsigned char*>(mem);
+
+   try {
+      const unsigned char* end = data_ + len_ - sizeof(COLUMNAR_MAGIC) - 8;
+      uint64_t footer_offset = read_le64(end);
+      if (memcmp(data_, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)) != 0 ||
+          memcmp(end + 8, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)) != 0 ||
+          footer_offset > static_cast<uint64_t>(end - data_))
+         throw std::runtime_error("Invalid columnar file " + path);
+      const unsigned char* p = data_ + footer_offset;
+      uint64_t columns = read_varint(p, end);
+      if (columns != COLUMN_COUNT)
+         throw std::runtime_error("Unsupported columnar file " + path);
+      for (uint64_t i = 0; i < columns; i++) {
+         uint64_t len = read_varint(p, end);
+         if (len + 2 > static_cast<uint64_t>(end - p))
+            throw std::runtime_error("Invalid columnar file " + path);
+         names_.emplace_back(reinterpret_cast<const char*>(p), static_cast<size_t>(len));
+         p += len;
+         if (names_.back() != COLUMNS[i].name || p[0] != COLUMNS[i].value || p[1] != COLUMNS[i].encoding)
+            throw std::runtime_error("Unsupported columnar file " + path);
+         p += 2;
+      }
+      uint64_t groups = read_varint(p, end);
+      if (groups > static_cast<uint64_t>(end - p) / 8 || static_cast<uint64_t>(end - p) != groups * 8 + 8)
+         throw std::runtime_error("Invalid columnar file " + path);
+      for (uint64_t i = 0; i < groups; i++, p += 8)
+         row_groups_.push_back(read_le64(p));
+      rows_ = read_le64(p);
+   } catch (...) {
+      munmap(const_cast<unsigned char*>(data_), len_);
+      throw;
+   }
+}
+
+columnar_reader_t::~columnar_reader_t()
+{
+   munmap(const_cast<unsigned char*>(data_), len_);
+}
+
+void columnar_reader_t::read(size_t row_group, columnar_row_group_t& group, unsigned int columns) const
+{
+   if (row_group >= row_groups_.size())
+      throw std::runtime_error("Invalid row group");
+   const unsigned char* end = data_ + len_;
+   const unsigned char* p = data_ + row_groups_[row_group];
+   if (p + 4 > end)
+      throw std::runtime_error("Corrupted columnar file");
+   uint32_t rows;
+   memcpy(&rows, p, sizeof(rows));
+   group.rows = le32toh(rows);
+   p += 4;
+
+   std::vector<unsigned char> buf;
+   for (unsigned int column = 0; column < COLUMN_COUNT; column++) {
+      if (static_cast<size_t>(end - p) < CHUNK_HEADER_SIZE)
+         throw std::runtime_error("Corrupted columnar file");
+      unsigned char compression = p[1];
+      uint64_t raw_size = read_le64(p + 2);
+      uint64_t size = read_le64(p + 10);
+      p += CHUNK_HEADER_SIZE;
+      if (size > static_cast<uint64_t>(end - p))
+         throw std::runtime_error("Corrupted columnar file");
+      const unsigned char* chunk = p;
+      p += size;
+      if (!(columns & (1u << column)))
+         continue;
+
+      const unsigned char* chunk_end = chunk + size;
+      if (compression == COMPRESSION_ZSTD) {
+#ifdef HAVE_ZSTD
+         buf.resize(raw_size);
+         size_t res = ZSTD_decompress(buf.data(), buf.size(), chunk, size);
+         if (ZSTD_isError(res) || res != raw_size)
+            throw std::runtime_error("Corrupted columnar file");
+         chunk = buf.data();
+         chunk_end = chunk + raw_size;
+#else
+         throw std::runtime_error("btc_utils is built without zstd");
+#endif
+      } else if (compression != COMPRESSION_NONE || raw_size != size) {
+         throw std::runtime_error("Corrupted columnar file");
+      }
+
+      switch (column) {
+      case COLUMN_BLOCK_POS:
+         decode_delta(chunk, chunk_end, group.rows, group.block_pos);
+         break;
+      case COLUMN_TXID:
+         decode_dictionary(chunk, chunk_end, group.rows, [](const unsigned char* v, size_t len) {
+            uint256_t h;
+            if (len != h.size())
+               throw std::runtime_error("Corrupted columnar file");
+            std::copy(v, v + len, h.begin());
+            return h;
+         }, group.txid);
+         break;
+      case COLUMN_VOUT:
+         decode_varints(chunk, chunk_end, group.rows, group.vout);
+         break;
+      case COLUMN_TYPE:
+         decode_dictionary(chunk, chunk_end, group.rows, byte_value, group.type);
+         break;
+      case COLUMN_VERSION:
+         decode_dictionary(chunk, chunk_end, group.rows, byte_value, group.version);
+         break;
+      case COLUMN_PROGRAM:
+         decode_dictionary(chunk, chunk_end, group.rows, [](const unsigned char* v, size_t len) {
+            return std::string(reinterpret_cast<const char*>(v), len);
+         }, group.program);
+         break;
+      case COLUMN_VALUE:
+         decode_varints(chunk, chunk_end, group.rows, group.value);
+         break;
+      }
+   }
+}
+
+}
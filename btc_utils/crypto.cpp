@@ -4,12 +4,14 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "crypto.h"
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <openssl/ripemd.h>
 #include <openssl/ec.h>
 #include <openssl/bn.h>
 #include <openssl/obj_mac.h>
 #include <memory>
+#include <stdexcept>
 #include <algorithm>
 
 namespace btc_utils
@@ -65,6 +67,116 @@ std::string encode_base58_check(const std::vector<unsigned char> &data)
    return encode_base58(vch);
 }
 
+size_t encode_base58_check(const unsigned char* data, size_t len, char* out)
+{
+    if (len > MAX_BASE58_CHECK_PAYLOAD)
+        throw std::runtime_error("Base58 payload is too long");
+    unsigned char buf[MAX_BASE58_CHECK_PAYLOAD + 4];
+    std::copy(data, data + len, buf);
+    uint256_t h = hash_sha256d(data, len);
+    std::copy(h.begin(), h.begin() + 4, buf + len);
+    len += 4;
+
+    size_t zeroes = 0;
+    while (zeroes < len && buf[zeroes] == 0)
+        zeroes++;
+    // big-endian base58 digits, log(256) / log(58) digits per byte rounded up
+    unsigned char b58[(MAX_BASE58_CHECK_PAYLOAD + 4) * 138 / 100 + 1] = {};
+    size_t size = (len - zeroes) * 138 / 100 + 1;
+    size_t length = 0;
+    for (size_t j = zeroes; j < len; j++) {
+        unsigned carry = buf[j];
+        size_t i = 0;
+        // Apply "b58 = b58 * 256 + ch".
+        for (; (carry != 0 || i < length) && i < size; i++) {
+            carry += 256u * b58[size - 1 - i];
+            b58[size - 1 - i] = static_cast<unsigned char>(carry % 58u);
+            carry /= 58u;
+        }
+        length = i;
+    }
+    size_t pos = size - length;
+    while (pos < size && b58[pos] == 0)
+        pos++;
+    char* p = std::fill_n(out, zeroes, '1');
+    for (; pos < size; pos++)
+        *p++ = pszBase58[b58[pos]];
+    return static_cast<size_t>(p - out);
+}
+
+static const int8_t mapBase58[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1, 0, 1, 2, 3, 4, 5, 6,  7, 8,-1,-1,-1,-1,-1,-1,
+    -1, 9,10,11,12,13,14,15, 16,-1,17,18,19,20,21,-1,
+    22,23,24,25,26,27,28,29, 30,31,32,-1,-1,-1,-1,-1,
+    -1,33,34,35,36,37,38,39, 40,41,42,43,-1,44,45,46,
+    47,48,49,50,51,52,53,54, 55,56,57,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,
+};
+
+bool decode_base58(const std::string& str, std::vector<unsigned char>& data)
+{
+    auto it = str.begin();
+    // Skip and count leading '1's.
+    size_t zeroes = 0;
+    while (it != str.end() && *it == '1') {
+        zeroes++;
+        it++;
+    }
+    // Allocate enough space in big-endian base256 representation.
+    size_t size = static_cast<size_t>(str.end() - it) * 733u / 1000u + 1u; // log(58) / log(256), rounded up.
+    std::vector<unsigned char> b256(size);
+    size_t length = 0;
+    // Process the characters.
+    while (it != str.end()) {
+        // Decode base58 character
+        int carry = mapBase58[static_cast<unsigned char>(*it)];
+        if (carry == -1)  // Invalid b58 character
+            return false;
+        size_t i = 0;
+        for (auto b = b256.rbegin(); (carry != 0 || i < length) && (b != b256.rend()); ++b, ++i) {
+            carry += 58 * (*b);
+            *b = static_cast<unsigned char>(carry % 256);
+            carry /= 256;
+        }
+        if (carry != 0)
+            return false;
+        length = i;
+        it++;
+    }
+    // Skip leading zeroes in b256.
+    auto b = std::next(b256.begin(), static_cast<long int>(size - length));
+    // Copy result into output vector.
+    data.assign(zeroes, 0x00);
+    data.insert(data.end(), b, b256.end());
+    return true;
+}
+
+bool decode_base58_check(const std::string& str, std::vector<unsigned char>& data)
+{
+    if (!decode_base58(str, data) || data.size() < 4) {
+        data.clear();
+        return false;
+    }
+    // re-calculate the checksum, ensure it matches the included 4-byte checksum
+    uint256_t h = hash_sha256d(data.data(), data.size() - 4);
+    if (!std::equal(h.begin(), h.begin() + 4, data.end() - 4)) {
+        data.clear();
+        return false;
+    }
+    data.resize(data.size() - 4);
+    return true;
+}
+
 uint256_t hash_sha256(const std::vector<unsigned char> &data)
 {
     SHA256_CTX sha256;
@@ -75,6 +187,106 @@ uint256_t hash_sha256(const std::vector<unsigned char> &data)
     return res;
 }
 
+uint256_t hash_sha256d(const unsigned char* data, size_t len)
+{
+    return hash256_t::thread_hasher().write(data, len).finalize();
+}
+
+namespace
+{
+
+//! the digests fetched once, an implicit fetch on every initialization costs as much as hashing a transaction
+const EVP_MD* sha256_md()
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static EVP_MD* md = EVP_MD_fetch(nullptr, "SHA256", nullptr);
+    return md;
+#else
+    return EVP_sha256();
+#endif
+}
+
+const EVP_MD* ripemd160_md()
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static EVP_MD* md = EVP_MD_fetch(nullptr, "RIPEMD160", nullptr);
+    return md;
+#else
+    return EVP_ripemd160();
+#endif
+}
+
+//! a context per thread for the hashes of one call
+struct md_ctx_deleter_t
+{
+    void operator()(EVP_MD_CTX* ctx) const { EVP_MD_CTX_free(ctx); }
+};
+
+EVP_MD_CTX* thread_md_ctx()
+{
+    thread_local std::unique_ptr<EVP_MD_CTX, md_ctx_deleter_t> ctx(EVP_MD_CTX_new());
+    if (!ctx)
+        throw std::runtime_error("Unable to allocate a digest context");
+    return ctx.get();
+}
+
+void digest(EVP_MD_CTX* ctx, const EVP_MD* md, const unsigned char* data, size_t len, unsigned char* res)
+{
+    if (!md || !EVP_DigestInit_ex(ctx, md, nullptr) || !EVP_DigestUpdate(ctx, data, len) ||
+        !EVP_DigestFinal_ex(ctx, res, nullptr))
+        throw std::runtime_error("Unable to compute a digest");
+}
+
+}
+
+hash256_t::hash256_t()
+    : ctx_(EVP_MD_CTX_new()), pending_(false)
+{
+    if (!ctx_ || !sha256_md() || !EVP_DigestInit_ex(ctx_, sha256_md(), nullptr)) {
+        EVP_MD_CTX_free(ctx_);
+        throw std::runtime_error("Unable to initialize SHA-256");
+    }
+}
+
+hash256_t::~hash256_t()
+{
+    EVP_MD_CTX_free(ctx_);
+}
+
+hash256_t& hash256_t::write(const unsigned char* data, size_t len)
+{
+    EVP_DigestUpdate(ctx_, data, len);
+    pending_ = true;
+    return *this;
+}
+
+uint256_t hash256_t::finalize()
+{
+    uint256_t res;
+    EVP_DigestFinal_ex(ctx_, res.data(), nullptr);
+    EVP_DigestInit_ex(ctx_, sha256_md(), nullptr);
+    EVP_DigestUpdate(ctx_, res.data(), res.size());
+    EVP_DigestFinal_ex(ctx_, res.data(), nullptr);
+    EVP_DigestInit_ex(ctx_, sha256_md(), nullptr);
+    pending_ = false;
+    return res;
+}
+
+void hash256_t::reset()
+{
+    if (pending_) {
+        EVP_DigestInit_ex(ctx_, sha256_md(), nullptr);
+        pending_ = false;
+    }
+}
+
+hash256_t& hash256_t::thread_hasher()
+{
+    thread_local hash256_t hasher;
+    hasher.reset();
+    return hasher;
+}
+
 uint160_t hash_ripemd160(const std::vector<unsigned char> &data)
 {
     RIPEMD160_CTX ripemd;
@@ -85,6 +297,16 @@ uint160_t hash_ripemd160(const std::vector<unsigned char> &data)
     return res;
 }
 
+uint160_t hash_160(const unsigned char* data, size_t len)
+{
+    EVP_MD_CTX* ctx = thread_md_ctx();
+    uint256_t sha;
+    digest(ctx, sha256_md(), data, len, sha.data());
+    uint160_t res;
+    digest(ctx, ripemd160_md(), sha.data(), sha.size(), res.data());
+    return res;
+}
+
 const signed char p_util_hexdigit[256] =
 { -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
   -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
@@ -138,7 +360,7 @@ std::string to_hex(const std::vector<unsigned char>& v)
     static const char hexmap[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
                                      '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
     rv.reserve(v.size() * 2);
-    for(auto c = v.rend(); c != v.rbegin(); c++)
+    for(auto c = v.begin(); c != v.end(); c++)
     {
         unsigned char val = *c;
         rv.push_back(hexmap[val>>4]);
@@ -165,7 +387,7 @@ uint256_t uint256_from_hex(const std::string& hex)
         if (c == failed)
             throw std::runtime_error("Invalid symbol in hex string");
         n = static_cast<unsigned char>(n | c);
-        res[count++] = n;
+        res[res.size() - 1 - count++] = n;
     }
     return res;
 }
@@ -175,8 +397,9 @@ std::string uint256_to_hex(const uint256_t& v)
    std::string rv;
    static const char hexmap[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
                                     '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
+   // uint256 values are displayed in reversed byte order, as bitcoind does
    rv.reserve(v.size() * 2);
-   for(auto c = v.rend(); c != v.rbegin(); c++)
+   for(auto c = v.rbegin(); c != v.rend(); c++)
    {
        unsigned char val = *c;
        rv.push_back(hexmap[val>>4]);
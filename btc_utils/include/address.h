@@ -6,7 +6,9 @@
 #ifndef BTC_UTILS_ADDRESS_H__
 #define BTC_UTILS_ADDRESS_H__
 
+#include "chainparams.h"
 #include "crypto.h"
+#include "script.h"
 
 #include <string>
 #include <vector>
@@ -21,6 +23,7 @@ namespace btc_utils
  *  * script_hash_tx_destination_t: TX_SCRIPTHASH destination (P2SH)
  *  * witness_v0_script_hash_tx_destination_t: TX_WITNESS_V0_SCRIPTHASH destination (P2WSH)
  *  * witness_v0_key_hash_tx_destination_t: TX_WITNESS_V0_KEYHASH destination (P2WPKH)
+ *  * witness_v1_taproot_tx_destination_t: TX_WITNESS_V1_TAPROOT destination (P2TR)
  *  * witness_unknown_tx_destination_t: TX_WITNESS_UNKNOWN destination (P2W???)
  */
 struct no_destination_t
@@ -53,6 +56,12 @@ struct witness_v0_script_hash_tx_destination_t
    explicit witness_v0_script_hash_tx_destination_t(const uint256_t& hash) : data_(hash) {}
 };
 
+struct witness_v1_taproot_tx_destination_t
+{
+   uint256_t data_;
+   explicit witness_v1_taproot_tx_destination_t(const uint256_t& output_key) : data_(output_key) {}
+};
+
 struct witness_unknown_tx_destination_t
 {
    unsigned int version_;
@@ -65,8 +74,116 @@ std::string encode_destination(const pk_hash_tx_destination_t& dest);
 std::string encode_destination(const script_hash_tx_destination_t& dest);
 std::string encode_destination(const witness_v0_key_hash_tx_destination_t& dest);
 std::string encode_destination(const witness_v0_script_hash_tx_destination_t& dest);
+std::string encode_destination(const witness_v1_taproot_tx_destination_t& dest);
 std::string encode_destination(const witness_unknown_tx_destination_t& dest);
 
+/**
+ * Network independent destination of an output: the output type and the
+ * hash or witness program its address encodes. TX_PUBKEY destinations keep
+ * the hash160 of the key and are encoded as P2PKH addresses, a bare
+ * TX_MULTISIG output gives such a destination for every key.
+ */
+struct tx_destination_t
+{
+   txnouttype type_;
+   unsigned char version_; //!< witness version, 0 for base58 destinations
+   unsigned char length_;  //!< number of used program_ bytes
+   std::array<unsigned char, 40> program_;
+};
+
+/** Destinations of an output script, nothing for data carrying and nonstandard scripts */
+std::vector<tx_destination_t> extract_destinations(const std::vector<unsigned char>& script);
+
+class transaction_t;
+
+/** Destinations of one output of a destination_batch_t */
+struct destination_range_t
+{
+   const tx_destination_t* first;
+   const tx_destination_t* last;
+
+   const tx_destination_t* begin() const { return first; }
+   const tx_destination_t* end() const { return last; }
+   bool empty() const { return first == last; }
+};
+
+/**
+ * Destinations of all outputs of a run of transactions, the same as
+ * extract_destinations gives for every output. The scripts are classified at
+ * once by classify_scripts, then the outputs of every template are decoded by
+ * a loop of their own. Only the other scripts go through the solver. The
+ * storage is kept for the next run.
+ */
+class destination_batch_t
+{
+public:
+   //! find the destinations of the outputs of [begin, end)
+   void assign(const transaction_t* begin, const transaction_t* end);
+
+   //! destinations of output i, numbered over the transactions in order
+   destination_range_t operator[](size_t i) const
+   {
+      return {dests_.data() + offsets_[i], dests_.data() + offsets_[i + 1]};
+   }
+
+private:
+   std::vector<const unsigned char*> scripts_;
+   std::vector<uint32_t> sizes_;
+   std::vector<txnouttype> types_;
+   std::vector<uint32_t> offsets_;     //!< first destination of every output, then the end
+   std::vector<tx_destination_t> dests_;
+   std::array<std::vector<uint32_t>, TX_WITNESS_V1_TAPROOT + 1> outputs_;   //!< outputs of every template type
+
+   template<size_t OFFSET, size_t LENGTH>
+   void decode_programs(txnouttype type, unsigned char version);
+};
+
+//! longest address of any network: bcrt1 + version + 40 byte program + checksum
+constexpr size_t MAX_ADDRESS_SIZE = 80;
+
+/**
+ * Address of the destination on the network Params written to out, which
+ * must have room for MAX_ADDRESS_SIZE characters. Returns the length, 0 when
+ * the destination has no address. Nothing is allocated. Instantiated for
+ * the parameters of chainparams.h.
+ */
+template<typename Params>
+size_t encode_destination(const tx_destination_t& dest, char* out);
+
+//! address of the destination on the network
+std::string encode_destination(const tx_destination_t& dest, network_t network = g_network);
+
+/**
+ * Network independent key of an address: the address kind (0 for P2PKH, P2PK
+ * and multisig outputs, 1 for P2SH, 2 + witness version for witness outputs)
+ * followed by the hash or witness program.
+ */
+struct address_key_t
+{
+   unsigned char len_;
+   std::array<unsigned char, 41> data_;
+
+   address_key_t() : len_(0) {}
+   explicit address_key_t(const tx_destination_t& dest);
+
+   //! destination of the address, TX_PUBKEYHASH for the P2PKH kind
+   tx_destination_t destination() const;
+
+   //! well mixed 64 bit hash of the key
+   uint64_t hash() const;
+   bool operator==(const address_key_t& other) const;
+   bool operator<(const address_key_t& other) const;
+};
+
+//! shard of the address when the addresses are partitioned into shards by the hash of their key
+inline unsigned int address_shard(const address_key_t& key, unsigned int shards)
+{
+   return static_cast<unsigned int>(key.hash() % shards);
+}
+
+/** Parse an address of the network, TX_PUBKEYHASH is reported for P2PKH addresses */
+bool decode_destination(const std::string& address, tx_destination_t& dest, network_t network = g_network);
+
 }
 
 #endif // BTC_UTILS_ADDRESS_H__
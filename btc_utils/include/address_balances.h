@@ -0,0 +1,93 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_ADDRESS_BALANCES_H__
+#define BTC_UTILS_ADDRESS_BALANCES_H__
+
+#include <address.h>
+#include <utxo_set.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace btc_utils
+{
+
+/**
+ * Balances of the addresses paid by a run of transactions, from the UTXO set
+ * built while they are applied. The transactions have to come in chain order.
+ *
+ * Owners are kept as address keys, the kind and the hash or witness program,
+ * stored once in an arena as their length and bytes and found through an
+ * open addressing table of owner ids. They are encoded as addresses only when
+ * the balances are read.
+ *
+ * A UTXO has one owner. An output paying to several destinations, a bare
+ * multisig output, is credited to the address of its first key: crediting
+ * every key would count the value once per key. shared_outputs() counts them.
+ */
+class address_balances_t
+{
+public:
+   explicit address_balances_t(const std::string& spill_path = std::string());
+
+   address_balances_t(const address_balances_t&) = delete;
+   address_balances_t& operator=(const address_balances_t&) = delete;
+
+   //! spend the inputs and add the outputs of [begin, end), in order
+   void process(const transaction_t* begin, const transaction_t* end);
+
+   //! call f with the key and the balance of every address with unspent outputs, in the order they were first paid
+   template<typename F>
+   void for_each(F f) const
+   {
+      std::vector<uint64_t> balances(offsets_.size(), 0);
+      utxos_.for_each([&balances](const utxo_t& coin) { balances[coin.address_id] += coin.value; });
+      for (size_t id = 0; id < balances.size(); id++) {
+         if (balances[id] != 0)
+            f(key(static_cast<uint32_t>(id)), balances[id]);
+      }
+   }
+
+   //! outpoints added
+   uint64_t added() const { return added_; }
+   //! outpoints spent
+   uint64_t spent() const { return spent_; }
+   //! spends of outpoints that were not in the set
+   uint64_t missing() const { return missing_; }
+   //! outputs with several destinations credited to the first one
+   uint64_t shared_outputs() const { return shared_; }
+   size_t unspent() const { return utxos_.size(); }
+   //! addresses ever paid
+   size_t addresses() const { return offsets_.size(); }
+   //! bytes of the UTXO table, the owner keys and their index
+   size_t memory_usage() const
+   {
+      return utxos_.memory_usage() + arena_.capacity() + offsets_.capacity() * sizeof(uint64_t) +
+             slots_.size() * sizeof(uint32_t);
+   }
+
+private:
+   static constexpr uint32_t EMPTY = 0xffffffff;
+
+   utxo_set_t utxos_;
+   destination_batch_t dests_;
+   std::vector<unsigned char> arena_;   //!< keys as their length and bytes
+   std::vector<uint64_t> offsets_;      //!< owner id -> offset of its key in arena_
+   std::vector<uint32_t> slots_;        //!< owner ids by key hash, EMPTY for a free slot
+   uint64_t added_;
+   uint64_t spent_;
+   uint64_t missing_;
+   uint64_t shared_;
+
+   address_key_t key(uint32_t id) const;
+   bool equal(uint32_t id, const address_key_t& key) const;
+   uint32_t owner(const address_key_t& key);
+   void grow();
+};
+
+}
+
+#endif // BTC_UTILS_ADDRESS_BALANCES_H__
@@ -0,0 +1,72 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_ADDRESS_CACHE_H__
+#define BTC_UTILS_ADDRESS_CACHE_H__
+
+#include <address.h>
+#include <chainparams.h>
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace btc_utils
+{
+
+/**
+ * Cache of encoded addresses for destinations that are paid again and
+ * again, such as exchange and pool payout addresses.
+ *
+ * The cache is not synchronized, every thread keeps its own, and serves a
+ * single network as the key does not include it. Entries are
+ * evicted in CLOCK order, addresses are stored in an arena of fixed size
+ * slots and returned as views into it. An index table with linear probing
+ * and backward shift deletion maps address keys to entries.
+ */
+class address_cache_t
+{
+public:
+   explicit address_cache_t(size_t capacity = 1u << 16);
+
+   address_cache_t(const address_cache_t&) = delete;
+   address_cache_t& operator=(const address_cache_t&) = delete;
+
+   //! encoded address of the destination on the network Params, valid until the next call
+   template<typename Params>
+   std::string_view encode(const tx_destination_t& dest);
+   //! encoded address of the destination on the network
+   std::string_view encode(const tx_destination_t& dest, network_t network = g_network);
+
+   uint64_t hits(txnouttype type) const { return hits_[type]; }
+   uint64_t misses(txnouttype type) const { return misses_[type]; }
+   size_t memory_usage() const;
+
+private:
+   static constexpr uint32_t EMPTY = 0xffffffff;
+   static constexpr size_t TYPES = TX_WITNESS_V1_TAPROOT + 1;
+
+   struct entry_t
+   {
+      address_key_t key;
+      uint64_t hash;
+      unsigned char len;      //!< length of the address, 0 for an unused entry
+      bool referenced;        //!< hit since the clock hand passed
+   };
+
+   std::vector<entry_t> entries_;
+   std::vector<char> arena_;      //!< MAX_ADDRESS_SIZE bytes per entry
+   std::vector<uint32_t> index_;  //!< entry numbers, twice as many slots as entries
+   size_t hand_;
+   std::array<uint64_t, TYPES> hits_;
+   std::array<uint64_t, TYPES> misses_;
+
+   size_t home(uint64_t hash) const { return static_cast<size_t>(hash) & (index_.size() - 1); }
+   void erase(uint32_t entry);
+};
+
+}
+
+#endif // BTC_UTILS_ADDRESS_CACHE_H__
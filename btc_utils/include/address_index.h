@@ -0,0 +1,103 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_ADDRESS_INDEX_H__
+#define BTC_UTILS_ADDRESS_INDEX_H__
+
+#include <address.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace btc_utils
+{
+
+/**
+ * On-disk index from address to the positions of the blocks that pay to it.
+ *
+ * Addresses are identified by their address_key_t. A block position is
+ * (file number << 32) | offset of the block data in the file.
+ *
+ * File layout, all integers are little endian:
+ *   header: "BTCADIX1", bucket bits (4), reserved (4), number of keys (8),
+ *           offset of the bucket table (8)
+ *   entries sorted by key hash, each one is
+ *           key length (1), key, postings size in bytes (varint),
+ *           number of postings (varint), delta coded positions (varints)
+ *   bucket table: 2^bits + 1 offsets of the first entry of every bucket,
+ *           a bucket is the top bits of the key hash
+ */
+struct address_posting_t
+{
+   uint64_t hash;
+   uint64_t pos;
+   address_key_t key;
+
+   address_posting_t() : hash(0), pos(0) {}
+   address_posting_t(const tx_destination_t& dest, uint64_t block_pos);
+
+   bool operator<(const address_posting_t& other) const;
+   bool same_key(const address_posting_t& other) const;
+};
+
+inline uint64_t make_block_pos(uint32_t file, uint32_t offset)
+{
+   return (static_cast<uint64_t>(file) << 32) | offset;
+}
+
+/**
+ * Builder of the address index. Postings of every block file are sorted
+ * and stored as a run file next to the index, finish() merges the runs.
+ * add_run() may be called from several threads at once.
+ */
+class address_index_writer_t
+{
+public:
+   explicit address_index_writer_t(const std::string& path);
+   ~address_index_writer_t();
+
+   address_index_writer_t(const address_index_writer_t&) = delete;
+   address_index_writer_t& operator=(const address_index_writer_t&) = delete;
+
+   void add_run(std::vector<address_posting_t>& postings);
+   //! merge the runs into the index file, returns the number of keys
+   uint64_t finish();
+
+private:
+   std::string path_;
+   std::mutex mutex_;
+   std::vector<std::string> runs_;
+   uint64_t postings_;
+   unsigned int next_run_;
+
+   std::string run_path();
+};
+
+/** Read only view of an index file mapped into memory */
+class address_index_t
+{
+public:
+   explicit address_index_t(const std::string& path);
+   ~address_index_t();
+
+   address_index_t(const address_index_t&) = delete;
+   address_index_t& operator=(const address_index_t&) = delete;
+
+   //! block positions of the destination in ascending order
+   std::vector<uint64_t> find(const tx_destination_t& dest) const;
+   uint64_t size() const { return keys_; }
+
+private:
+   const unsigned char* data_;
+   size_t len_;
+   unsigned int bits_;
+   uint64_t keys_;
+   const unsigned char* table_;
+};
+
+}
+
+#endif // BTC_UTILS_ADDRESS_INDEX_H__
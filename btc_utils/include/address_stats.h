@@ -0,0 +1,160 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_ADDRESS_STATS_H__
+#define BTC_UTILS_ADDRESS_STATS_H__
+
+#include <address.h>
+#include <serialize.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace btc_utils
+{
+
+/** What an address received: heights of the first and the last block paying to it, outputs and value */
+struct address_stats_t
+{
+   uint32_t first_height;
+   uint32_t last_height;
+   uint64_t outputs;
+   uint64_t received;
+
+   void merge(const address_stats_t& other)
+   {
+      first_height = std::min(first_height, other.first_height);
+      last_height = std::max(last_height, other.last_height);
+      outputs += other.outputs;
+      received += other.received;
+   }
+};
+
+template<>
+struct serialize_traits_t<address_stats_t>
+{
+   static constexpr auto fields = std::make_tuple(&address_stats_t::first_height, &address_stats_t::last_height,
+                                                  &address_stats_t::outputs, &address_stats_t::received);
+};
+
+/**
+ * Open addressing table from address keys to their statistics, not
+ * synchronized. Slots are 32 bytes: the key hash, the received value, the
+ * offset of the key in an arena, the heights and the output count. Keys are
+ * stored once in the arena as their length and bytes, 22 or 34 bytes for
+ * most addresses. The home slot is taken from the top bits of the hash, so
+ * the slots are close to hash order.
+ */
+class address_stats_table_t
+{
+public:
+   //! the slots and keys of the table take at most max_memory bytes
+   explicit address_stats_table_t(size_t max_memory = std::numeric_limits<size_t>::max(), size_t capacity = 1u << 16);
+
+   /**
+    * Add the statistics of the address with the key of the hash. Returns
+    * false, changing nothing, when the address is new and does not fit.
+    */
+   bool merge(const address_key_t& key, uint64_t hash, const address_stats_t& stats);
+
+   size_t size() const { return size_; }
+   //! bytes of the slots and the keys
+   size_t memory_usage() const { return slots_.size() * sizeof(slot_t) + arena_.size(); }
+   //! forget the addresses, keeping the memory
+   void clear();
+
+   //! call f(key, hash, stats) for every address in the order of the hash and then the key
+   void for_each_sorted(const std::function<void(const address_key_t&, uint64_t, const address_stats_t&)>& f) const;
+
+private:
+   static constexpr uint32_t EMPTY = 0xffffffff;
+
+   struct slot_t
+   {
+      uint64_t hash;
+      uint64_t received;
+      uint32_t key;           //!< offset of the key in arena_, EMPTY for a free slot
+      uint32_t first_height;
+      uint32_t last_height;
+      uint32_t outputs;       //!< saturates at 2^32 - 1
+   };
+
+   size_t max_memory_;
+   std::vector<slot_t> slots_;
+   std::vector<unsigned char> arena_;
+   size_t size_;
+   unsigned int shift_;       //!< 64 - log2 of the slot count
+
+   bool equal(const slot_t& slot, const address_key_t& key) const
+   {
+      return arena_[slot.key] == key.len_ && memcmp(&arena_[slot.key + 1], key.data_.data(), key.len_) == 0;
+   }
+   address_key_t key(const slot_t& slot) const;
+   size_t find(const address_key_t& key, uint64_t hash) const;
+   void grow();
+};
+
+/**
+ * Statistics of the addresses paid by outputs added from several threads, in
+ * bounded memory. Every thread adds to a table of its own. When a new address
+ * does not fit into the share of the memory limit of the thread, the table is
+ * written to a run file sorted by key hash and cleared. finish() merges the runs
+ * and the tables one partition of the hash range at a time, so it only needs
+ * the memory of the addresses of a partition. Run files are named after
+ * run_path and are removed with the aggregator.
+ */
+class address_aggregator_t
+{
+public:
+   static constexpr unsigned int PARTITION_BITS = 8;
+
+   address_aggregator_t(const std::string& run_path, size_t memory_limit, unsigned int threads);
+   ~address_aggregator_t();
+
+   address_aggregator_t(const address_aggregator_t&) = delete;
+   address_aggregator_t& operator=(const address_aggregator_t&) = delete;
+
+   //! an output of the block at height pays value to the destination; thread is below the thread count
+   void add(unsigned int thread, const tx_destination_t& dest, uint32_t height, uint64_t value);
+
+   /**
+    * Call f(key, stats) once for every address in the order of the key hash,
+    * after all threads finished adding. Returns the number of addresses.
+    */
+   uint64_t finish(const std::function<void(const address_key_t&, const address_stats_t&)>& f);
+
+   //! run files written so far
+   unsigned int runs() const { return next_run_; }
+   //! largest memory usage of a table
+   size_t peak_memory() const { return peak_memory_; }
+
+private:
+   /** Run file with the offsets of the partitions in it */
+   struct run_t
+   {
+      std::string path;
+      std::vector<uint64_t> offsets;    //!< start of every partition, then the end of the file
+   };
+
+   std::string run_path_;
+   size_t thread_limit_;
+   std::vector<std::unique_ptr<address_stats_table_t>> tables_;
+   std::mutex mutex_;
+   std::vector<run_t> runs_;
+   unsigned int next_run_;
+   size_t peak_memory_;
+
+   void spill(address_stats_table_t& table);
+};
+
+}
+
+#endif // BTC_UTILS_ADDRESS_STATS_H__
@@ -7,13 +7,17 @@
 // separator character (1), and a base32 data section, the last
 // 6 characters of which are a checksum.
 //
-// For more information, see BIP 173.
+// For more information, see BIP 173 and BIP 350.
 
 #ifndef BTC_UTILS_BECH32_H
 #define BTC_UTILS_BECH32_H
 
 #include <stdint.h>
+#include <array>
+#include <cstddef>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace btc_utils
@@ -46,11 +50,87 @@ bool ConvertBits(const O& outfn, I it, I end) {
 namespace bech32
 {
 
-/** Encode a Bech32 string. If hrp contains uppercase characters, this will cause an assertion error. */
-std::string Encode(const std::string& hrp, const std::vector<uint8_t>& values);
+/** The values {2^n}k(x) for the set bits n of every c0, where k(x) = x^6 mod g(x) is
+ *  {29}x^5 + {22}x^4 + {20}x^3 + {21}x^2 + {29}x + {18}:
+ *     k(x) = 0x3b6a57b2,  {2}k(x) = 0x26508e6d,  {4}k(x) = 0x1ea119fa,
+ *  {8}k(x) = 0x3d4233dd, {16}k(x) = 0x2a1462b3 */
+constexpr std::array<uint32_t, 32> MakeGeneratorTable()
+{
+    constexpr uint32_t k[5] = {0x3b6a57b2, 0x26508e6d, 0x1ea119fa, 0x3d4233dd, 0x2a1462b3};
+    std::array<uint32_t, 32> table{};
+    for (size_t c0 = 0; c0 < 32; ++c0) {
+        for (size_t n = 0; n < 5; ++n) {
+            if (c0 & (1u << n)) table[c0] ^= k[n];
+        }
+    }
+    return table;
+}
+
+constexpr std::array<uint32_t, 32> GENERATOR_TABLE = MakeGeneratorTable();
+
+/** Process one more value v_i of the PolyMod input, see PolyMod in bech32.cpp for the details. */
+constexpr uint32_t PolyModStep(uint32_t c, uint8_t v_i)
+{
+    // We want to update `c` to correspond to a polynomial with one extra term. If the initial
+    // value of `c` consists of the coefficients of c(x) = f(x) mod g(x), we modify it to
+    // correspond to c'(x) = (f(x) * x + v_i) mod g(x), where v_i is the next input to
+    // process. Simplifying:
+    // c'(x) = (f(x) * x + v_i) mod g(x)
+    //         ((f(x) mod g(x)) * x + v_i) mod g(x)
+    //         (c(x) * x + v_i) mod g(x)
+    // If c(x) = c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5, we want to compute
+    // c'(x) = (c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5) * x + v_i mod g(x)
+    //       = c0*x^6 + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i mod g(x)
+    //       = c0*(x^6 mod g(x)) + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i
+    // If we call (x^6 mod g(x)) = k(x), this can be written as
+    // c'(x) = (c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + v_i) + c0*k(x)
+    // c0*k(x) is looked up instead of adding {2^n}k(x) for each set bit n of c0.
+    return (((c & 0x1ffffff) << 5) ^ v_i) ^ GENERATOR_TABLE[c >> 25];
+}
+
+/** PolyMod state after the expanded HRP: the high bits of every character, a zero, and the
+ *  low bits. A constant expression for a constant HRP. */
+constexpr uint32_t PolyModHRP(std::string_view hrp)
+{
+    uint32_t c = 1;
+    for (const char ch : hrp) {
+        c = PolyModStep(c, static_cast<uint8_t>(static_cast<unsigned char>(ch) >> 5));
+    }
+    c = PolyModStep(c, 0);
+    for (const char ch : hrp) {
+        c = PolyModStep(c, static_cast<uint8_t>(static_cast<unsigned char>(ch) & 0x1f));
+    }
+    return c;
+}
+
+
+enum class Encoding {
+    INVALID, //!< Failed decoding
+
+    BECH32,  //!< Bech32 encoding as defined in BIP173, used by witness v0
+    BECH32M, //!< Bech32m encoding as defined in BIP350, used by witness v1+
+};
+
+/** Encode a Bech32 or Bech32m string into out, which must have room for hrp, the separator,
+ *  the values and 6 checksum characters, without allocating. hrp must be lowercase and
+ *  hrp_state must be PolyModHRP(hrp). Returns the length of the string. */
+size_t Encode(Encoding encoding, std::string_view hrp, uint32_t hrp_state, const uint8_t* values, size_t size, char* out);
+
+/** Encode a Bech32 or Bech32m string. If hrp contains uppercase characters, this throws std::runtime_error. */
+std::string Encode(Encoding encoding, const std::string& hrp, const std::vector<uint8_t>& values);
+
+struct DecodeResult
+{
+    Encoding encoding;         //!< What encoding was detected in the result; Encoding::INVALID if failed.
+    std::string hrp;           //!< The human readable part
+    std::vector<uint8_t> data; //!< The payload (excluding checksum)
+
+    DecodeResult() : encoding(Encoding::INVALID) {}
+    DecodeResult(Encoding enc, std::string&& h, std::vector<uint8_t>&& d) : encoding(enc), hrp(std::move(h)), data(std::move(d)) {}
+};
 
-/** Decode a Bech32 string. Returns (hrp, data). Empty hrp means failure. */
-std::pair<std::string, std::vector<uint8_t>> Decode(const std::string& str);
+/** Decode a Bech32 or Bech32m string. */
+DecodeResult Decode(const std::string& str);
 
 } // namespace bech32
 } // namespace btc_utils
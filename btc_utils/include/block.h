@@ -6,6 +6,7 @@
 #define BTC_UTILS_BLOCK_H__
 
 #include <crypto.h>
+#include <serialize.h>
 #include <transaction.h>
 
 #include <vector>
@@ -13,9 +14,12 @@
 namespace btc_utils
 {
 
-class block_t
+/** Block header, the first 80 bytes of a block */
+class block_header_t
 {
 public:
+   static constexpr size_t SIZE = 80;
+
    uint32_t version_;
    uint256_t prev_block_hash_;
    uint256_t merkle_root_;
@@ -23,20 +27,55 @@ public:
    uint32_t bits_;
    uint32_t nonce_;
 
+   //! block hash, double SHA-256 of the serialized header
+   uint256_t hash() const;
+};
+
+template<>
+struct serialize_traits_t<block_header_t>
+{
+   static constexpr auto fields = std::make_tuple(&block_header_t::version_, &block_header_t::prev_block_hash_,
+                                                  &block_header_t::merkle_root_, &block_header_t::time_,
+                                                  &block_header_t::bits_, &block_header_t::nonce_);
+};
+
+static_assert(fixed_width<block_header_t>::value == block_header_t::SIZE, "a header is 80 bytes");
+
+/** Header in its serialized form, the members that select and link blocks are decoded when asked for */
+class block_header_view_t : public fixed_view_t<block_header_t>
+{
+public:
+   using fixed_view_t::fixed_view_t;
+
+   //! hash of the bytes in place, without encoding the header again
+   uint256_t hash() const { return hash_sha256d(data(), SIZE); }
+   uint256_t prev_block_hash() const { return get<1>(); }
+   uint32_t time() const { return get<3>(); }
+   uint32_t bits() const { return get<4>(); }
+
+   //! whether the bytes can be the header of a block: a positive version, and a previous hash that
+   //! is null or below the proof of work limit of every network, so with the top bit clear
+   bool plausible() const
+   {
+      uint32_t version = get<0>();
+      return version >= 1 && version <= 0x7fffffffu && data()[4 + 31] < 0x80;
+   }
+};
+
+class block_t : public block_header_t
+{
+public:
    std::vector<transaction_t> txes_;
 
    template<typename T>
    void unserialize(T& data_source)
    {
-      data_source.unserialize(version_);
-      data_source.unserialize(prev_block_hash_);
-      data_source.unserialize(merkle_root_);
-      data_source.unserialize(time_);
-      data_source.unserialize(bits_);
-      data_source.unserialize(nonce_);
+      data_source.unserialize(static_cast<block_header_t&>(*this));
       data_source.unserialize(txes_);
    }
 
+   //! deserialize a block that was checked when it was read, the vectors keep their storage
+   void decode(const unsigned char* data, tx_hashes_t hashes);
 };
 
 }
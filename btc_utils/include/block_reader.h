@@ -0,0 +1,490 @@
+// Copyright (c) 2020 gladcow
+// Copyright (c) 2009-2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_BLOCK_READER_H__
+#define BTC_UTILS_BLOCK_READER_H__
+
+#include <block.h>
+#include <buffered_file.h>
+#include <chainparams.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace btc_utils
+{
+
+//! path of the block file blk<index>.dat of the directory
+std::string get_block_file_path(const std::string& dir, uint32_t index);
+
+//! block hashes are uniformly distributed, their first bytes are a good hash
+struct block_hash_hasher_t
+{
+   size_t operator()(const uint256_t& hash) const
+   {
+      size_t res;
+      memcpy(&res, hash.data(), sizeof(res));
+      return res;
+   }
+};
+
+/** Page cache hint for a whole block file */
+enum block_file_advice_t
+{
+   BLOCK_FILE_WILLNEED,    //!< read it into the page cache in the background
+   BLOCK_FILE_DONTNEED,    //!< drop its pages from the page cache
+};
+
+//! pass the hint to the kernel, false when the file cannot be opened or the hint fails
+bool advise_block_file(const std::string& dir, uint32_t index, block_file_advice_t advice);
+
+//! share of the pages of the block file in the page cache, 0 when it cannot be mapped
+double block_file_residency(const std::string& dir, uint32_t index);
+
+/**
+ * Heights and block times to read, both inclusive. Heights are not in the block files, so a
+ * height range is resolved by index_block_headers into the hashes of the blocks in the range and
+ * the block files holding any of them.
+ */
+struct block_filter_t
+{
+   uint32_t from_height = 0;
+   uint32_t to_height = std::numeric_limits<uint32_t>::max();
+   uint32_t from_time = 0;
+   uint32_t to_time = std::numeric_limits<uint32_t>::max();
+   std::unordered_set<uint256_t, block_hash_hasher_t> blocks; //!< blocks in the height range
+   std::vector<bool> files;                                  //!< block files with blocks in the range
+
+   bool by_height() const { return from_height != 0 || to_height != std::numeric_limits<uint32_t>::max(); }
+   bool active() const { return by_height() || from_time != 0 || to_time != std::numeric_limits<uint32_t>::max(); }
+
+   bool accepts(const block_header_view_t& header) const
+   {
+      uint32_t time = header.time();
+      if (time < from_time || time > to_time)
+         return false;
+      return !by_height() || blocks.count(header.hash()) != 0;
+   }
+
+   bool accepts_file(uint32_t file) const
+   {
+      return !by_height() || (file < files.size() && files[file]);
+   }
+};
+
+/**
+ * Page cache hints for the block files of a directory read in file order. When a file is begun the
+ * kernel is asked to read the readahead files after it in the background, so a cold directory is
+ * read from disk while the file before is parsed. When drop is set, the pages of a file that was
+ * read are dropped afterwards unless most of it was cached before, so a scan does not evict the
+ * working set of a node. The calls may come from several threads.
+ */
+class block_file_cache_t
+{
+public:
+   //! files the filter rejects are not read ahead
+   block_file_cache_t(const std::string& dir, unsigned int readahead, bool drop, const block_filter_t* filter = nullptr);
+
+   block_file_cache_t(const block_file_cache_t&) = delete;
+   block_file_cache_t& operator=(const block_file_cache_t&) = delete;
+
+   //! the file is about to be read
+   void begin(uint32_t file);
+   //! every block of the file was read
+   void end(uint32_t file);
+
+   //! files read ahead
+   uint32_t prefetched() const { return prefetched_; }
+   //! files whose pages were dropped
+   uint32_t dropped() const { return dropped_; }
+
+private:
+   std::string dir_;
+   unsigned int readahead_;
+   bool drop_;
+   const block_filter_t* filter_;
+   std::mutex mutex_;
+   bool started_;             //!< a file was begun
+   uint32_t checked_;         //!< files from the first begun to before it were looked at by begin
+   std::unordered_map<uint32_t, bool> warm_;   //!< files looked at, mostly cached before the first look
+   uint32_t prefetched_;
+   uint32_t dropped_;
+};
+
+/** Blocks passed through a chain_linker_t */
+struct chain_linker_stats_t
+{
+   uint64_t blocks = 0;       //!< blocks emitted in chain order
+   uint64_t stale = 0;        //!< blocks of branches the best chain left behind, dropped
+   uint64_t unlinked = 0;     //!< blocks whose previous block never came, dropped
+   uint64_t duplicates = 0;   //!< blocks met again, ignored
+   uint64_t early = 0;        //!< blocks emitted before depth blocks were on top as the buffer was full
+   uint64_t peak_blocks = 0;  //!< most blocks buffered at once
+   uint64_t peak_bytes = 0;   //!< most serialized bytes of blocks buffered at once
+   uint64_t total_delay = 0;  //!< blocks added while the emitted blocks waited, summed
+   uint64_t max_delay = 0;    //!< most blocks added while a block waited
+   double max_seconds = 0;    //!< longest time a block waited
+};
+
+/**
+ * Reorder buffer turning the blocks of the block files, which are in the order they were
+ * downloaded and include the blocks of stale branches, into the blocks of the best chain in
+ * height order. Blocks are linked by their previous block hash; a block without a previous one
+ * has height 0. The chain with the most work, summed from the targets of the headers, is the best
+ * one and the first one met wins a tie. A block of it is emitted once depth blocks are on top of
+ * it, then the other branches forking below it are stale and dropped, as are blocks linking to
+ * it later.
+ *
+ * Blocks are buffered in their serialized form until they are emitted or dropped. When their
+ * size, 80 bytes for a header, goes over max_memory, the best chain is emitted without waiting for depth blocks on top of it, then the
+ * blocks whose previous block is missing are dropped, the first ones added first.
+ */
+class chain_linker_t
+{
+public:
+   //! gets the serialized block with the file and position it was read at and its height
+   typedef std::function<void(const std::vector<unsigned char>&, uint32_t, uint64_t, uint32_t)> emit_t;
+
+   chain_linker_t(unsigned int depth, uint64_t max_memory, emit_t emit);
+
+   chain_linker_t(const chain_linker_t&) = delete;
+   chain_linker_t& operator=(const chain_linker_t&) = delete;
+
+   //! a serialized block read at pos of the file
+   void add(std::vector<unsigned char>&& block, uint32_t file, uint64_t pos);
+   //! a block left unread, only its header links the chain and it is not emitted
+   void add_header(const block_header_t& header);
+   //! no more blocks: emit the rest of the best chain, drop the other blocks
+   void finish();
+
+   //! the block was added, emitted or dropped as stale lately
+   bool knows(const uint256_t& hash) const { return nodes_.count(hash) || settled_.count(hash); }
+
+   //! height of the next block to emit
+   uint32_t height() const { return next_height_; }
+   const chain_linker_stats_t& stats() const { return stats_; }
+
+private:
+   struct node_t
+   {
+      uint256_t hash;
+      uint256_t prev;
+      uint32_t bits;
+      node_t* parent;
+      std::vector<node_t*> children;
+      bool linked;
+      uint32_t height;
+      double work;                     //!< chain work up to the block
+      std::vector<unsigned char> block; //!< the serialized block, empty for a header
+      uint32_t file;
+      uint64_t pos;
+      uint64_t size;                   //!< buffered bytes
+      uint64_t seq;                    //!< blocks added before it
+      std::chrono::steady_clock::time_point added;
+   };
+
+   //! emitted and stale blocks remembered to tell the stale blocks met later from unlinked ones
+   static constexpr size_t SETTLED_WINDOW = 4096;
+
+   unsigned int depth_;
+   uint64_t max_memory_;
+   emit_t emit_;
+   std::unordered_map<uint256_t, std::unique_ptr<node_t>, block_hash_hasher_t> nodes_;
+   //! blocks whose previous block was not met by its hash
+   std::unordered_multimap<uint256_t, node_t*, block_hash_hasher_t> orphans_;
+   std::unordered_set<uint256_t, block_hash_hasher_t> settled_;
+   std::deque<uint256_t> settled_order_;
+   node_t* root_;             //!< last block emitted, nullptr before the first one
+   node_t* tip_;              //!< linked block with the most work
+   uint32_t next_height_;
+   uint64_t seq_;
+   uint64_t buffered_blocks_;
+   uint64_t buffered_bytes_;
+   chain_linker_stats_t stats_;
+
+   void insert(std::unique_ptr<node_t> node);
+   void link(node_t* node);
+   void emit_next();
+   void settle(const uint256_t& hash);
+   void drop(node_t* node, bool stale);
+   void release(node_t& node);
+};
+
+//! buffer of a block file reader, room for the largest block and for rewinding over it
+constexpr uint64_t BLOCK_FILE_BUFFER_SIZE = 8000000;
+//! buffer of the header index, big enough for a few headers as the transactions are skipped
+constexpr uint64_t HEADER_INDEX_BUFFER_SIZE = 64 << 10;
+
+/**
+ * Read the blocks of the network whose header starts in [nBegin, nEnd) of the file, the file is
+ * closed afterwards. on_block gets the bytes of every block with the position of its data and the
+ * position where the search for the next block starts. The bytes are checked as deserializing the
+ * block would check them, so block_view_t and block_t::decode can read them in place; the vector
+ * is reused for the next block unless on_block moves it away. A block follows from the position the search
+ * starts at and the file contents alone, so parts of a file can be read apart and joined where
+ * the positions meet.
+ *
+ * The header of a block is read first and accept decides whether the rest is read, it gets a
+ * block_header_view_t of the header bytes and decodes only the members it looks at. The
+ * transactions of a block it rejects are skipped by its size, seeking past them when they are
+ * not buffered yet, and on_skip gets the positions instead of on_block. A rejected header that
+ * is not plausible came from a false match of the magic, its size is not trusted and the search
+ * goes on after the magic, as it does for a block that does not deserialize. A small buffer reads
+ * little more than the headers of rejected blocks.
+ *
+ * Blocks that do not deserialize and exceptions thrown by on_block are passed to on_error, the
+ * search for blocks goes on after them.
+ */
+template<typename A, typename F, typename S, typename E>
+void read_block_file_range(FILE* f, network_t network, uint64_t nBegin, uint64_t nEnd,
+                           A accept, F on_block, S on_skip, E on_error,
+                           uint64_t nBufSize = BLOCK_FILE_BUFFER_SIZE)
+{
+   const start_marker_t& start = message_start(network);
+   try {
+       // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+       buffered_file_t blkdat(f, nBufSize, std::min<uint64_t>(MAX_BLOCK_SERIALIZED_SIZE+8, nBufSize/2));
+       std::vector<unsigned char> block;
+       if (nBegin && !blkdat.Seek(nBegin))
+           return;
+       uint64_t nRewind = blkdat.GetPos();
+       while (!blkdat.eof()) {
+           blkdat.SetPos(nRewind);
+           nRewind++; // start one byte further next time, in case of failure
+           blkdat.SetLimit(); // remove former limit
+           blkdat.clear();
+           uint32_t nSize = 0;
+           // locate a header
+           std::array<unsigned char, MESSAGE_START_SIZE> buf;
+           if (!blkdat.FindByte(start[0]) || blkdat.GetPos() >= nEnd)
+               break; // no valid block header found; don't complain
+           nRewind = blkdat.GetPos()+1;
+           if (!blkdat.read(buf.data(), MESSAGE_START_SIZE))
+               break;
+           if (memcmp(buf.data(), start, MESSAGE_START_SIZE))
+               continue;
+           // read size
+           if (!blkdat.read(reinterpret_cast<unsigned char*>(&nSize), sizeof(nSize)))
+               break;
+           if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+               continue;
+           // read block
+           uint64_t nBlockPos = blkdat.GetPos();
+           blkdat.SetLimit(nBlockPos + nSize);
+           blkdat.SetPos(nBlockPos);
+           unsigned char raw_header[block_header_t::SIZE];
+           blkdat.read(raw_header, sizeof(raw_header));
+           const block_header_view_t header(raw_header);
+           if (!blkdat.failed() && !accept(header)) {
+               if (!header.plausible())
+                   continue;
+               nRewind = nBlockPos + nSize;
+               blkdat.SetLimit();
+               if (!blkdat.Skip(nRewind))
+                   break;
+               on_skip(nBlockPos, nRewind);
+               continue;
+           }
+           uint64_t nTxCount = blkdat.read_vector_size();
+           for (uint64_t i = 0; i < nTxCount && !blkdat.failed(); i++)
+               skip_transaction(blkdat);
+           if (blkdat.failed()) {
+               on_error(std::string("Deserialize or I/O error - ") + get_read_status(blkdat.status()));
+               continue;
+           }
+           nRewind = blkdat.GetPos();
+           block.resize(nRewind - nBlockPos);
+           blkdat.copy(block.data(), nBlockPos, nRewind);
+           try {
+               on_block(block, nBlockPos, nRewind);
+           } catch (const std::exception& e) {
+               on_error(std::string("Error processing block - ") + e.what());
+           }
+       }
+   } catch (const std::runtime_error& e) {
+       on_error(std::string("System error: ") + e.what());
+   }
+}
+
+/** Block headers read by index_block_headers */
+struct header_index_stats_t
+{
+   uint64_t headers = 0;
+   uint32_t files = 0;
+   uint64_t orphans = 0;      //!< blocks linked to no block without a previous one
+   uint64_t stale = 0;        //!< blocks linked to one, off the chain with the most work
+};
+
+//! heights of blocks by block hash
+typedef std::unordered_map<uint256_t, uint32_t, block_hash_hasher_t> block_height_map_t;
+
+/**
+ * Read the headers of the blocks of the directory, skipping their transactions, and link them
+ * by the previous block hash to get their heights: a block without a previous block has height
+ * 0. Only the blocks of the chain with the most work, summed from the targets of the headers,
+ * get a height; the first tip met wins a tie. The blocks in the height and time range of the
+ * filter and the files holding them are kept in it, the heights of all blocks of the chain in
+ * heights when it is given. Blocks of stale branches and blocks linked to no block without a
+ * previous one have no height and are taken as out of the range.
+ */
+header_index_stats_t index_block_headers(const std::string& dir, network_t network, block_filter_t& filter,
+                                         block_height_map_t* heights = nullptr);
+
+/**
+ * Block passed to a visitor, only valid during the call.
+ *
+ * The view reads the serialized block in place: the header through a block_header_view_t, the
+ * transactions and their outputs through views that find their parts without copying them. The
+ * block is deserialized into a block_t only when block() is called.
+ */
+class block_view_t
+{
+public:
+   block_view_t(const unsigned char* data, size_t size, tx_hashes_t hashes, uint32_t fileIn, uint64_t posIn,
+                unsigned int threadIn);
+
+   uint32_t file;             //!< number of the block file
+   uint64_t pos;              //!< position of the block data in the file
+   unsigned int thread;       //!< reader thread making the call, below the thread count of the reader
+
+   block_header_view_t header() const { return block_header_view_t(data_); }
+   const unsigned char* data() const { return data_; }
+   //! serialized size
+   size_t size() const { return size_; }
+   uint64_t transactions() const;
+
+   //! call f with a view of every transaction, in the order of the block
+   template<typename F>
+   void for_each_transaction(F f) const
+   {
+      uint64_t count;
+      const unsigned char* p = data_ + block_header_t::SIZE;
+      p += decode_compact_int(p, count);
+      for (uint64_t i = 0; i < count; i++) {
+         transaction_view_t tx(p);
+         f(tx);
+         p += tx.size();
+      }
+   }
+
+   //! the block deserialized on the first call, with the transaction hashes of the reader options
+   const block_t& block() const;
+
+private:
+   const unsigned char* data_;
+   size_t size_;
+   tx_hashes_t hashes_;
+   mutable std::unique_ptr<block_t> block_;
+};
+
+/**
+ * Callbacks of a block_reader_t, the default ones do nothing. The transactions and outputs of a
+ * block are visited after the block itself, in the order of the block.
+ */
+class block_visitor_t
+{
+public:
+   virtual ~block_visitor_t() {}
+
+   //! a block file is opened, before its blocks are visited
+   virtual void begin_file(uint32_t /* file */, unsigned int /* thread */) {}
+   //! every block of the file was visited
+   virtual void end_file(uint32_t /* file */, unsigned int /* thread */) {}
+   virtual void on_block(const block_view_t& /* block */) {}
+   virtual void on_transaction(const block_view_t& /* block */, const transaction_view_t& /* tx */) {}
+   //! output n of the transaction
+   virtual void on_output(const block_view_t& /* block */, const transaction_view_t& /* tx */, uint32_t /* n */,
+                          const tx_out_view_t& /* out */) {}
+   //! a block could not be read or a block callback threw, reading goes on with the next block
+   virtual void on_error(uint32_t /* file */, const std::string& /* message */) {}
+};
+
+/** How a block_reader_t reads the directory */
+struct block_reader_options_t
+{
+   network_t network = g_network;
+   //! block files read at once, each by its own thread
+   unsigned int threads = 1;
+   uint64_t buffer_size = BLOCK_FILE_BUFFER_SIZE;
+   //! transaction hashes computed when a visitor deserializes a block through block_view_t::block()
+   tx_hashes_t hashes = TX_HASHES_NONE;
+   //! block files after the one being read that the kernel reads ahead, 0 for none
+   unsigned int readahead = 2;
+   //! drop the pages of a block file that was not cached before from the page cache once it is read
+   bool drop_cache = false;
+   //! blocks to read, a height range not indexed by index_block_headers yet is indexed first
+   block_filter_t filter;
+   //! visit the blocks of the best chain in height order through a chain_linker_t, reading the files by one thread
+   bool chain_order = false;
+   //! blocks on top of a block before it is visited in chain order
+   unsigned int chain_depth = 6;
+   //! serialized size of the blocks buffered for the chain order
+   uint64_t chain_memory = uint64_t(512) << 20;
+};
+
+/**
+ * Reader of the blocks of a block directory, blk00000.dat up to the first missing file, which
+ * passes the blocks, transactions and outputs to a visitor.
+ *
+ * With several threads every thread reads whole block files, so the visitor is called from all
+ * of them at once for different files; the calls for one file are made by one thread in file
+ * order. Exceptions thrown by begin_file and end_file stop the reader and are thrown again by
+ * read().
+ *
+ * In chain order a block is visited when the chain_linker_t emits it, which may be in a later
+ * file or after the end_file of the last file. Blocks the filter rejects still link the chain by
+ * their headers, so no block file is skipped.
+ */
+class block_reader_t
+{
+public:
+   explicit block_reader_t(const std::string& dir, const block_reader_options_t& options = block_reader_options_t());
+
+   void read(block_visitor_t& visitor);
+   //! stop reading, from a callback or another thread; the blocks left in the open files are skipped unread
+   void cancel() { cancelled_ = true; }
+
+   //! block files read, without the ones skipped
+   uint32_t files() const { return files_; }
+   //! block files without blocks in the range of the filter
+   uint32_t skipped_files() const { return skipped_files_; }
+   uint64_t blocks() const { return blocks_; }
+   //! blocks out of the range of the filter
+   uint64_t skipped_blocks() const { return skipped_blocks_; }
+   //! headers read for a height range
+   const header_index_stats_t& index_stats() const { return index_stats_; }
+   //! blocks put in chain order
+   const chain_linker_stats_t& chain_stats() const { return chain_stats_; }
+
+private:
+   std::string dir_;
+   block_reader_options_t options_;
+   uint32_t files_;
+   uint32_t skipped_files_;
+   uint64_t blocks_;
+   uint64_t skipped_blocks_;
+   header_index_stats_t index_stats_;
+   chain_linker_stats_t chain_stats_;
+   std::atomic<bool> cancelled_;
+};
+
+}
+
+#endif // BTC_UTILS_BLOCK_READER_H__
@@ -0,0 +1,123 @@
+/* Copyright (c) 2020 gladcow
+ * Distributed under the MIT software license, see the accompanying
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.
+ */
+
+#ifndef BTC_UTILS_C_H__
+#define BTC_UTILS_C_H__
+
+/**
+ * C interface of libbtc_utils.so, for callers in other languages.
+ *
+ * A reader walks the block files of a directory in a background thread and
+ * delivers the addresses paid by the outputs as fixed size records, copied in
+ * batches into arrays owned by the caller. Large batches keep the cost of a
+ * call across the language boundary small compared to the work per record.
+ *
+ * No C++ type crosses the interface. The structures only change together with
+ * BTC_UTILS_C_API_VERSION.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define BTC_UTILS_API __attribute__((visibility("default")))
+#else
+#define BTC_UTILS_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BTC_UTILS_C_API_VERSION 1
+
+/** room for the longest address of any network and its terminating zero */
+#define BTC_ADDRESS_SIZE 96
+
+enum btc_network
+{
+   BTC_MAINNET = 0,
+   BTC_TESTNET = 1,
+   BTC_REGTEST = 2
+};
+
+/** Kind of the output script, the values of txnouttype */
+enum btc_output_type
+{
+   BTC_OUTPUT_NONSTANDARD = 0,
+   BTC_OUTPUT_P2PK = 1,
+   BTC_OUTPUT_P2PKH = 2,
+   BTC_OUTPUT_P2SH = 3,
+   BTC_OUTPUT_MULTISIG = 4,
+   BTC_OUTPUT_NULL_DATA = 5,
+   BTC_OUTPUT_P2WSH = 6,
+   BTC_OUTPUT_P2WPKH = 7,
+   BTC_OUTPUT_WITNESS_UNKNOWN = 8,
+   BTC_OUTPUT_P2TR = 9
+};
+
+typedef struct btc_reader_options
+{
+   int network;               /**< enum btc_network */
+   unsigned int threads;      /**< block files read at once, records of different files interleave with more than one */
+   uint32_t from_height;      /**< heights and block times to read, both inclusive */
+   uint32_t to_height;
+   uint32_t from_time;
+   uint32_t to_time;
+   int txids;                 /**< compute the txids, the records have zero txids otherwise */
+} btc_reader_options_t;
+
+/** Address paid by an output, a multisig output has a record for every key */
+typedef struct btc_output_record
+{
+   char address[BTC_ADDRESS_SIZE];   /**< zero terminated */
+   uint8_t txid[32];                 /**< in block order, the reverse of the hex form */
+   uint64_t value;                   /**< in satoshis */
+   uint64_t block_pos;               /**< position of the block data in the block file */
+   uint32_t file;                    /**< number of the block file */
+   uint32_t vout;
+   int32_t type;                     /**< enum btc_output_type */
+   uint32_t reserved;
+} btc_output_record_t;
+
+typedef struct btc_reader btc_reader_t;
+
+/** BTC_UTILS_C_API_VERSION of the library */
+BTC_UTILS_API int btc_api_version(void);
+
+/** Defaults: mainnet, one thread, every block, with txids */
+BTC_UTILS_API void btc_reader_options_init(btc_reader_options_t* options);
+
+/**
+ * Start reading blk00000.dat and the following block files of the directory,
+ * options may be NULL for the defaults. Returns NULL with the reason in
+ * btc_last_error() when there is no block file or an option is invalid.
+ */
+BTC_UTILS_API btc_reader_t* btc_reader_open(const char* dir, const btc_reader_options_t* options);
+
+/**
+ * Copy the next records into the array, waiting for the reader thread. Fewer
+ * than capacity records are only returned when every block was read, 0 then.
+ * Returns -1 with the reason in btc_reader_error() when reading failed.
+ */
+BTC_UTILS_API int64_t btc_reader_next(btc_reader_t* reader, btc_output_record_t* records, size_t capacity);
+
+/** Blocks that could not be deserialized and were skipped so far */
+BTC_UTILS_API uint64_t btc_reader_errors(btc_reader_t* reader);
+
+/** Why btc_reader_next() failed, valid until the reader is closed */
+BTC_UTILS_API const char* btc_reader_error(btc_reader_t* reader);
+
+/** Stop the reader thread, the records not fetched yet are dropped */
+BTC_UTILS_API void btc_reader_close(btc_reader_t* reader);
+
+/** Why the last btc_reader_open() of the calling thread failed */
+BTC_UTILS_API const char* btc_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BTC_UTILS_C_H__ */
@@ -0,0 +1,387 @@
+// Copyright (c) 2020 gladcow
+// Copyright (c) 2009-2019 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_BUFFERED_FILE_H__
+#define BTC_UTILS_BUFFERED_FILE_H__
+
+#include <crypto.h>
+#include <serialize.h>
+#include <transaction.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+#include <ios>
+#include <limits>
+#include <vector>
+
+namespace btc_utils
+{
+
+//! largest size of a serialized vector
+static const unsigned int MAX_SIZE = 0x02000000;
+
+/** Non-refcounted RAII wrapper around a FILE* that implements a ring buffer to
+ *  deserialize from. It guarantees the ability to rewind a given number of bytes.
+ *  Reads do not throw, the first failure is kept in status() until clear().
+ *
+ *  Will automatically close the file when it goes out of scope if not null.
+ *  If you need to close the file early, use file.fclose() instead of fclose(file).
+ */
+class buffered_file_t
+{
+private:
+    FILE *src;            //!< source file
+    uint64_t nSrcPos;     //!< how many bytes have been read from source
+    uint64_t nReadPos;    //!< how many bytes have been read from this
+    uint64_t nReadLimit;  //!< up to which position we're allowed to read
+    uint64_t nRewind;     //!< how many bytes we guarantee to rewind
+    std::vector<char> vchBuf; //!< the buffer
+    tx_hashes_t nTxHashes; //!< transaction hashes computed while deserializing
+    read_status_t nStatus; //!< first failure since the last clear()
+
+protected:
+    //! read data from the source to fill the buffer
+    bool Fill() {
+        size_t pos = nSrcPos % vchBuf.size();
+        size_t readNow = vchBuf.size() - pos;
+        size_t nAvail = vchBuf.size() - (nSrcPos - nReadPos) - nRewind;
+        if (nAvail < readNow)
+            readNow = nAvail;
+        if (readNow == 0)
+            return false;
+        size_t nBytes = fread(&vchBuf[pos], 1, readNow, src);
+        if (nBytes == 0) {
+            fail(feof(src) ? READ_END_OF_FILE : READ_IO_ERROR);
+            return false;
+        }
+        nSrcPos += nBytes;
+        return true;
+    }
+
+public:
+    buffered_file_t(FILE *fileIn, uint64_t nBufSize, uint64_t nRewindIn) :
+        nSrcPos(0), nReadPos(0), nReadLimit(std::numeric_limits<uint64_t>::max()), nRewind(nRewindIn), vchBuf(nBufSize, 0), nTxHashes(TX_HASHES_NONE), nStatus(READ_OK)
+    {
+        if (nRewindIn >= nBufSize)
+            throw std::ios_base::failure("Rewind limit must be less than buffer size");
+        src = fileIn;
+    }
+
+    ~buffered_file_t()
+    {
+        fclose();
+    }
+
+    // Disallow copies
+    buffered_file_t(const buffered_file_t&) = delete;
+    buffered_file_t& operator=(const buffered_file_t&) = delete;
+
+    void fclose()
+    {
+        if (src) {
+            ::fclose(src);
+            src = nullptr;
+        }
+    }
+
+    //! check whether we're at the end of the source file
+    bool eof() const {
+        return nReadPos == nSrcPos && feof(src);
+    }
+
+    //! record the first failure
+    void fail(read_status_t status) {
+        if (nStatus == READ_OK)
+            nStatus = status;
+    }
+
+    bool failed() const {
+        return nStatus != READ_OK;
+    }
+
+    read_status_t status() const {
+        return nStatus;
+    }
+
+    void clear() {
+        nStatus = READ_OK;
+    }
+
+    //! read a number of bytes, zeros are returned after a failure
+    bool read(unsigned char *pch, size_t nSize) {
+        if (nStatus == READ_OK && nSize + nReadPos > nReadLimit)
+            fail(READ_PAST_LIMIT);
+        while (nSize > 0) {
+            if (nStatus != READ_OK || (nReadPos == nSrcPos && !Fill())) {
+                memset(pch, 0, nSize);
+                return false;
+            }
+            size_t pos = nReadPos % vchBuf.size();
+            size_t nNow = nSize;
+            if (nNow + pos > vchBuf.size())
+                nNow = vchBuf.size() - pos;
+            if (nNow + nReadPos > nSrcPos)
+                nNow = nSrcPos - nReadPos;
+            memcpy(pch, &vchBuf[pos], nNow);
+            nReadPos += nNow;
+            pch += nNow;
+            nSize -= nNow;
+        }
+        return true;
+    }
+
+    //! move past a number of bytes with the checks of read
+    bool ignore(size_t nSize) {
+        if (nStatus == READ_OK && nSize + nReadPos > nReadLimit)
+            fail(READ_PAST_LIMIT);
+        while (nSize > 0) {
+            if (nStatus != READ_OK || (nReadPos == nSrcPos && !Fill()))
+                return false;
+            size_t nNow = nSize;
+            if (nNow + nReadPos > nSrcPos)
+                nNow = nSrcPos - nReadPos;
+            nReadPos += nNow;
+            nSize -= nNow;
+        }
+        return true;
+    }
+
+    uint8_t readdata8()
+    {
+       uint8_t obj;
+       read(&obj, 1);
+       return obj;
+    }
+
+    uint16_t readdata16()
+    {
+       uint16_t obj;
+       read(reinterpret_cast<unsigned char*>(&obj), 2);
+       return le16toh(obj);
+    }
+
+    uint32_t readdata32()
+    {
+       uint32_t obj;
+       read(reinterpret_cast<unsigned char*>(&obj), 4);
+       return le32toh(obj);
+    }
+
+    uint64_t readdata64()
+    {
+       uint64_t obj;
+       read(reinterpret_cast<unsigned char*>(&obj), 8);
+       return le64toh(obj);
+    }
+
+    uint64_t read_compact_int()
+    {
+        uint8_t ci_size = readdata8();
+        uint64_t res = 0;
+        if (ci_size < 253)
+        {
+            res = ci_size;
+        }
+        else if (ci_size == 253)
+        {
+            res = readdata16();
+            if (res < 253)
+                fail(READ_NON_CANONICAL);
+        }
+        else if (ci_size == 254)
+        {
+            res = readdata32();
+            if (res < 0x10000u)
+                fail(READ_NON_CANONICAL);
+        }
+        else
+        {
+            res = readdata64();
+            if (res < 0x100000000ULL)
+                fail(READ_NON_CANONICAL);
+        }
+        if (res > static_cast<uint64_t>(MAX_SIZE))
+            fail(READ_TOO_LARGE);
+        return failed() ? 0 : res;
+    }
+
+    //! size of a vector, every element takes at least a byte of what is left before the limit
+    uint64_t read_vector_size()
+    {
+        uint64_t v_size = read_compact_int();
+        if (v_size > nReadLimit - nReadPos) {
+            fail(READ_TOO_LARGE);
+            return 0;
+        }
+        return v_size;
+    }
+
+    void unserialize(unsigned char& val)
+    {
+       val = readdata8();
+    }
+
+    void unserialize(uint32_t& val)
+    {
+       val = readdata32();
+    }
+
+    void unserialize(uint64_t& val)
+    {
+       val = readdata64();
+    }
+
+    template<typename T, typename A>
+    void unserialize(std::vector<T, A>& v)
+    {
+       v.clear();
+       uint64_t v_size = read_vector_size();
+       v.resize(v_size);
+       for (uint64_t i = 0; i < v_size && !failed(); i++)
+           unserialize(v[i]);
+    }
+
+    void unserialize(std::vector<unsigned char>& v)
+    {
+       v.clear();
+       uint64_t v_size = read_vector_size();
+       v.resize(v_size);
+       read(v.data(), v.size());
+    }
+
+    void unserialize(std::vector<std::vector<unsigned char> >& v)
+    {
+       v.clear();
+       uint64_t v_size = read_vector_size();
+       v.resize(v_size);
+       for (uint64_t i = 0; i < v_size && !failed(); i++)
+           unserialize(v[i]);
+    }
+
+    void unserialize(uint256_t& val)
+    {
+       read(val.data(), val.size());
+    }
+
+    //! objects with a serialize_traits_t description or a member unserialize
+    template<typename T>
+    void unserialize(T& obj)
+    {
+       unserialize_object(*this, obj);
+    }
+
+    //! transaction hashes to compute while deserializing
+    tx_hashes_t tx_hashes() const {
+        return nTxHashes;
+    }
+
+    void SetTxHashes(tx_hashes_t hashes) {
+        nTxHashes = hashes;
+    }
+
+    //! hash bytes [nBegin, nEnd) that were already read, straight from the buffer
+    void hash(hash256_t& hasher, uint64_t nBegin, uint64_t nEnd) const {
+        if (nBegin > nEnd || nEnd > nSrcPos || nBegin + vchBuf.size() < nSrcPos)
+            throw std::ios_base::failure("Hash range is not in the buffer");
+        while (nBegin < nEnd) {
+            size_t pos = nBegin % vchBuf.size();
+            size_t nNow = vchBuf.size() - pos;
+            if (nNow > nEnd - nBegin)
+                nNow = nEnd - nBegin;
+            hasher.write(reinterpret_cast<const unsigned char*>(&vchBuf[pos]), nNow);
+            nBegin += nNow;
+        }
+    }
+
+    //! copy bytes [nBegin, nEnd) that were already read, straight from the buffer
+    void copy(unsigned char* pch, uint64_t nBegin, uint64_t nEnd) const {
+        if (nBegin > nEnd || nEnd > nSrcPos || nBegin + vchBuf.size() < nSrcPos)
+            throw std::ios_base::failure("Copy range is not in the buffer");
+        while (nBegin < nEnd) {
+            size_t pos = nBegin % vchBuf.size();
+            size_t nNow = vchBuf.size() - pos;
+            if (nNow > nEnd - nBegin)
+                nNow = nEnd - nBegin;
+            memcpy(pch, &vchBuf[pos], nNow);
+            pch += nNow;
+            nBegin += nNow;
+        }
+    }
+
+    //! return the current reading position
+    uint64_t GetPos() const {
+        return nReadPos;
+    }
+
+    //! rewind to a given reading position
+    bool SetPos(uint64_t nPos) {
+        size_t bufsize = vchBuf.size();
+        if (nPos + bufsize < nSrcPos) {
+            // rewinding too far, rewind as far as possible
+            nReadPos = nSrcPos - bufsize;
+            return false;
+        }
+        if (nPos > nSrcPos) {
+            // can't go this far forward, go as far as possible
+            nReadPos = nSrcPos;
+            return false;
+        }
+        nReadPos = nPos;
+        return true;
+    }
+
+    //! move forward to a position, seeking past the bytes not buffered yet instead of reading them
+    bool Skip(uint64_t nPos) {
+        if (nPos <= nSrcPos)
+            return SetPos(nPos);
+        return Seek(nPos);
+    }
+
+    bool Seek(uint64_t nPos) {
+        if (nPos > static_cast<uint64_t>(std::numeric_limits<long>::max()))
+            return false;
+        if (fseek(src, static_cast<long>(nPos), SEEK_SET))
+            return false;
+        long nLongPos = ftell(src);
+        if (nLongPos < 0)
+            return false;
+        nSrcPos = static_cast<uint64_t>(nLongPos);
+        nReadPos = nSrcPos;
+        return true;
+    }
+
+    //! prevent reading beyond a certain position
+    //! no argument removes the limit
+    bool SetLimit(uint64_t nPos = std::numeric_limits<uint64_t>::max()) {
+        if (nPos < nReadPos)
+            return false;
+        nReadLimit = nPos;
+        return true;
+    }
+
+    template<typename T>
+    buffered_file_t& operator>>(T&& obj) {
+        // Unserialize from this stream
+        unserialize(obj);
+        return (*this);
+    }
+
+    //! search for a given byte in the stream, and remain positioned on it; false at the end of the file
+    bool FindByte(unsigned char ch) {
+        while (true) {
+            if (nReadPos == nSrcPos && !Fill())
+                return false;
+            if (static_cast<unsigned char>(vchBuf[nReadPos % vchBuf.size()]) == ch)
+                return true;
+            nReadPos++;
+        }
+    }
+};
+
+}
+
+#endif // BTC_UTILS_BUFFERED_FILE_H__
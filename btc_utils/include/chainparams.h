@@ -5,8 +5,13 @@
 #ifndef BTC_UTILS_CHAINPARAMS_H__
 #define BTC_UTILS_CHAINPARAMS_H__
 
-#include <vector>
+#include <bech32.h>
+
+#include <cstdint>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace btc_utils
 {
@@ -18,6 +23,7 @@ enum network_t
    regtest
 };
 
+/** Network of the command line tools, the default where no network is passed */
 extern network_t g_network;
 
 /** The maximum allowed size for a serialized block, in bytes (only for buffer size limits) */
@@ -26,11 +32,67 @@ constexpr unsigned int MESSAGE_START_SIZE = 4;
 
 typedef unsigned char start_marker_t[MESSAGE_START_SIZE];
 
-const start_marker_t& message_start();
+const start_marker_t& message_start(network_t network = g_network);
+
+/**
+ * Compile time parameters of the networks. Code templated on them gets the
+ * prefixes, the HRP and its bech32 checksum state as constants.
+ *
+ * The message start string is designed to be unlikely to occur in normal data.
+ * The characters are rarely used upper ASCII, not valid as UTF-8, and produce
+ * a large 32-bit integer with any alignment.
+ */
+struct mainnet_params_t
+{
+   static constexpr network_t NETWORK = network_t::mainnet;
+   static constexpr start_marker_t MESSAGE_START = {0xf9, 0xbe, 0xb4, 0xd9};
+   static constexpr unsigned char PUBKEY_ADDRESS_PREFIX = 0;
+   static constexpr unsigned char SCRIPT_ADDRESS_PREFIX = 5;
+   static constexpr std::string_view BECH32_HRP = "bc";
+   static constexpr uint32_t BECH32_HRP_STATE = bech32::PolyModHRP(BECH32_HRP);
+};
+
+struct testnet_params_t
+{
+   static constexpr network_t NETWORK = network_t::testnet;
+   static constexpr start_marker_t MESSAGE_START = {0x0b, 0x11, 0x09, 0x07};
+   static constexpr unsigned char PUBKEY_ADDRESS_PREFIX = 111;
+   static constexpr unsigned char SCRIPT_ADDRESS_PREFIX = 196;
+   static constexpr std::string_view BECH32_HRP = "tb";
+   static constexpr uint32_t BECH32_HRP_STATE = bech32::PolyModHRP(BECH32_HRP);
+};
+
+struct regtest_params_t
+{
+   static constexpr network_t NETWORK = network_t::regtest;
+   static constexpr start_marker_t MESSAGE_START = {0xfa, 0xbf, 0xb5, 0xda};
+   static constexpr unsigned char PUBKEY_ADDRESS_PREFIX = 111;
+   static constexpr unsigned char SCRIPT_ADDRESS_PREFIX = 196;
+   static constexpr std::string_view BECH32_HRP = "bcrt";
+   static constexpr uint32_t BECH32_HRP_STATE = bech32::PolyModHRP(BECH32_HRP);
+};
+
+/** Call f with the parameters object of the network, the one place that switches on it */
+template<typename F>
+decltype(auto) with_network_params(network_t network, F&& f)
+{
+   switch(network)
+   {
+   case(network_t::mainnet):
+      return f(mainnet_params_t());
+   case(network_t::testnet):
+      return f(testnet_params_t());
+   case(network_t::regtest):
+      return f(regtest_params_t());
+   }
+   throw std::runtime_error("Unknown network type");
+}
 
-std::vector<unsigned char> base_58_pubkey_address_prefix();
-std::vector<unsigned char> base_58_script_address_prefix();
-std::string bech32_hrp();
+std::vector<unsigned char> base_58_pubkey_address_prefix(network_t network = g_network);
+std::vector<unsigned char> base_58_script_address_prefix(network_t network = g_network);
+std::string bech32_hrp(network_t network = g_network);
+//! mainnet, testnet or regtest
+const char* get_network_name(network_t network);
 }
 
 #endif // BTC_UTILS_CHAINPARAMS_H__
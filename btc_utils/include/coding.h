@@ -0,0 +1,66 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_CODING_H__
+#define BTC_UTILS_CODING_H__
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <endian.h>
+
+namespace btc_utils
+{
+
+/** Helpers for the integers of the index and columnar files */
+
+inline void write_le64(unsigned char* p, uint64_t val)
+{
+   val = htole64(val);
+   memcpy(p, &val, sizeof(val));
+}
+
+inline uint64_t read_le64(const unsigned char* p)
+{
+   uint64_t val;
+   memcpy(&val, p, sizeof(val));
+   return le64toh(val);
+}
+
+//! LEB128 varint, unlike the compact size of the bitcoin serialization
+inline void write_varint(std::vector<unsigned char>& buf, uint64_t val)
+{
+   while (val >= 0x80) {
+      buf.push_back(static_cast<unsigned char>(val | 0x80));
+      val >>= 7;
+   }
+   buf.push_back(static_cast<unsigned char>(val));
+}
+
+inline uint64_t read_varint(const unsigned char*& p, const unsigned char* end)
+{
+   uint64_t val = 0;
+   for (unsigned int shift = 0; p < end && shift < 64; shift += 7) {
+      unsigned char c = *p++;
+      val |= static_cast<uint64_t>(c & 0x7f) << shift;
+      if (!(c & 0x80))
+         return val;
+   }
+   throw std::runtime_error("Invalid varint");
+}
+
+inline uint64_t zigzag_encode(int64_t val)
+{
+   return (static_cast<uint64_t>(val) << 1) ^ static_cast<uint64_t>(val >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t val)
+{
+   return static_cast<int64_t>(val >> 1) ^ -static_cast<int64_t>(val & 1);
+}
+
+}
+
+#endif // BTC_UTILS_CODING_H__
@@ -0,0 +1,163 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_COLUMNAR_H__
+#define BTC_UTILS_COLUMNAR_H__
+
+#include <address.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace btc_utils
+{
+
+/**
+ * Self-describing columnar file with the outputs paying to addresses.
+ *
+ * Rows are split into row groups, every row group stores each column as a
+ * separate chunk:
+ *   block_pos - position of the block, (file number << 32) | offset,
+ *               zigzag delta coded varints
+ *   txid      - dictionary coded 32 byte hashes
+ *   vout      - varints
+ *   type      - dictionary coded txnouttype
+ *   version   - dictionary coded witness version
+ *   program   - dictionary coded hash or witness program
+ *   value     - varints
+ * Chunks are zstd compressed when the library is built with zstd and
+ * compression is enabled.
+ *
+ * File layout, all integers are little endian:
+ *   "BTCCOLS1"
+ *   row groups: number of rows (4), then for every column
+ *               encoding (1), compression (1), raw size (8), stored size (8), data
+ *   footer: number of columns (varint), then name length (varint), name,
+ *           value type (1), encoding (1) for every column, number of row
+ *           groups (varint), offsets of the row groups (8 each), number of
+ *           rows (8)
+ *   footer offset (8), "BTCCOLS1"
+ */
+enum column_t
+{
+   COLUMN_BLOCK_POS,
+   COLUMN_TXID,
+   COLUMN_VOUT,
+   COLUMN_TYPE,
+   COLUMN_VERSION,
+   COLUMN_PROGRAM,
+   COLUMN_VALUE,
+   COLUMN_COUNT
+};
+
+enum column_value_t
+{
+   VALUE_UINT,  //!< unsigned integer
+   VALUE_BYTES, //!< byte string
+};
+
+enum column_encoding_t
+{
+   ENCODING_VARINT,
+   ENCODING_DELTA,      //!< zigzag coded differences of the values as varints
+   ENCODING_DICTIONARY, //!< distinct values followed by varint indexes
+};
+
+enum column_compression_t
+{
+   COMPRESSION_NONE,
+   COMPRESSION_ZSTD,
+};
+
+/** Whether the library was built with zstd */
+bool columnar_zstd_supported();
+
+class columnar_writer_t
+{
+public:
+   //! zstd_level 0 disables compression
+   columnar_writer_t(const std::string& path, int zstd_level = 0, size_t row_group_size = 1u << 20);
+   ~columnar_writer_t();
+
+   columnar_writer_t(const columnar_writer_t&) = delete;
+   columnar_writer_t& operator=(const columnar_writer_t&) = delete;
+
+   void add(uint64_t block_pos, const uint256_t& txid, uint32_t vout,
+            const tx_destination_t& dest, uint64_t value);
+   //! write the last row group and the footer
+   void close();
+
+   uint64_t rows() const { return rows_; }
+   //! bytes of the column chunks before and after compression
+   uint64_t raw_size() const { return raw_size_; }
+   uint64_t stored_size() const { return stored_size_; }
+
+private:
+   FILE* file_;
+   int zstd_level_;
+   size_t row_group_size_;
+   uint64_t offset_;
+   uint64_t rows_;
+   uint64_t raw_size_;
+   uint64_t stored_size_;
+   std::vector<uint64_t> row_groups_;
+
+   std::vector<uint64_t> block_pos_;
+   std::vector<uint256_t> txid_;
+   std::vector<uint32_t> vout_;
+   std::vector<unsigned char> type_;
+   std::vector<unsigned char> version_;
+   std::vector<std::string> program_;
+   std::vector<uint64_t> value_;
+
+   void write(const void* data, size_t len);
+   void write_chunk(column_encoding_t encoding, const std::vector<unsigned char>& raw);
+   void flush_row_group();
+};
+
+/** Columns of one row group, only the requested columns are filled */
+struct columnar_row_group_t
+{
+   uint32_t rows;
+   std::vector<uint64_t> block_pos;
+   std::vector<uint256_t> txid;
+   std::vector<uint32_t> vout;
+   std::vector<unsigned char> type;
+   std::vector<unsigned char> version;
+   std::vector<std::string> program;
+   std::vector<uint64_t> value;
+
+   tx_destination_t destination(size_t row) const;
+};
+
+/** Reader of a columnar file mapped into memory */
+class columnar_reader_t
+{
+public:
+   explicit columnar_reader_t(const std::string& path);
+   ~columnar_reader_t();
+
+   columnar_reader_t(const columnar_reader_t&) = delete;
+   columnar_reader_t& operator=(const columnar_reader_t&) = delete;
+
+   size_t row_groups() const { return row_groups_.size(); }
+   uint64_t rows() const { return rows_; }
+   const std::vector<std::string>& column_names() const { return names_; }
+
+   //! decode the columns selected by the (1 << column_t) bits of columns
+   void read(size_t row_group, columnar_row_group_t& group, unsigned int columns = (1u << COLUMN_COUNT) - 1) const;
+
+private:
+   const unsigned char* data_;
+   size_t len_;
+   uint64_t rows_;
+   std::vector<std::string> names_;
+   std::vector<uint64_t> row_groups_;
+};
+
+}
+
+#endif // BTC_UTILS_COLUMNAR_H__
@@ -6,7 +6,11 @@
 #ifndef BTC_UTILS_CRYPTO_H__
 #define BTC_UTILS_CRYPTO_H__
 
+#include <openssl/evp.h>
+
 #include <array>
+#include <cstddef>
+#include <string>
 #include <vector>
 
 namespace btc_utils
@@ -22,10 +26,50 @@ uint256_t uint256_from_hex(const std::string& hex);
 std::string uint256_to_hex(const uint256_t& v);
 
 uint256_t hash_sha256(const std::vector<unsigned char>& data);
+uint256_t hash_sha256d(const unsigned char* data, size_t len);
 uint160_t hash_ripemd160(const std::vector<unsigned char>& data);
+//! RIPEMD-160 of SHA-256, the hash of keys and scripts in addresses
+uint160_t hash_160(const unsigned char* data, size_t len);
+
+/** Incremental double SHA-256 (the txid/block hash function).
+ *  Data can be fed in several pieces straight from the source buffer, so
+ *  the hashed object does not have to be serialized again.
+ *  OpenSSL picks the SHA-NI/AVX2 implementation at runtime when available.
+ */
+class hash256_t
+{
+private:
+    EVP_MD_CTX* ctx_;
+    bool pending_;  //!< data was written since the last finalize
+
+public:
+    hash256_t();
+    ~hash256_t();
+
+    hash256_t(const hash256_t&) = delete;
+    hash256_t& operator=(const hash256_t&) = delete;
+
+    hash256_t& write(const unsigned char* data, size_t len);
+
+    //! return the hash and reset the hasher for the next object
+    uint256_t finalize();
+
+    //! drop the data written since the last finalize, left by an exception
+    void reset();
+
+    //! the reset hasher of the calling thread, creating a context for every object costs as much as hashing it;
+    //! it is shared with hash_sha256d, so it has to be finalized before anything else hashes on the thread
+    static hash256_t& thread_hasher();
+};
 
 std::string encode_base58(const std::vector<unsigned char>& data);
 std::string encode_base58_check(const std::vector<unsigned char>& data);
+//! longest payload of the allocation free encode_base58_check
+constexpr size_t MAX_BASE58_CHECK_PAYLOAD = 64;
+//! base58 with checksum written to out, which must have room for len * 138 / 100 + 7 characters; returns the length
+size_t encode_base58_check(const unsigned char* data, size_t len, char* out);
+bool decode_base58(const std::string& str, std::vector<unsigned char>& data);
+bool decode_base58_check(const std::string& str, std::vector<unsigned char>& data);
 
 class key_id_t: public uint160_t
 {
@@ -63,6 +107,10 @@ public:
       return vch.size() > 0 && get_len(vch[0]) == vch.size();
     }
 
+    bool static valid_size(const unsigned char* data, size_t len) {
+      return len > 0 && get_len(data[0]) == len;
+    }
+
     pub_key_t()
     {
         invalidate();
@@ -86,9 +134,7 @@ public:
 
     key_id_t get_id() const
     {
-        std::vector<unsigned char> tmp(data_.begin(), data_.begin() + get_len(data_[0]));
-        uint256_t h = hash_sha256(tmp);
-        return hash_ripemd160(std::vector<unsigned char>(h.begin(), h.end()));
+        return hash_160(data_.data(), get_len(data_[0]));
     }
 };
 
@@ -0,0 +1,148 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_OUTPUT_WRITER_H__
+#define BTC_UTILS_OUTPUT_WRITER_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace btc_utils
+{
+
+/** Format of the output file */
+enum output_format_t
+{
+   OUTPUT_PLAIN,
+   OUTPUT_ZSTD,
+   OUTPUT_LZ4,
+};
+
+/** Whether the library was built with the compressor of the format */
+bool output_format_supported(output_format_t format);
+const char* get_output_format_name(output_format_t format);
+
+/** Frame of a compressed output file */
+struct output_frame_t
+{
+   uint64_t offset;         //!< position of the frame in the file
+   uint32_t size;           //!< compressed size
+   uint32_t raw_size;       //!< size of the data in it
+};
+
+/** Frames listed by the seek table at the end of a compressed output file, throws when there is none */
+std::vector<output_frame_t> read_output_frames(const std::string& path);
+/** Decompress a frame read from a compressed output file */
+std::string decompress_output_frame(output_format_t format, const char* data, const output_frame_t& frame);
+
+/**
+ * Output file written by a background thread.
+ *
+ * Data is copied into large page aligned buffers, a full buffer is handed
+ * to the writer thread, which writes the buffers in order with pwrite. The
+ * caller only waits when every buffer is queued, that time is reported as
+ * the stall time. With direct set the file is opened with O_DIRECT when the
+ * file system supports it, the last buffer is padded to the alignment and
+ * the file is truncated to its size afterwards.
+ *
+ * With a compressed format every buffer is compressed as an independent
+ * zstd or lz4 frame by a pool of compression threads and the writer thread
+ * writes the frames in order. end_frame() ends the frame early, so a frame
+ * never holds data of two block files. close() appends a seek table in the
+ * zstd seekable format, a skippable frame both formats ignore, listing the
+ * sizes of the frames so readers can decompress them in parallel. O_DIRECT
+ * is not used for compressed output.
+ *
+ * write() does not throw, the first I/O or compression error is reported by
+ * close().
+ */
+class output_writer_t
+{
+public:
+   static constexpr size_t ALIGNMENT = 4096;
+
+   //! seekable format magic numbers
+   static constexpr uint32_t SKIPPABLE_FRAME_MAGIC = 0x184D2A5E;
+   static constexpr uint32_t SEEK_TABLE_MAGIC = 0x8F92EAB1;
+
+   //! level 0 is the default level of the format
+   explicit output_writer_t(const std::string& path, size_t buffer_size = 4u << 20, size_t buffers = 4,
+                            bool direct = false, output_format_t format = OUTPUT_PLAIN, int level = 0,
+                            unsigned int compress_threads = 1);
+   ~output_writer_t();
+
+   output_writer_t(const output_writer_t&) = delete;
+   output_writer_t& operator=(const output_writer_t&) = delete;
+
+   void write(const char* data, size_t size);
+   void write(std::string_view data) { write(data.data(), data.size()); }
+   //! start a new compressed frame for the data written next
+   void end_frame();
+   //! write the buffered data and close the file
+   void close();
+
+   //! size of the data written
+   uint64_t bytes() const { return bytes_; }
+   //! size of the file, with compression and the seek table
+   uint64_t file_size() const { return file_size_; }
+   bool direct() const { return direct_; }
+   output_format_t format() const { return format_; }
+   size_t frames() const { return frames_.size(); }
+   unsigned int compress_threads() const { return static_cast<unsigned int>(compressors_.size()); }
+   //! time the compression threads spent compressing, summed over the threads
+   double compress_seconds() const { return std::chrono::duration<double>(compress_time_).count(); }
+   //! time spent waiting for a free buffer
+   double stall_seconds() const { return std::chrono::duration<double>(stall_).count(); }
+
+private:
+   struct buffer_t
+   {
+      char* data;
+      size_t size;
+      std::vector<char> packed;  //!< the compressed frame
+      bool ready;                //!< plain or compressed, the writer may write it
+   };
+
+   std::string path_;
+   int fd_;
+   bool direct_;
+   output_format_t format_;
+   int level_;
+   size_t buffer_size_;
+   std::vector<buffer_t> storage_;
+   buffer_t* current_;
+   uint64_t bytes_;
+   uint64_t file_size_;
+   std::chrono::steady_clock::duration stall_;
+
+   std::mutex mutex_;
+   std::condition_variable cv_;
+   std::deque<buffer_t*> full_;   //!< buffers waiting for the writer, in file order
+   std::deque<buffer_t*> unpacked_; //!< buffers waiting for a compression thread
+   std::vector<buffer_t*> free_;
+   bool closing_;
+   bool busy_;                    //!< the writer thread is writing a buffer
+   std::string error_;
+   std::chrono::steady_clock::duration compress_time_;
+   std::vector<output_frame_t> frames_;
+   std::thread thread_;
+   std::vector<std::thread> compressors_;
+
+   void submit();
+   void run();
+   void compress();
+   //! the error, empty when every byte was written
+   std::string write_fully(const char* data, size_t size, uint64_t offset);
+};
+
+}
+
+#endif // BTC_UTILS_OUTPUT_WRITER_H__
@@ -0,0 +1,70 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_PUB_KEY_CACHE_H__
+#define BTC_UTILS_PUB_KEY_CACHE_H__
+
+#include <crypto.h>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace btc_utils
+{
+
+/**
+ * Bounded cache of the hash160 of public keys. Early P2PK outputs and
+ * mining pools pay to the same keys over and over, a hit saves a SHA-256
+ * and a RIPEMD-160.
+ *
+ * The slots are split into shards with a lock each, a key always goes to
+ * the same slot of its shard and replaces what was there.
+ */
+class pub_key_cache_t
+{
+public:
+   static constexpr size_t SHARDS = 16;
+
+   //! capacity is the total number of cached keys, rounded up to a power of 2
+   explicit pub_key_cache_t(size_t capacity = 1u << 16);
+
+   pub_key_cache_t(const pub_key_cache_t&) = delete;
+   pub_key_cache_t& operator=(const pub_key_cache_t&) = delete;
+
+   //! hash160 of a 33 or 65 byte public key
+   key_id_t get_id(const unsigned char* key, size_t len);
+
+   uint64_t hits() const;
+   uint64_t misses() const;
+   size_t memory_usage() const;
+
+private:
+   struct entry_t
+   {
+      unsigned char len;
+      std::array<unsigned char, pub_key_t::SIZE> key;
+      key_id_t id;
+   };
+
+   struct shard_t
+   {
+      mutable std::mutex mutex;
+      std::vector<entry_t> entries; //!< allocated on the first miss
+      uint64_t hits = 0;
+      uint64_t misses = 0;
+   };
+
+   size_t slots_;
+   std::unique_ptr<shard_t[]> shards_;
+};
+
+/** Cache used while extracting destinations */
+extern pub_key_cache_t g_pub_key_cache;
+
+}
+
+#endif // BTC_UTILS_PUB_KEY_CACHE_H__
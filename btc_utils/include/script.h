@@ -7,6 +7,9 @@
 #define BTC_UTILS_SCRIPT_H__
 
 #include <crypto.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 
 namespace btc_utils
@@ -24,11 +27,41 @@ enum txnouttype
     TX_WITNESS_V0_SCRIPTHASH,
     TX_WITNESS_V0_KEYHASH,
     TX_WITNESS_UNKNOWN, //!< Only for Witness versions not already defined above
+    TX_WITNESS_V1_TAPROOT, //!< after TX_WITNESS_UNKNOWN to keep the stored type values
 };
 
+/** Name of the output type for logs */
+const char* get_txn_output_type(txnouttype type);
+
+/** Public keys of a bare multisig script, pointing into the script bytes */
+struct multisig_keys_t
+{
+    static constexpr size_t MAX_KEYS = 16;
+
+    unsigned int required;
+    unsigned int count;
+    std::array<const unsigned char*, MAX_KEYS> keys;
+    std::array<unsigned char, MAX_KEYS> sizes;
+};
+
+/** Match OP_m <pubkey>... OP_n OP_CHECKMULTISIG without copying the keys */
+bool match_multisig(const std::vector<unsigned char>& script, multisig_keys_t& keys);
+
 txnouttype solver(const std::vector<unsigned char>& script,
                   std::vector<std::vector<unsigned char>>& solutions);
 
+/**
+ * Types of count output scripts given as pointers and sizes, for the scripts
+ * of a fixed template: P2PKH, P2SH, P2WPKH, P2WSH, P2TR and P2PK with a key
+ * of either size, whose key prefix is not checked. Every other script gets
+ * TX_NONSTANDARD and is left to the solver.
+ *
+ * The size and the bytes at the positions the templates fix are gathered for
+ * 16 scripts at a time and compared with a template in one step, with SSE2
+ * where the target has it.
+ */
+void classify_scripts(const unsigned char* const* scripts, const uint32_t* sizes, size_t count, txnouttype* types);
+
 }
 
 #endif //BTC_UTILS_SCRIPT_H__
@@ -0,0 +1,298 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_SERIALIZE_H__
+#define BTC_UTILS_SERIALIZE_H__
+
+#include <crypto.h>
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <endian.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace btc_utils
+{
+
+/**
+ * Serialization description of a type: fields lists pointers to its members in
+ * serialization order. Integers are little endian, hashes are raw bytes, other
+ * members are read by the data source, vectors with their compact size first.
+ *
+ * A run of consecutive members of fixed width - integers, hashes and described
+ * types made of them only - is read from the data source at once, so the 80
+ * bytes of a header take one bounds check instead of one per member. The same
+ * description decodes fixed width objects in place through fixed_view_t and
+ * writes them with encode_fixed.
+ *
+ * Types whose layout depends on their contents, like transactions with their
+ * witness flag, have no description and keep a member unserialize(source).
+ */
+template<typename T>
+struct serialize_traits_t;
+
+template<typename T, typename = void>
+struct has_serialize_traits : std::false_type {};
+
+template<typename T>
+struct has_serialize_traits<T, std::void_t<decltype(serialize_traits_t<T>::fields)>> : std::true_type {};
+
+namespace detail
+{
+
+template<typename M>
+struct member_type;
+
+template<typename C, typename V>
+struct member_type<V C::*>
+{
+   using type = V;
+};
+
+template<typename T>
+using fields_t = std::remove_cv_t<decltype(serialize_traits_t<T>::fields)>;
+
+} // namespace detail
+
+//! type of member I of the description of T
+template<typename T, size_t I>
+using field_type_t = typename detail::member_type<std::tuple_element_t<I, detail::fields_t<T>>>::type;
+
+template<typename T>
+constexpr size_t field_count_v = std::tuple_size_v<detail::fields_t<T>>;
+
+//! size of the serialization of T when it does not depend on the value, 0 otherwise
+template<typename T, typename = void>
+struct fixed_width : std::integral_constant<size_t, 0> {};
+
+template<> struct fixed_width<uint8_t> : std::integral_constant<size_t, 1> {};
+template<> struct fixed_width<uint16_t> : std::integral_constant<size_t, 2> {};
+template<> struct fixed_width<uint32_t> : std::integral_constant<size_t, 4> {};
+template<> struct fixed_width<uint64_t> : std::integral_constant<size_t, 8> {};
+template<> struct fixed_width<uint256_t> : std::integral_constant<size_t, 32> {};
+
+namespace detail
+{
+
+template<typename T, size_t... I>
+constexpr std::array<size_t, sizeof...(I)> field_widths(std::index_sequence<I...>)
+{
+   return {{fixed_width<field_type_t<T, I>>::value...}};
+}
+
+//! fixed widths of the members of T, 0 for the others
+template<typename T>
+constexpr std::array<size_t, field_count_v<T>> field_widths_v = field_widths<T>(std::make_index_sequence<field_count_v<T>>());
+
+//! first member after the run of fixed width members starting at member first
+template<typename T>
+constexpr size_t run_end(size_t first)
+{
+   size_t end = first;
+   while (end < field_count_v<T> && field_widths_v<T>[end])
+      end++;
+   return end;
+}
+
+//! width of the members [first, end)
+template<typename T>
+constexpr size_t range_width(size_t first, size_t end)
+{
+   size_t width = 0;
+   for (size_t i = first; i < end; i++)
+      width += field_widths_v<T>[i];
+   return width;
+}
+
+} // namespace detail
+
+template<typename T>
+struct fixed_width<T, std::enable_if_t<has_serialize_traits<T>::value>> :
+   std::integral_constant<size_t, detail::run_end<T>(0) == field_count_v<T> ? detail::range_width<T>(0, field_count_v<T>) : 0> {};
+
+//! size of the fixed width members T starts with, read at once
+template<typename T>
+constexpr size_t fixed_prefix_size_v = detail::range_width<T>(0, detail::run_end<T>(0));
+
+//! position of member I in the serialization of T, which the fixed width members before it determine
+template<typename T, size_t I>
+constexpr size_t field_offset_v = detail::range_width<T>(0, I);
+
+inline void decode_fixed(const unsigned char* data, uint8_t& value) { value = data[0]; }
+
+inline void decode_fixed(const unsigned char* data, uint16_t& value)
+{
+   memcpy(&value, data, sizeof(value));
+   value = le16toh(value);
+}
+
+inline void decode_fixed(const unsigned char* data, uint32_t& value)
+{
+   memcpy(&value, data, sizeof(value));
+   value = le32toh(value);
+}
+
+inline void decode_fixed(const unsigned char* data, uint64_t& value)
+{
+   memcpy(&value, data, sizeof(value));
+   value = le64toh(value);
+}
+
+inline void decode_fixed(const unsigned char* data, uint256_t& value) { memcpy(value.data(), data, value.size()); }
+
+//! decode a compact size of data that was checked when it was read, returns its width
+inline size_t decode_compact_int(const unsigned char* data, uint64_t& value)
+{
+   if (data[0] < 253) {
+      value = data[0];
+      return 1;
+   }
+   if (data[0] == 253) {
+      uint16_t v;
+      decode_fixed(data + 1, v);
+      value = v;
+      return 3;
+   }
+   if (data[0] == 254) {
+      uint32_t v;
+      decode_fixed(data + 1, v);
+      value = v;
+      return 5;
+   }
+   decode_fixed(data + 1, value);
+   return 9;
+}
+
+inline void encode_fixed(uint8_t value, unsigned char* data) { data[0] = value; }
+
+inline void encode_fixed(uint16_t value, unsigned char* data)
+{
+   value = htole16(value);
+   memcpy(data, &value, sizeof(value));
+}
+
+inline void encode_fixed(uint32_t value, unsigned char* data)
+{
+   value = htole32(value);
+   memcpy(data, &value, sizeof(value));
+}
+
+inline void encode_fixed(uint64_t value, unsigned char* data)
+{
+   value = htole64(value);
+   memcpy(data, &value, sizeof(value));
+}
+
+inline void encode_fixed(const uint256_t& value, unsigned char* data) { memcpy(data, value.data(), value.size()); }
+
+namespace detail
+{
+
+//! decode the members first + K of T from data, the start of the first one
+template<typename T, size_t first, size_t... K>
+void decode_range(const unsigned char* data, T& obj, std::index_sequence<K...>)
+{
+   (decode_fixed(data + range_width<T>(first, first + K), obj.*std::get<first + K>(serialize_traits_t<T>::fields)), ...);
+}
+
+template<typename T, size_t first, size_t... K>
+void encode_range(const T& obj, unsigned char* data, std::index_sequence<K...>)
+{
+   (encode_fixed(obj.*std::get<first + K>(serialize_traits_t<T>::fields), data + range_width<T>(first, first + K)), ...);
+}
+
+} // namespace detail
+
+//! decode a described object of fixed width from its serialization
+template<typename T>
+std::enable_if_t<fixed_width<T>::value != 0 && has_serialize_traits<T>::value>
+decode_fixed(const unsigned char* data, T& obj)
+{
+   detail::decode_range<T, 0>(data, obj, std::make_index_sequence<field_count_v<T>>());
+}
+
+//! write the serialization of a described object of fixed width, fixed_width<T> bytes
+template<typename T>
+std::enable_if_t<fixed_width<T>::value != 0 && has_serialize_traits<T>::value>
+encode_fixed(const T& obj, unsigned char* data)
+{
+   detail::encode_range<T, 0>(obj, data, std::make_index_sequence<field_count_v<T>>());
+}
+
+namespace detail
+{
+
+template<size_t I, typename S, typename T>
+void read_fields(S& source, T& obj)
+{
+   if constexpr (I < field_count_v<T>) {
+      constexpr size_t end = run_end<T>(I);
+      if constexpr (end > I) {
+         // one read for the whole run, the data source fills in zeros when it fails
+         unsigned char data[range_width<T>(I, end)];
+         source.read(data, sizeof(data));
+         decode_range<T, I>(data, obj, std::make_index_sequence<end - I>());
+         read_fields<end>(source, obj);
+      } else {
+         source.unserialize(obj.*std::get<I>(serialize_traits_t<T>::fields));
+         read_fields<I + 1>(source, obj);
+      }
+   }
+}
+
+} // namespace detail
+
+/** Read an object from a data source with its description, or its member unserialize when it has none */
+template<typename S, typename T>
+void unserialize_object(S& source, T& obj)
+{
+   if constexpr (has_serialize_traits<T>::value)
+      detail::read_fields<0>(source, obj);
+   else
+      obj.unserialize(source);
+}
+
+/**
+ * Serialization of a described fixed width object used in place: members are
+ * decoded at their offsets when they are asked for, the others are not touched.
+ * The data must outlive the view.
+ */
+template<typename T>
+class fixed_view_t
+{
+public:
+   static constexpr size_t SIZE = fixed_width<T>::value;
+   static_assert(SIZE != 0, "only fixed width objects have views");
+
+   explicit fixed_view_t(const unsigned char* data) : data_(data) {}
+
+   //! member I of the description
+   template<size_t I>
+   field_type_t<T, I> get() const
+   {
+      field_type_t<T, I> value;
+      decode_fixed(data_ + field_offset_v<T, I>, value);
+      return value;
+   }
+
+   //! the whole object
+   T decode() const
+   {
+      T obj;
+      decode_fixed(data_, obj);
+      return obj;
+   }
+
+   const unsigned char* data() const { return data_; }
+
+private:
+   const unsigned char* data_;
+};
+
+}
+
+#endif // BTC_UTILS_SERIALIZE_H__
@@ -0,0 +1,78 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_TASK_SCHEDULER_H__
+#define BTC_UTILS_TASK_SCHEDULER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace btc_utils
+{
+
+/**
+ * Pool of threads running tasks with work stealing.
+ *
+ * Every worker has its own queue. Tasks submitted by a worker go to the
+ * back of its queue and the worker takes them from the back, so a task
+ * that splits its work keeps the parts warm in the cache of its thread.
+ * An idle worker steals from the front of the other queues, where the
+ * oldest and usually largest tasks are. Tasks submitted from other threads
+ * are spread over the queues round robin.
+ *
+ * Tasks must not throw. The destructor runs the queued tasks before the
+ * workers exit.
+ */
+class task_scheduler_t
+{
+public:
+   typedef std::function<void()> task_t;
+
+   explicit task_scheduler_t(unsigned int threads);
+   ~task_scheduler_t();
+
+   task_scheduler_t(const task_scheduler_t&) = delete;
+   task_scheduler_t& operator=(const task_scheduler_t&) = delete;
+
+   void submit(task_t task);
+
+   unsigned int threads() const { return static_cast<unsigned int>(workers_.size()); }
+   //! index of the worker running the caller, threads() when it is not one of ours
+   unsigned int current_worker() const;
+
+   uint64_t executed() const { return executed_; }
+   //! tasks a worker took from the queue of another one
+   uint64_t steals() const { return steals_; }
+
+private:
+   struct queue_t
+   {
+      std::mutex mutex;
+      std::deque<task_t> tasks;
+   };
+
+   std::unique_ptr<queue_t[]> queues_;
+   std::vector<std::thread> workers_;
+   std::mutex idle_mutex_;
+   std::condition_variable idle_cv_;
+   std::atomic<size_t> queued_;
+   std::atomic<unsigned int> next_queue_;
+   std::atomic<uint64_t> executed_;
+   std::atomic<uint64_t> steals_;
+   bool stop_;
+
+   void run(unsigned int index);
+   bool take(unsigned int index, task_t& task);
+};
+
+}
+
+#endif // BTC_UTILS_TASK_SCHEDULER_H__
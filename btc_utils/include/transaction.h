@@ -6,25 +6,56 @@
 #ifndef BTC_UTILS_TRANSACTION_H__
 #define BTC_UTILS_TRANSACTION_H__
 
+#include <chainparams.h>
 #include <crypto.h>
+#include <serialize.h>
+#include <stdexcept>
 #include <vector>
 
 namespace btc_utils
 {
 
+/** Which transaction hashes are computed while deserializing.
+ *  The data source tells it through tx_hashes(), the bytes are then hashed
+ *  in place through data_source.hash(hasher, begin, end).
+ */
+enum tx_hashes_t
+{
+   TX_HASHES_NONE,
+   TX_HASHES_TXID,
+   TX_HASHES_ALL, //!< txid and wtxid
+};
+
+/** Why a data source failed. Failures do not throw: the first one is kept,
+ *  later reads return zeros and the objects being read stop early. The
+ *  data source reports it through failed() and status(), objects report
+ *  invalid data through fail(status).
+ */
+enum read_status_t
+{
+   READ_OK,
+   READ_END_OF_FILE,
+   READ_IO_ERROR,
+   READ_PAST_LIMIT,        //!< read beyond the end of the block
+   READ_NON_CANONICAL,     //!< compact int not in the shortest form
+   READ_TOO_LARGE,         //!< compact int or vector size above the limits
+   READ_INVALID,           //!< data that no valid transaction has
+};
+
+const char* get_read_status(read_status_t status);
+
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
 class out_point_t
 {
 public:
     uint256_t hash;
     uint32_t n;
+};
 
-    template<typename T>
-    void unserialize(T& data_source)
-    {
-       data_source.unserialize(hash);
-       data_source.unserialize(n);
-    }
+template<>
+struct serialize_traits_t<out_point_t>
+{
+   static constexpr auto fields = std::make_tuple(&out_point_t::hash, &out_point_t::n);
 };
 
 /** An input of a transaction.  It contains the location of the previous
@@ -38,14 +69,12 @@ public:
    std::vector<unsigned char> scriptSig;
    uint32_t nSequence;
    std::vector<std::vector<unsigned char> > scriptWitness; //!< Only serialized through CTransaction
+};
 
-   template<typename T>
-   void unserialize(T& data_source)
-   {
-      prevout.unserialize(data_source);
-      data_source.unserialize(scriptSig);
-      data_source.unserialize(nSequence);
-   }
+template<>
+struct serialize_traits_t<tx_in_t>
+{
+   static constexpr auto fields = std::make_tuple(&tx_in_t::prevout, &tx_in_t::scriptSig, &tx_in_t::nSequence);
 };
 
 /** An output of a transaction.  It contains the public key that the next input
@@ -57,14 +86,13 @@ public:
    uint64_t nValue;
    std::vector<unsigned char> scriptPubKey;
 
-   template<typename T>
-   void unserialize(T& data_source)
-   {
-      data_source.unserialize(nValue);
-      data_source.unserialize(scriptPubKey);
-   }
+   std::vector<std::string> addresses(network_t network = g_network) const;
+};
 
-   std::vector<std::string> addresses() const;
+template<>
+struct serialize_traits_t<tx_out_t>
+{
+   static constexpr auto fields = std::make_tuple(&tx_out_t::nValue, &tx_out_t::scriptPubKey);
 };
 
 class transaction_t
@@ -74,11 +102,15 @@ public:
    std::vector<tx_out_t> vout;
    uint32_t nVersion;
    uint32_t nLockTime;
+   uint256_t txid;  //!< hash of the serialization without witness data
+   uint256_t wtxid; //!< hash of the full serialization, equals txid without witness
 
    template<typename T>
    void unserialize(T& data_source)
    {
+      uint64_t tx_begin = data_source.GetPos();
       data_source.unserialize(nVersion);
+      uint64_t body_begin = data_source.GetPos();
       unsigned char flags = 0;
       vin.clear();
       vout.clear();
@@ -88,6 +120,7 @@ public:
           /* We read a dummy or an empty vin. */
           data_source.unserialize(flags);
           if (flags != 0) {
+              body_begin = data_source.GetPos();
               data_source.unserialize(vin);
               data_source.unserialize(vout);
           }
@@ -95,26 +128,213 @@ public:
           /* We read a non-empty vin. Assume a normal vout follows. */
           data_source.unserialize(vout);
       }
+      uint64_t body_end = data_source.GetPos();
       if ((flags & 1)) {
           /* The witness flag is present, and we support witnesses. */
           flags ^= 1;
-          for (size_t i = 0; i < vin.size(); i++) {
+          for (size_t i = 0; i < vin.size() && !data_source.failed(); i++) {
               data_source.unserialize(vin[i].scriptWitness);
           }
-          if (!has_witness()) {
+          if (!data_source.failed() && !has_witness()) {
               /* It's illegal to encode witnesses when all witness stacks are empty. */
-              throw std::runtime_error("Superfluous witness record");
+              data_source.fail(READ_INVALID);
+              return;
           }
       }
       if (flags) {
           /* Unknown flag in the serialization */
-          throw std::runtime_error("Unknown transaction optional data");
+          data_source.fail(READ_INVALID);
+          return;
       }
+      uint64_t lock_begin = data_source.GetPos();
       data_source.unserialize(nLockTime);
+
+      tx_hashes_t hashes = data_source.tx_hashes();
+      if (hashes == TX_HASHES_NONE || data_source.failed())
+          return;
+      hash256_t& hasher = hash256_t::thread_hasher();
+      uint64_t tx_end = data_source.GetPos();
+      if (body_begin == tx_begin + 4) {
+          data_source.hash(hasher, tx_begin, tx_end);
+          txid = hasher.finalize();
+          wtxid = txid;
+          return;
+      }
+      // skip the marker, flag and witness data
+      data_source.hash(hasher, tx_begin, tx_begin + 4);
+      data_source.hash(hasher, body_begin, body_end);
+      data_source.hash(hasher, lock_begin, tx_end);
+      txid = hasher.finalize();
+      if (hashes == TX_HASHES_ALL) {
+          data_source.hash(hasher, tx_begin, tx_end);
+          wtxid = hasher.finalize();
+      } else {
+          wtxid = txid;
+      }
    }
 
    bool has_witness() const;
 };
 
+namespace detail
+{
+
+template<typename T>
+void skip_bytes(T& data_source)
+{
+   data_source.ignore(data_source.read_vector_size());
+}
+
+//! read past the inputs, returns their count
+template<typename T>
+uint64_t skip_inputs(T& data_source)
+{
+   uint64_t count = data_source.read_vector_size();
+   for (uint64_t i = 0; i < count && !data_source.failed(); i++) {
+      data_source.ignore(36); // prevout
+      skip_bytes(data_source);
+      data_source.ignore(4);  // nSequence
+   }
+   return count;
+}
+
+template<typename T>
+void skip_outputs(T& data_source)
+{
+   uint64_t count = data_source.read_vector_size();
+   for (uint64_t i = 0; i < count && !data_source.failed(); i++) {
+      data_source.ignore(8);  // nValue
+      skip_bytes(data_source);
+   }
+}
+
+} // namespace detail
+
+/** Read past a transaction with the reads and the checks of transaction_t::unserialize, so it
+ *  fails where the transaction does, without keeping anything of it.
+ */
+template<typename T>
+void skip_transaction(T& data_source)
+{
+   data_source.ignore(4); // nVersion
+   unsigned char flags = 0;
+   uint64_t inputs = detail::skip_inputs(data_source);
+   if (inputs == 0) {
+      data_source.unserialize(flags);
+      if (flags != 0) {
+         inputs = detail::skip_inputs(data_source);
+         detail::skip_outputs(data_source);
+      }
+   } else {
+      detail::skip_outputs(data_source);
+   }
+   if ((flags & 1)) {
+      flags ^= 1;
+      bool witness = false;
+      for (uint64_t i = 0; i < inputs && !data_source.failed(); i++) {
+         uint64_t items = data_source.read_vector_size();
+         witness = witness || items != 0;
+         for (uint64_t j = 0; j < items && !data_source.failed(); j++)
+            detail::skip_bytes(data_source);
+      }
+      if (!data_source.failed() && !witness) {
+         data_source.fail(READ_INVALID);
+         return;
+      }
+   }
+   if (flags) {
+      data_source.fail(READ_INVALID);
+      return;
+   }
+   data_source.ignore(4); // nLockTime
+}
+
+/** Output in its serialized form, the value and the script are read in place.
+ *  The data must outlive the view.
+ */
+class tx_out_view_t
+{
+public:
+   explicit tx_out_view_t(const unsigned char* data) : data_(data)
+   {
+      uint64_t size;
+      script_offset_ = 8 + decode_compact_int(data + 8, size);
+      script_size_ = static_cast<size_t>(size);
+   }
+
+   uint64_t value() const
+   {
+      uint64_t value;
+      decode_fixed(data_, value);
+      return value;
+   }
+
+   const unsigned char* script_data() const { return data_ + script_offset_; }
+   size_t script_size() const { return script_size_; }
+   //! a copy of the script
+   std::vector<unsigned char> script() const { return {script_data(), script_data() + script_size_}; }
+   //! serialized size
+   size_t size() const { return script_offset_ + script_size_; }
+
+   tx_out_t decode() const { return tx_out_t{value(), script()}; }
+
+private:
+   const unsigned char* data_;
+   size_t script_offset_;
+   size_t script_size_;
+};
+
+/**
+ * Transaction in its serialized form, already checked by skip_transaction when it was read.
+ * The constructor only finds where the parts start, the outputs are visited in place and the
+ * hashes are computed when they are asked for. The data must outlive the view.
+ */
+class transaction_view_t
+{
+public:
+   explicit transaction_view_t(const unsigned char* data);
+
+   const unsigned char* data() const { return data_; }
+   //! serialized size
+   size_t size() const { return size_; }
+   uint32_t version() const;
+   uint32_t lock_time() const;
+   uint64_t inputs() const { return inputs_; }
+   uint64_t outputs() const { return outputs_; }
+   bool has_witness() const { return body_begin_ != 4; }
+
+   //! hash of the serialization without witness data, computed on the first call
+   const uint256_t& txid() const;
+   //! hash of the full serialization
+   uint256_t wtxid() const;
+
+   //! call f with the index and a view of every output
+   template<typename F>
+   void for_each_output(F f) const
+   {
+      const unsigned char* p = data_ + outputs_begin_;
+      for (uint32_t n = 0; n < outputs_; n++) {
+         tx_out_view_t out(p);
+         f(n, out);
+         p += out.size();
+      }
+   }
+
+   //! deserialize into tx, whose vectors keep their storage, with the hashes asked for
+   void decode(transaction_t& tx, tx_hashes_t hashes) const;
+
+private:
+   const unsigned char* data_;
+   size_t size_;
+   size_t body_begin_;        //!< the input count, after the marker and the flag of a witness serialization
+   size_t outputs_begin_;     //!< the first output
+   size_t body_end_;          //!< after the outputs
+   size_t lock_begin_;
+   uint64_t inputs_;
+   uint64_t outputs_;
+   mutable bool hashed_;
+   mutable uint256_t txid_;
+};
+
 }
 #endif // BTC_UTILS_TRANSACTION_H__
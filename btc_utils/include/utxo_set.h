@@ -0,0 +1,87 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BTC_UTILS_UTXO_SET_H__
+#define BTC_UTILS_UTXO_SET_H__
+
+#include <transaction.h>
+
+#include <cstdint>
+#include <string>
+
+namespace btc_utils
+{
+
+/** An unspent output as stored in the set: the owner and the amount */
+struct utxo_t
+{
+   uint32_t address_id;
+   uint64_t value;
+};
+
+/**
+ * Set of unspent outputs keyed by outpoint.
+ *
+ * Open addressing table with linear probing and backward shift deletion,
+ * every slot is 48 bytes: the txid, the output index, the owner id and the
+ * amount. The first 8 bytes of the txid pick the home slot, outpoints are
+ * told apart by the whole txid.
+ *
+ * The slots live in an anonymous mapping, or in a mapping of spill_path
+ * when it is set, so the kernel can write cold pages out to that file
+ * instead of swapping when RAM is short. The file is unlinked right after
+ * creation and disappears with the set.
+ */
+class utxo_set_t
+{
+public:
+   explicit utxo_set_t(const std::string& spill_path = std::string(), size_t capacity = 1u << 20);
+   ~utxo_set_t();
+
+   utxo_set_t(const utxo_set_t&) = delete;
+   utxo_set_t& operator=(const utxo_set_t&) = delete;
+
+   void add(const out_point_t& outpoint, const utxo_t& coin);
+   //! remove the outpoint from the set, returns false if it is unknown
+   bool spend(const out_point_t& outpoint, utxo_t& coin);
+
+   size_t size() const { return size_; }
+   //! bytes occupied by the table
+   size_t memory_usage() const { return capacity_ * sizeof(slot_t); }
+
+   template<typename F>
+   void for_each(F f) const
+   {
+      for (size_t i = 0; i < capacity_; i++) {
+         if (slots_[i].address_id != EMPTY)
+            f(utxo_t{slots_[i].address_id, slots_[i].value});
+      }
+   }
+
+private:
+   static constexpr uint32_t EMPTY = 0xffffffff;
+
+   struct slot_t
+   {
+      uint256_t txid;
+      uint32_t n;
+      uint32_t address_id;
+      uint64_t value;
+   };
+
+   std::string spill_path_;
+   slot_t* slots_;
+   size_t capacity_;
+   size_t size_;
+
+   size_t home(const uint256_t& txid, uint32_t n) const;
+   slot_t* allocate(size_t capacity) const;
+   void release(slot_t* slots, size_t capacity) const;
+   void insert(const slot_t& slot);
+   void grow();
+};
+
+}
+
+#endif // BTC_UTILS_UTXO_SET_H__
@@ -0,0 +1,438 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <output_writer.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+namespace btc_utils
+{
+
+namespace
+{
+
+//! size of the footer of the seek table: number of frames, descriptor and magic
+const size_t SEEK_TABLE_FOOTER_SIZE = 9;
+//! compressed and raw size of a frame in the seek table
+const size_t SEEK_TABLE_ENTRY_SIZE = 8;
+
+void write_le32(char* dst, uint32_t value)
+{
+   value = htole32(value);
+   memcpy(dst, &value, sizeof(value));
+}
+
+uint32_t read_le32(const char* src)
+{
+   uint32_t value;
+   memcpy(&value, src, sizeof(value));
+   return le32toh(value);
+}
+
+#ifdef HAVE_LZ4
+LZ4F_preferences_t lz4_preferences(size_t size, int level)
+{
+   LZ4F_preferences_t prefs;
+   memset(&prefs, 0, sizeof(prefs));
+   prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+   prefs.frameInfo.contentSize = size;
+   prefs.compressionLevel = level;
+   return prefs;
+}
+#endif
+
+} // namespace
+
+bool output_format_supported(output_format_t format)
+{
+   switch (format) {
+   case OUTPUT_PLAIN:
+      return true;
+   case OUTPUT_ZSTD:
+#ifdef HAVE_ZSTD
+      return true;
+#else
+      return false;
+#endif
+   case OUTPUT_LZ4:
+#ifdef HAVE_LZ4
+      return true;
+#else
+      return false;
+#endif
+   }
+   return false;
+}
+
+const char* get_output_format_name(output_format_t format)
+{
+   switch (format) {
+   case OUTPUT_PLAIN:
+      return "plain";
+   case OUTPUT_ZSTD:
+      return "zstd";
+   case OUTPUT_LZ4:
+      return "lz4";
+   }
+   return "unknown";
+}
+
+std::vector<output_frame_t> read_output_frames(const std::string& path)
+{
+   FILE* file = fopen(path.c_str(), "rb");
+   if (!file)
+      throw std::runtime_error("Unable to open file " + path);
+   std::vector<output_frame_t> frames;
+   std::vector<char> table;
+   char footer[SEEK_TABLE_FOOTER_SIZE];
+   bool valid = fseeko(file, 0, SEEK_END) == 0;
+   off_t size = ftello(file);
+   valid = valid && size >= off_t(SEEK_TABLE_FOOTER_SIZE + 8) &&
+           fseeko(file, size - off_t(SEEK_TABLE_FOOTER_SIZE), SEEK_SET) == 0 &&
+           fread(footer, 1, sizeof(footer), file) == sizeof(footer) &&
+           read_le32(footer + 5) == output_writer_t::SEEK_TABLE_MAGIC && footer[4] == 0;
+   if (valid) {
+      uint64_t count = read_le32(footer);
+      uint64_t table_size = 8 + count * SEEK_TABLE_ENTRY_SIZE + SEEK_TABLE_FOOTER_SIZE;
+      valid = table_size <= uint64_t(size);
+      if (valid) {
+         table.resize(table_size);
+         valid = fseeko(file, size - off_t(table_size), SEEK_SET) == 0 &&
+                 fread(table.data(), 1, table.size(), file) == table.size() &&
+                 read_le32(table.data()) == output_writer_t::SKIPPABLE_FRAME_MAGIC &&
+                 read_le32(table.data() + 4) == table_size - 8;
+      }
+      uint64_t offset = 0;
+      for (uint64_t i = 0; valid && i < count; i++) {
+         const char* entry = table.data() + 8 + i * SEEK_TABLE_ENTRY_SIZE;
+         output_frame_t frame{offset, read_le32(entry), read_le32(entry + 4)};
+         offset += frame.size;
+         frames.push_back(frame);
+      }
+      valid = valid && offset + table_size == uint64_t(size);
+   }
+   fclose(file);
+   if (!valid)
+      throw std::runtime_error("No valid seek table in " + path);
+   return frames;
+}
+
+std::string decompress_output_frame(output_format_t format, const char* data, const output_frame_t& frame)
+{
+   std::string res(frame.raw_size, 0);
+   switch (format) {
+   case OUTPUT_PLAIN:
+      res.assign(data, frame.size);
+      return res;
+   case OUTPUT_ZSTD: {
+#ifdef HAVE_ZSTD
+      size_t size = ZSTD_decompress(&res[0], res.size(), data, frame.size);
+      if (ZSTD_isError(size) || size != res.size())
+         throw std::runtime_error("Invalid zstd frame");
+      return res;
+#else
+      break;
+#endif
+   }
+   case OUTPUT_LZ4: {
+#ifdef HAVE_LZ4
+      LZ4F_dctx* ctx = nullptr;
+      if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+         throw std::bad_alloc();
+      size_t dst_size = res.size();
+      size_t src_size = frame.size;
+      size_t hint = LZ4F_decompress(ctx, &res[0], &dst_size, data, &src_size, nullptr);
+      LZ4F_freeDecompressionContext(ctx);
+      // a hint of 0 means the frame is complete
+      if (LZ4F_isError(hint) || hint != 0 || dst_size != res.size() || src_size != frame.size)
+         throw std::runtime_error("Invalid lz4 frame");
+      return res;
+#else
+      break;
+#endif
+   }
+   }
+   throw std::runtime_error(std::string("btc_utils is built without ") + get_output_format_name(format));
+}
+
+output_writer_t::output_writer_t(const std::string& path, size_t buffer_size, size_t buffers, bool direct,
+                                 output_format_t format, int level, unsigned int compress_threads)
+   : path_(path), fd_(-1), direct_(false), format_(format), level_(level), buffer_size_(0), current_(nullptr),
+     bytes_(0), file_size_(0), stall_(0), closing_(false), busy_(false), compress_time_(0)
+{
+   if (!output_format_supported(format))
+      throw std::runtime_error(std::string("btc_utils is built without ") + get_output_format_name(format));
+   buffer_size_ = std::max(ALIGNMENT, (buffer_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT);
+   buffers = std::max<size_t>(buffers, 2);
+   size_t packed_size = 0;
+   if (format != OUTPUT_PLAIN) {
+      direct = false;
+      compress_threads = std::max(compress_threads, 1u);
+      // enough buffers to keep every compression thread busy while the next one is filled
+      buffers = std::max<size_t>(buffers, compress_threads + 2);
+#ifdef HAVE_ZSTD
+      if (format == OUTPUT_ZSTD)
+         packed_size = ZSTD_compressBound(buffer_size_);
+#endif
+#ifdef HAVE_LZ4
+      if (format == OUTPUT_LZ4) {
+         LZ4F_preferences_t prefs = lz4_preferences(buffer_size_, level_);
+         packed_size = LZ4F_compressFrameBound(buffer_size_, &prefs);
+      }
+#endif
+   }
+   if (direct) {
+      fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+      direct_ = fd_ >= 0;
+   }
+   if (fd_ < 0)
+      fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd_ < 0)
+      throw std::runtime_error("Unable to open file " + path);
+   storage_.resize(buffers);
+   for (buffer_t& buffer: storage_) {
+      void* data = nullptr;
+      if (posix_memalign(&data, ALIGNMENT, buffer_size_) != 0) {
+         for (buffer_t& allocated: storage_)
+            free(allocated.data);
+         ::close(fd_);
+         throw std::bad_alloc();
+      }
+      buffer = buffer_t{static_cast<char*>(data), 0, std::vector<char>(packed_size), false};
+   }
+   current_ = &storage_[0];
+   for (size_t i = 1; i < storage_.size(); i++)
+      free_.push_back(&storage_[i]);
+   thread_ = std::thread(&output_writer_t::run, this);
+   if (format != OUTPUT_PLAIN)
+      for (unsigned int i = 0; i < compress_threads; i++)
+         compressors_.emplace_back(&output_writer_t::compress, this);
+}
+
+output_writer_t::~output_writer_t()
+{
+   try {
+      close();
+   } catch (const std::exception&) {
+   }
+   for (buffer_t& buffer: storage_)
+      free(buffer.data);
+}
+
+void output_writer_t::write(const char* data, size_t size)
+{
+   while (size > 0) {
+      size_t now = std::min(size, buffer_size_ - current_->size);
+      memcpy(current_->data + current_->size, data, now);
+      current_->size += now;
+      data += now;
+      size -= now;
+      if (current_->size == buffer_size_)
+         submit();
+   }
+}
+
+void output_writer_t::end_frame()
+{
+   // plain buffers are not frames, O_DIRECT needs them full
+   if (format_ != OUTPUT_PLAIN && current_->size)
+      submit();
+}
+
+void output_writer_t::submit()
+{
+   std::unique_lock<std::mutex> lock(mutex_);
+   bytes_ += current_->size;
+   full_.push_back(current_);
+   if (format_ == OUTPUT_PLAIN)
+      current_->ready = true;
+   else
+      unpacked_.push_back(current_);
+   cv_.notify_all();
+   if (free_.empty()) {
+      auto start = std::chrono::steady_clock::now();
+      cv_.wait(lock, [this]() { return !free_.empty(); });
+      stall_ += std::chrono::steady_clock::now() - start;
+   }
+   current_ = free_.back();
+   current_->size = 0;
+   current_->ready = false;
+   free_.pop_back();
+}
+
+void output_writer_t::close()
+{
+   if (fd_ < 0)
+      return;
+   uint64_t size = bytes_ + current_->size;
+   if (current_->size) {
+      // O_DIRECT writes whole blocks, the padding is cut off below
+      if (direct_ && current_->size % ALIGNMENT) {
+         size_t padded = (current_->size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+         memset(current_->data + current_->size, 0, padded - current_->size);
+         current_->size = padded;
+      }
+      submit();
+   }
+   {
+      std::unique_lock<std::mutex> lock(mutex_);
+      closing_ = true;
+      cv_.notify_all();
+      auto start = std::chrono::steady_clock::now();
+      cv_.wait(lock, [this]() { return full_.empty() && !busy_; });
+      stall_ += std::chrono::steady_clock::now() - start;
+   }
+   thread_.join();
+   for (auto& compressor: compressors_)
+      compressor.join();
+   bytes_ = size;
+   if (format_ == OUTPUT_PLAIN) {
+      file_size_ = size;
+   } else {
+      // the seek table follows the last frame
+      std::vector<char> table(8 + frames_.size() * SEEK_TABLE_ENTRY_SIZE + SEEK_TABLE_FOOTER_SIZE);
+      write_le32(table.data(), SKIPPABLE_FRAME_MAGIC);
+      write_le32(table.data() + 4, static_cast<uint32_t>(table.size() - 8));
+      char* entry = table.data() + 8;
+      for (const output_frame_t& frame: frames_) {
+         write_le32(entry, frame.size);
+         write_le32(entry + 4, frame.raw_size);
+         entry += SEEK_TABLE_ENTRY_SIZE;
+      }
+      write_le32(entry, static_cast<uint32_t>(frames_.size()));
+      entry[4] = 0;
+      write_le32(entry + 5, SEEK_TABLE_MAGIC);
+      if (error_.empty())
+         error_ = write_fully(table.data(), table.size(), file_size_);
+      file_size_ += table.size();
+   }
+   if (error_.empty() && direct_ && ftruncate(fd_, static_cast<off_t>(size)) != 0)
+      error_ = strerror(errno);
+   if (::close(fd_) != 0 && error_.empty())
+      error_ = strerror(errno);
+   fd_ = -1;
+   if (!error_.empty())
+      throw std::runtime_error("Unable to write " + path_ + ": " + error_);
+}
+
+std::string output_writer_t::write_fully(const char* data, size_t size, uint64_t offset)
+{
+   while (size > 0) {
+      ssize_t res = pwrite(fd_, data, size, static_cast<off_t>(offset));
+      if (res < 0 && errno == EINTR)
+         continue;
+      if (res < 0)
+         return strerror(errno);
+      // errno is not set when nothing was written
+      if (res == 0)
+         return "short write, " + std::to_string(size) + " bytes not written";
+      data += res;
+      size -= static_cast<size_t>(res);
+      offset += static_cast<uint64_t>(res);
+   }
+   return std::string();
+}
+
+void output_writer_t::run()
+{
+   std::unique_lock<std::mutex> lock(mutex_);
+   while (true) {
+      cv_.wait(lock, [this]() { return (closing_ && full_.empty()) || (!full_.empty() && full_.front()->ready); });
+      if (full_.empty())
+         break;
+      buffer_t* buffer = full_.front();
+      full_.pop_front();
+      busy_ = true;
+      bool failed = !error_.empty();
+      lock.unlock();
+      const char* data = buffer->data;
+      size_t size = buffer->size;
+      if (format_ != OUTPUT_PLAIN) {
+         data = buffer->packed.data();
+         size = buffer->packed.size();
+         frames_.push_back({file_size_, static_cast<uint32_t>(size), static_cast<uint32_t>(buffer->size)});
+      }
+      // after an error the data is dropped, close() reports it
+      if (!failed) {
+         std::string error = write_fully(data, size, file_size_);
+         if (!error.empty()) {
+            lock.lock();
+            error_ = error;
+            lock.unlock();
+         }
+      }
+      file_size_ += size;
+      lock.lock();
+      busy_ = false;
+      free_.push_back(buffer);
+      cv_.notify_all();
+   }
+}
+
+void output_writer_t::compress()
+{
+#ifdef HAVE_ZSTD
+   std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> zstd(nullptr, ZSTD_freeCCtx);
+   if (format_ == OUTPUT_ZSTD)
+      zstd.reset(ZSTD_createCCtx());
+#endif
+   std::unique_lock<std::mutex> lock(mutex_);
+   while (true) {
+      cv_.wait(lock, [this]() { return closing_ || !unpacked_.empty(); });
+      if (unpacked_.empty())
+         break;
+      buffer_t* buffer = unpacked_.front();
+      unpacked_.pop_front();
+      lock.unlock();
+      auto start = std::chrono::steady_clock::now();
+      // the buffer is sized by the compress bound, so compression only fails on bad parameters
+      std::string error;
+      size_t size = 0;
+      buffer->packed.resize(buffer->packed.capacity());
+#ifdef HAVE_ZSTD
+      if (format_ == OUTPUT_ZSTD && !zstd) {
+         error = "Unable to allocate a zstd context";
+      } else if (format_ == OUTPUT_ZSTD) {
+         size = ZSTD_compressCCtx(zstd.get(), buffer->packed.data(), buffer->packed.size(), buffer->data,
+                                  buffer->size, level_);
+         if (ZSTD_isError(size))
+            error = std::string("zstd compression failed: ") + ZSTD_getErrorName(size);
+      }
+#endif
+#ifdef HAVE_LZ4
+      if (format_ == OUTPUT_LZ4) {
+         LZ4F_preferences_t prefs = lz4_preferences(buffer->size, level_);
+         size = LZ4F_compressFrame(buffer->packed.data(), buffer->packed.size(), buffer->data, buffer->size,
+                                   &prefs);
+         if (LZ4F_isError(size))
+            error = std::string("lz4 compression failed: ") + LZ4F_getErrorName(size);
+      }
+#endif
+      buffer->packed.resize(error.empty() ? size : 0);
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      lock.lock();
+      compress_time_ += elapsed;
+      if (!error.empty() && error_.empty())
+         error_ = error;
+      buffer->ready = true;
+      cv_.notify_all();
+   }
+}
+
+}
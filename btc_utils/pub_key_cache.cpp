@@ -0,0 +1,83 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <pub_key_cache.h>
+
+#include <cstring>
+
+namespace btc_utils
+{
+
+pub_key_cache_t g_pub_key_cache;
+
+pub_key_cache_t::pub_key_cache_t(size_t capacity) : slots_(1), shards_(new shard_t[SHARDS])
+{
+   while (slots_ * SHARDS < capacity)
+      slots_ <<= 1;
+}
+
+key_id_t pub_key_cache_t::get_id(const unsigned char* key, size_t len)
+{
+   // the x coordinate of a key is uniformly distributed, mix it anyway for crafted keys
+   uint64_t h = 0;
+   memcpy(&h, key + 1, sizeof(h));
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   shard_t& shard = shards_[(h >> 56) % SHARDS];
+   size_t slot = static_cast<size_t>(h >> 8) & (slots_ - 1);
+   {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      if (!shard.entries.empty()) {
+         const entry_t& entry = shard.entries[slot];
+         if (entry.len == len && memcmp(entry.key.data(), key, len) == 0) {
+            shard.hits++;
+            return entry.id;
+         }
+      }
+   }
+
+   key_id_t id = hash_160(key, len);
+   std::lock_guard<std::mutex> lock(shard.mutex);
+   if (shard.entries.empty())
+      shard.entries.resize(slots_, entry_t{0, {}, {}});
+   entry_t& entry = shard.entries[slot];
+   entry.len = static_cast<unsigned char>(len);
+   memcpy(entry.key.data(), key, len);
+   entry.id = id;
+   shard.misses++;
+   return id;
+}
+
+uint64_t pub_key_cache_t::hits() const
+{
+   uint64_t res = 0;
+   for (size_t i = 0; i < SHARDS; i++) {
+      std::lock_guard<std::mutex> lock(shards_[i].mutex);
+      res += shards_[i].hits;
+   }
+   return res;
+}
+
+uint64_t pub_key_cache_t::misses() const
+{
+   uint64_t res = 0;
+   for (size_t i = 0; i < SHARDS; i++) {
+      std::lock_guard<std::mutex> lock(shards_[i].mutex);
+      res += shards_[i].misses;
+   }
+   return res;
+}
+
+size_t pub_key_cache_t::memory_usage() const
+{
+   size_t res = 0;
+   for (size_t i = 0; i < SHARDS; i++) {
+      std::lock_guard<std::mutex> lock(shards_[i].mutex);
+      res += shards_[i].entries.size() * sizeof(entry_t);
+   }
+   return res;
+}
+
+}
@@ -5,9 +5,18 @@
 
 #include <script.h>
 
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /** Signature hash sizes */
 static constexpr size_t WITNESS_V0_SCRIPTHASH_SIZE = 32;
 static constexpr size_t WITNESS_V0_KEYHASH_SIZE = 20;
+static constexpr size_t WITNESS_V1_TAPROOT_SIZE = 32;
 
 namespace btc_utils
 {
@@ -183,7 +192,7 @@ static bool is_witness_program(const std::vector<unsigned char>& script, int& ve
         return false;
     }
     if ((size_t)(script[1] + 2) == script.size()) {
-        version = decode_OP_N((opcode_t)script[0]);
+        version = decode_OP_N(static_cast<opcode_t>(script[0]));
         program = std::vector<unsigned char>(script.begin() + 2, script.end());
         return true;
     }
@@ -212,6 +221,145 @@ static bool match_pay_to_pubkey_hash(const std::vector<unsigned char>& script, s
     return false;
 }
 
+const char* get_txn_output_type(txnouttype type)
+{
+    switch (type)
+    {
+    case TX_NONSTANDARD: return "nonstandard";
+    case TX_PUBKEY: return "pubkey";
+    case TX_PUBKEYHASH: return "pubkeyhash";
+    case TX_SCRIPTHASH: return "scripthash";
+    case TX_MULTISIG: return "multisig";
+    case TX_NULL_DATA: return "nulldata";
+    case TX_WITNESS_V0_KEYHASH: return "witness_v0_keyhash";
+    case TX_WITNESS_V0_SCRIPTHASH: return "witness_v0_scripthash";
+    case TX_WITNESS_V1_TAPROOT: return "witness_v1_taproot";
+    case TX_WITNESS_UNKNOWN: return "witness_unknown";
+    }
+    return nullptr;
+}
+
+bool match_multisig(const std::vector<unsigned char>& script, multisig_keys_t& keys)
+{
+    if (script.size() < 3 || script.back() != OP_CHECKMULTISIG || script[0] < OP_1 || script[0] > OP_16)
+        return false;
+    keys.required = static_cast<unsigned int>(decode_OP_N(static_cast<opcode_t>(script[0])));
+    keys.count = 0;
+    size_t pos = 1;
+    while (pos < script.size() - 2 && keys.count < multisig_keys_t::MAX_KEYS) {
+        size_t len = script[pos];
+        if ((len != pub_key_t::COMPRESSED_SIZE && len != pub_key_t::SIZE) || pos + 1 + len > script.size() - 2)
+            return false;
+        const unsigned char* key = &script[pos + 1];
+        if (!pub_key_t::valid_size(key, len))
+            return false;
+        keys.keys[keys.count] = key;
+        keys.sizes[keys.count] = static_cast<unsigned char>(len);
+        keys.count++;
+        pos += 1 + len;
+    }
+    if (pos != script.size() - 2 || script[pos] < OP_1 || script[pos] > OP_16)
+        return false;
+    unsigned int n = static_cast<unsigned int>(decode_OP_N(static_cast<opcode_t>(script[pos])));
+    return n == keys.count && keys.required <= n;
+}
+
+namespace
+{
+
+//! script bytes the templates fix, gathered for a group of scripts
+enum script_column_t
+{
+    COLUMN_SIZE,
+    COLUMN_FIRST,
+    COLUMN_SECOND,
+    COLUMN_THIRD,
+    COLUMN_BEFORE_LAST,
+    COLUMN_LAST,
+    COLUMNS
+};
+
+//! scripts classified at once
+constexpr size_t SCRIPT_GROUP = 16;
+
+typedef unsigned char script_columns_t[COLUMNS][SCRIPT_GROUP];
+
+/** Output script of fixed size, -1 for the columns it does not fix */
+struct script_template_t
+{
+    txnouttype type;
+    std::array<int, COLUMNS> bytes;
+};
+
+const script_template_t SCRIPT_TEMPLATES[] = {
+    {TX_PUBKEYHASH, {{25, OP_DUP, OP_HASH160, 20, OP_EQUALVERIFY, OP_CHECKSIG}}},
+    {TX_SCRIPTHASH, {{23, OP_HASH160, 20, -1, -1, OP_EQUAL}}},
+    {TX_WITNESS_V0_KEYHASH, {{2 + WITNESS_V0_KEYHASH_SIZE, OP_0, WITNESS_V0_KEYHASH_SIZE, -1, -1, -1}}},
+    {TX_WITNESS_V0_SCRIPTHASH, {{2 + WITNESS_V0_SCRIPTHASH_SIZE, OP_0, WITNESS_V0_SCRIPTHASH_SIZE, -1, -1, -1}}},
+    {TX_WITNESS_V1_TAPROOT, {{2 + WITNESS_V1_TAPROOT_SIZE, OP_1, WITNESS_V1_TAPROOT_SIZE, -1, -1, -1}}},
+    {TX_PUBKEY, {{2 + pub_key_t::COMPRESSED_SIZE, pub_key_t::COMPRESSED_SIZE, -1, -1, -1, OP_CHECKSIG}}},
+    {TX_PUBKEY, {{2 + pub_key_t::SIZE, pub_key_t::SIZE, -1, -1, -1, OP_CHECKSIG}}},
+};
+
+//! columns of up to SCRIPT_GROUP scripts, the unused lanes have size 0 and match no template
+void gather_columns(const unsigned char* const* scripts, const uint32_t* sizes, size_t count, script_columns_t& columns)
+{
+    memset(columns, 0, sizeof(columns));
+    for (size_t i = 0; i < count; i++) {
+        uint32_t size = sizes[i];
+        // no template is 255 bytes long
+        columns[COLUMN_SIZE][i] = static_cast<unsigned char>(std::min<uint32_t>(size, 255));
+        if (size < 3)
+            continue;
+        const unsigned char* script = scripts[i];
+        columns[COLUMN_FIRST][i] = script[0];
+        columns[COLUMN_SECOND][i] = script[1];
+        columns[COLUMN_THIRD][i] = script[2];
+        columns[COLUMN_BEFORE_LAST][i] = script[size - 2];
+        columns[COLUMN_LAST][i] = script[size - 1];
+    }
+}
+
+//! bit i is set when script i of the group matches the template
+unsigned int match_template(const script_template_t& tmpl, const script_columns_t& columns)
+{
+#if defined(__SSE2__)
+    __m128i match = _mm_set1_epi8(-1);
+    for (size_t c = 0; c < COLUMNS; c++) {
+        if (tmpl.bytes[c] < 0)
+            continue;
+        __m128i column = _mm_loadu_si128(reinterpret_cast<const __m128i*>(columns[c]));
+        match = _mm_and_si128(match, _mm_cmpeq_epi8(column, _mm_set1_epi8(static_cast<char>(tmpl.bytes[c]))));
+    }
+    return static_cast<unsigned int>(_mm_movemask_epi8(match));
+#else
+    unsigned int match = 0;
+    for (size_t i = 0; i < SCRIPT_GROUP; i++) {
+        bool matches = true;
+        for (size_t c = 0; c < COLUMNS; c++)
+            matches &= tmpl.bytes[c] < 0 || columns[c][i] == tmpl.bytes[c];
+        match |= static_cast<unsigned int>(matches) << i;
+    }
+    return match;
+#endif
+}
+
+} // namespace
+
+void classify_scripts(const unsigned char* const* scripts, const uint32_t* sizes, size_t count, txnouttype* types)
+{
+    script_columns_t columns;
+    for (size_t first = 0; first < count; first += SCRIPT_GROUP) {
+        size_t n = std::min(SCRIPT_GROUP, count - first);
+        gather_columns(scripts + first, sizes + first, n, columns);
+        std::fill(types + first, types + first + n, TX_NONSTANDARD);
+        // the templates differ in size or first byte, a script matches one at most
+        for (const auto& tmpl: SCRIPT_TEMPLATES)
+            for (unsigned int match = match_template(tmpl, columns); match; match &= match - 1)
+                types[first + static_cast<size_t>(__builtin_ctz(match))] = tmpl.type;
+    }
+}
+
 txnouttype solver(const std::vector<unsigned char>& script, std::vector<std::vector<unsigned char> > &solutions)
 {
    solutions.clear();
@@ -236,6 +384,10 @@ txnouttype solver(const std::vector<unsigned char>& script, std::vector<std::vec
            solutions.push_back(witnessprogram);
            return TX_WITNESS_V0_SCRIPTHASH;
        }
+       if (witnessversion == 1 && witnessprogram.size() == WITNESS_V1_TAPROOT_SIZE) {
+           solutions.push_back(std::move(witnessprogram));
+           return TX_WITNESS_V1_TAPROOT;
+       }
        if (witnessversion != 0) {
            solutions.push_back(std::vector<unsigned char>{(unsigned char)witnessversion});
            solutions.push_back(std::move(witnessprogram));
@@ -264,6 +416,15 @@ txnouttype solver(const std::vector<unsigned char>& script, std::vector<std::vec
        return TX_PUBKEYHASH;
    }
 
+   multisig_keys_t multisig;
+   if (match_multisig(script, multisig)) {
+       solutions.push_back({static_cast<unsigned char>(multisig.required)});
+       for (unsigned int i = 0; i < multisig.count; i++)
+           solutions.emplace_back(multisig.keys[i], multisig.keys[i] + multisig.sizes[i]);
+       solutions.push_back({static_cast<unsigned char>(multisig.count)});
+       return TX_MULTISIG;
+   }
+
    solutions.clear();
    return TX_NONSTANDARD;
 }
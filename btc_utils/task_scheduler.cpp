@@ -0,0 +1,104 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <task_scheduler.h>
+
+namespace btc_utils
+{
+
+namespace
+{
+
+//! scheduler and worker index of the current thread
+thread_local const task_scheduler_t* t_scheduler = nullptr;
+thread_local unsigned int t_worker = 0;
+
+} // namespace
+
+task_scheduler_t::task_scheduler_t(unsigned int threads) :
+   queues_(new queue_t[threads ? threads : 1]), queued_(0), next_queue_(0), executed_(0), steals_(0), stop_(false)
+{
+   if (threads == 0)
+      threads = 1;
+   for (unsigned int i = 0; i < threads; i++)
+      workers_.emplace_back(&task_scheduler_t::run, this, i);
+}
+
+task_scheduler_t::~task_scheduler_t()
+{
+   {
+      std::lock_guard<std::mutex> lock(idle_mutex_);
+      stop_ = true;
+   }
+   idle_cv_.notify_all();
+   for (auto& worker: workers_)
+      worker.join();
+}
+
+unsigned int task_scheduler_t::current_worker() const
+{
+   return t_scheduler == this ? t_worker : threads();
+}
+
+void task_scheduler_t::submit(task_t task)
+{
+   unsigned int index = current_worker();
+   if (index == threads())
+      index = next_queue_++ % threads();
+   // counted first so the count never drops below the queued tasks
+   queued_++;
+   {
+      std::lock_guard<std::mutex> lock(queues_[index].mutex);
+      queues_[index].tasks.push_back(std::move(task));
+   }
+   // taking the lock orders the wake up after the check of a worker going to sleep
+   { std::lock_guard<std::mutex> lock(idle_mutex_); }
+   idle_cv_.notify_one();
+}
+
+bool task_scheduler_t::take(unsigned int index, task_t& task)
+{
+   {
+      queue_t& own = queues_[index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty()) {
+         task = std::move(own.tasks.back());
+         own.tasks.pop_back();
+         return true;
+      }
+   }
+   for (unsigned int i = 1; i < threads(); i++) {
+      queue_t& victim = queues_[(index + i) % threads()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+         task = std::move(victim.tasks.front());
+         victim.tasks.pop_front();
+         steals_++;
+         return true;
+      }
+   }
+   return false;
+}
+
+void task_scheduler_t::run(unsigned int index)
+{
+   t_scheduler = this;
+   t_worker = index;
+   task_t task;
+   while (true) {
+      if (take(index, task)) {
+         queued_--;
+         task();
+         task = nullptr;
+         executed_++;
+         continue;
+      }
+      std::unique_lock<std::mutex> lock(idle_mutex_);
+      idle_cv_.wait(lock, [this]() { return stop_ || queued_ > 0; });
+      if (stop_ && queued_ == 0)
+         break;
+   }
+}
+
+}
@@ -1,7 +1,28 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
+#include <address_balances.h>
+#include <address_cache.h>
+#include <address_index.h>
+#include <address_stats.h>
+#include <block.h>
+#include <block_reader.h>
+#include <btc_utils_c.h>
+#include <chainparams.h>
+#include <columnar.h>
 #include <crypto.h>
+#include <output_writer.h>
+#include <pub_key_cache.h>
+#include <task_scheduler.h>
+#include <utxo_set.h>
+#include <watchlist.h>
+
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sys/stat.h>
 
 TEST_CASE("crypto_base58")
 {
@@ -34,3 +55,1241 @@ TEST_CASE("crypto_base58")
     CHECK(btc_utils::encode_base58(btc_utils::from_hex("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9fa0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebfc0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedfe0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff")) ==
           "1cWB5HCBdLjAuqGGReWE3R3CguuwSjw6RHn39s2yuDRTS5NsBgNiFpWgAnEx6VQi8csexkgYw3mdYrMHr8x9i7aEwP8kZ7vccXWqKDvGv3u1GxFKPuAkn8JCPPGDMf3vMMnbzm6Nh9zh1gcNsMvH3ZNLmP5fSG6DGbbi2tuwMWPthr4boWwCxf7ewSgNQeacyozhKDDQQ1qL5fQFUW52QKUZDZ5fw3KXNQJMcNTcaB723LchjeKun7MuGW5qyCBZYzA1KjofN1gYBV3NqyhQJ3Ns746GNuf9N2pQPmHz4xpnSrrfCvy6TVVz5d4PdrjeshsWQwpZsZGzvbdAdN8MKV5QsBDY");
 }
+
+TEST_CASE("crypto_hash256")
+{
+    std::vector<unsigned char> header = btc_utils::from_hex("0100000000000000000000000000000000000000000000000000000000000000000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a29ab5f49ffff001d1dac2b7c");
+    btc_utils::uint256_t hash = btc_utils::hash_sha256d(header.data(), header.size());
+    CHECK(btc_utils::uint256_to_hex(hash) ==
+          "000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
+    CHECK(btc_utils::uint256_from_hex("000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f") == hash);
+
+    // the same hash fed in pieces
+    btc_utils::hash256_t hasher;
+    hasher.write(header.data(), 4).write(header.data() + 4, 36).write(header.data() + 40, 40);
+    CHECK(hasher.finalize() == hash);
+    CHECK(btc_utils::to_hex(header).substr(0, 8) == "01000000");
+}
+
+TEST_CASE("transaction_hashes")
+{
+    auto read_tx = [](const std::string& hex, btc_utils::tx_hashes_t hashes) {
+        std::vector<unsigned char> data = btc_utils::from_hex(hex);
+        FILE* f = std::tmpfile();
+        REQUIRE(f);
+        REQUIRE(fwrite(data.data(), 1, data.size(), f) == data.size());
+        rewind(f);
+        btc_utils::buffered_file_t file(f, 4096, 0);
+        file.SetTxHashes(hashes);
+        btc_utils::transaction_t tx;
+        file >> tx;
+        CHECK(!file.failed());
+        return tx;
+    };
+
+    // the genesis coinbase, without witness the wtxid is the txid
+    const std::string legacy =
+        "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff4d04ffff001d0104455468652054"
+        "696d65732030332f4a616e2f32303039204368616e63656c6c6f72206f6e206272696e6b206f66207365636f6e64206261696c6f757420"
+        "666f722062616e6b73ffffffff0100f2052a01000000434104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61"
+        "deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac00000000";
+    btc_utils::transaction_t tx = read_tx(legacy, btc_utils::TX_HASHES_ALL);
+    CHECK(btc_utils::uint256_to_hex(tx.txid) == "4a5e1e4baab89f3a32518a88c31bc87f618f76673e2cc77ab2127b7afdeda33b");
+    CHECK(tx.wtxid == tx.txid);
+
+    // the native P2WPKH example of BIP 143
+    const std::string segwit =
+        "01000000000102fff7f7881a8099afa6940d42d1e7f6362bec38171ea3edf433541db4e4ad969f00000000494830450221008b9d1dc26ba6"
+        "a9cb62127b02742fa9d754cd3bebf337f7a55d114c8e5cdd30be022040529b194ba3f9281a99f2b1c0a19c0489bc22ede944ccf4ecbab4"
+        "cc618ef3ed01eeffffffef51e1b804cc89d182d279655c3aa89e815b1b309fe287d9b2b55d57b90ec68a0100000000ffffffff02202cb2"
+        "06000000001976a9148280b37df378db99f66f85c95a783a76ac7a6d5988ac9093510d000000001976a9143bde42dbee7e4dbe6a21b2d5"
+        "0ce2f0167faa815988ac000247304402203609e17b84f6a7d30c80bfa610b5b4542f32a8a0d5447a12fb1366d7f01cc44a0220573a954c"
+        "4518331561406f90300e8f3358f51928d43c212a8caed02de67eebee0121025476c2e83188368da1ff3e292e7acafcdb3566bb0ad253f6"
+        "2fc70f07aeeb635711000000";
+    tx = read_tx(segwit, btc_utils::TX_HASHES_ALL);
+    CHECK(tx.has_witness());
+    CHECK(btc_utils::uint256_to_hex(tx.txid) == "e8151a2af31c368a35053ddd4bdb285a8595c769a3ad83e0fa02314a602d4609");
+    CHECK(btc_utils::uint256_to_hex(tx.wtxid) == "2eade7c9e5e7fba6d26f22d25677070cc8ee9f6b52ce5d9b3f574d1867e5f7b1");
+
+    // only the txid is hashed when the wtxid is not asked for
+    tx = read_tx(segwit, btc_utils::TX_HASHES_TXID);
+    CHECK(btc_utils::uint256_to_hex(tx.txid) == "e8151a2af31c368a35053ddd4bdb285a8595c769a3ad83e0fa02314a602d4609");
+    CHECK(tx.wtxid == tx.txid);
+
+    // a view of the bytes finds the same parts and hashes, skip_transaction reads as far as unserialize
+    for (const std::string& hex : {legacy, segwit}) {
+        CAPTURE(hex);
+        std::vector<unsigned char> data = btc_utils::from_hex(hex);
+        tx = read_tx(hex, btc_utils::TX_HASHES_ALL);
+        btc_utils::transaction_view_t view(data.data());
+        CHECK(view.size() == data.size());
+        CHECK(view.version() == tx.nVersion);
+        CHECK(view.lock_time() == tx.nLockTime);
+        CHECK(view.has_witness() == tx.has_witness());
+        CHECK(view.txid() == tx.txid);
+        CHECK(view.wtxid() == tx.wtxid);
+        REQUIRE(view.outputs() == tx.vout.size());
+        view.for_each_output([&](uint32_t n, const btc_utils::tx_out_view_t& out) {
+            CHECK(out.value() == tx.vout[n].nValue);
+            CHECK(out.script() == tx.vout[n].scriptPubKey);
+        });
+        btc_utils::transaction_t decoded;
+        view.decode(decoded, btc_utils::TX_HASHES_ALL);
+        REQUIRE(decoded.vin.size() == tx.vin.size());
+        for (size_t i = 0; i < tx.vin.size(); i++) {
+            CHECK(decoded.vin[i].prevout.hash == tx.vin[i].prevout.hash);
+            CHECK(decoded.vin[i].prevout.n == tx.vin[i].prevout.n);
+            CHECK(decoded.vin[i].scriptSig == tx.vin[i].scriptSig);
+            CHECK(decoded.vin[i].nSequence == tx.vin[i].nSequence);
+            CHECK(decoded.vin[i].scriptWitness == tx.vin[i].scriptWitness);
+        }
+        CHECK(decoded.wtxid == tx.wtxid);
+
+        FILE* f = std::tmpfile();
+        REQUIRE(f);
+        REQUIRE(fwrite(data.data(), 1, data.size(), f) == data.size());
+        rewind(f);
+        btc_utils::buffered_file_t file(f, 4096, 0);
+        btc_utils::skip_transaction(file);
+        CHECK(!file.failed());
+        CHECK(file.GetPos() == data.size());
+    }
+
+    // a witness flag without witness data, and a transaction cut short
+    for (const auto& bad : std::vector<std::pair<std::string, btc_utils::read_status_t>>{
+             {"01000000" "0001" "01" + std::string(72, '0') + "00" "ffffffff" "01" "0000000000000000" "00" "00" "00000000",
+              btc_utils::READ_INVALID},
+             {legacy.substr(0, legacy.size() - 2), btc_utils::READ_END_OF_FILE}}) {
+        std::vector<unsigned char> data = btc_utils::from_hex(bad.first);
+        FILE* f = std::tmpfile();
+        REQUIRE(f);
+        REQUIRE(fwrite(data.data(), 1, data.size(), f) == data.size());
+        rewind(f);
+        btc_utils::buffered_file_t file(f, 4096, 0);
+        btc_utils::skip_transaction(file);
+        CHECK(file.status() == bad.second);
+    }
+}
+
+TEST_CASE("block_header_hash")
+{
+    btc_utils::block_header_t genesis;
+    genesis.version_ = 1;
+    genesis.prev_block_hash_.fill(0);
+    genesis.merkle_root_ = btc_utils::uint256_from_hex("4a5e1e4baab89f3a32518a88c31bc87f618f76673e2cc77ab2127b7afdeda33b");
+    genesis.time_ = 1231006505;
+    genesis.bits_ = 0x1d00ffff;
+    genesis.nonce_ = 2083236893;
+    CHECK(btc_utils::uint256_to_hex(genesis.hash()) ==
+          "000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
+}
+
+namespace
+{
+
+std::string from_hex_string(const std::string& hex)
+{
+    std::vector<unsigned char> bytes = btc_utils::from_hex(hex);
+    return std::string(bytes.begin(), bytes.end());
+}
+
+//! coinbase paying 50 BTC to 1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa
+const std::string COINBASE_HEX =
+    "01000000" "01" + std::string(64, '0') + "ffffffff" "020101" "ffffffff"
+    "01" "00f2052a01000000" "1976a91462e907b15cbf27d5425399ebf6f0fb50ebb88f1888ac" "00000000";
+
+//! block file record of a block on top of prev with the transactions, the coinbase above by default;
+//! the nonce is picked so the hash has the top bit clear, as the hash of a real block has
+std::string make_block_record(uint32_t time, const btc_utils::uint256_t& prev = btc_utils::uint256_t{},
+                              const std::vector<std::string>& txes = {COINBASE_HEX})
+{
+    std::string block = from_hex_string("01000000") + std::string(prev.begin(), prev.end()) +
+                        from_hex_string(std::string(64, '1'));
+    for (uint32_t value: {time, 0x1d00ffffu, time * 7u})
+        block.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    for (uint32_t nonce = time * 7u;; nonce++) {
+        block.replace(76, sizeof(nonce), reinterpret_cast<const char*>(&nonce), sizeof(nonce));
+        if (btc_utils::hash_sha256d(reinterpret_cast<const unsigned char*>(block.data()), 80)[31] < 0x80)
+            break;
+    }
+    block += static_cast<char>(txes.size());
+    for (const auto& tx: txes)
+        block += from_hex_string(tx);
+    uint32_t size = static_cast<uint32_t>(block.size());
+    const btc_utils::start_marker_t& start = btc_utils::message_start(btc_utils::network_t::mainnet);
+    return std::string(reinterpret_cast<const char*>(start), btc_utils::MESSAGE_START_SIZE) +
+           std::string(reinterpret_cast<const char*>(&size), sizeof(size)) + block;
+}
+
+struct counting_visitor_t : public btc_utils::block_visitor_t
+{
+    std::mutex mutex;
+    std::map<uint32_t, std::vector<uint64_t>> positions;
+    std::vector<uint32_t> times;
+    size_t files = 0;
+    size_t txes = 0;
+    size_t outputs = 0;
+    size_t errors = 0;
+
+    void begin_file(uint32_t, unsigned int) override { std::lock_guard<std::mutex> lock(mutex); files++; }
+    void on_block(const btc_utils::block_view_t& view) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        positions[view.file].push_back(view.pos);
+        times.push_back(view.header().time());
+    }
+    void on_transaction(const btc_utils::block_view_t&, const btc_utils::transaction_view_t&) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        txes++;
+    }
+    void on_output(const btc_utils::block_view_t&, const btc_utils::transaction_view_t&, uint32_t,
+                   const btc_utils::tx_out_view_t& out) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (out.decode().addresses(btc_utils::network_t::mainnet) ==
+            std::vector<std::string>{"1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa"})
+            outputs++;
+    }
+    void on_error(uint32_t, const std::string&) override { std::lock_guard<std::mutex> lock(mutex); errors++; }
+};
+
+//! two block files with blocks of time 1000 and 2000, garbage between them and a block cut short at the end
+void write_block_files(const std::string& dir)
+{
+    mkdir(dir.c_str(), 0755);
+    std::string second = make_block_record(2000);
+    std::string data = "xyz" + make_block_record(1000) + "garbage" + second + second.substr(0, 100);
+    for (uint32_t file = 0; file < 2; file++) {
+        FILE* f = fopen(btc_utils::get_block_file_path(dir, file).c_str(), "wb");
+        REQUIRE(f);
+        REQUIRE(fwrite(data.data(), 1, data.size(), f) == data.size());
+        fclose(f);
+    }
+}
+
+//! hash of the block of a block file record
+btc_utils::uint256_t record_hash(const std::string& record)
+{
+    return btc_utils::hash_sha256d(reinterpret_cast<const unsigned char*>(record.data()) + 8,
+                                   btc_utils::block_header_t::SIZE);
+}
+
+//! one block file with the records
+void write_block_file(const std::string& dir, const std::vector<std::string>& records)
+{
+    mkdir(dir.c_str(), 0755);
+    FILE* f = fopen(btc_utils::get_block_file_path(dir, 0).c_str(), "wb");
+    REQUIRE(f);
+    for (const auto& record: records)
+        REQUIRE(fwrite(record.data(), 1, record.size(), f) == record.size());
+    fclose(f);
+}
+
+void remove_block_files(const std::string& dir)
+{
+    for (uint32_t file = 0; file < 2; file++)
+        std::remove(btc_utils::get_block_file_path(dir, file).c_str());
+    rmdir(dir.c_str());
+}
+
+}
+
+TEST_CASE("block_reader")
+{
+    const std::string dir = "block_reader_test";
+    write_block_files(dir);
+    const uint64_t first_pos = 3 + 8, second_pos = first_pos + make_block_record(1000).size() + 7;
+
+    for (unsigned int threads: {1u, 2u}) {
+        btc_utils::block_reader_options_t options;
+        options.network = btc_utils::network_t::mainnet;
+        options.threads = threads;
+        btc_utils::block_reader_t reader(dir, options);
+        counting_visitor_t visitor;
+        reader.read(visitor);
+        CHECK(reader.files() == 2);
+        CHECK(reader.blocks() == 4);
+        CHECK(visitor.files == 2);
+        CHECK(visitor.txes == 4);
+        CHECK(visitor.outputs == 4);
+        CHECK(visitor.errors == 2);
+        for (uint32_t file = 0; file < 2; file++)
+            CHECK(visitor.positions[file] == std::vector<uint64_t>{first_pos, second_pos});
+    }
+
+    // the block before the time range is skipped by its size
+    btc_utils::block_reader_options_t options;
+    options.network = btc_utils::network_t::mainnet;
+    options.filter.from_time = 1500;
+    btc_utils::block_reader_t reader(dir, options);
+    counting_visitor_t visitor;
+    reader.read(visitor);
+    CHECK(reader.blocks() == 2);
+    CHECK(reader.skipped_blocks() == 2);
+    CHECK(visitor.times == std::vector<uint32_t>{2000, 2000});
+
+    // only the existing file after the one being read is read ahead
+    CHECK(btc_utils::advise_block_file(dir, 1, btc_utils::BLOCK_FILE_WILLNEED));
+    CHECK(!btc_utils::advise_block_file(dir, 2, btc_utils::BLOCK_FILE_WILLNEED));
+    CHECK(btc_utils::block_file_residency(dir, 2) == 0);
+    btc_utils::block_file_cache_t cache(dir, 2, false);
+    cache.begin(0);
+    cache.end(0);
+    CHECK(cache.prefetched() == 1);
+    CHECK(cache.dropped() == 0);
+
+    // a file never begun is not dropped, the files before the first one begun are not looked at
+    btc_utils::block_file_cache_t dropping(dir, 0, true);
+    dropping.begin(1);
+    dropping.end(0);
+    CHECK(dropping.dropped() == 0);
+    remove_block_files(dir);
+}
+
+TEST_CASE("read_status")
+{
+    CHECK(std::string(btc_utils::get_read_status(btc_utils::READ_TOO_LARGE)) == "size is too large");
+    CHECK(std::string(btc_utils::get_read_status(static_cast<btc_utils::read_status_t>(7))) == "unknown");
+
+    // the transaction count of a record replaced, the size of the record follows it
+    auto with_tx_count = [](const std::string& record, const std::string& count) {
+        std::string res = record.substr(0, 8 + btc_utils::block_header_t::SIZE) + count +
+                          record.substr(8 + btc_utils::block_header_t::SIZE + 1);
+        uint32_t size = static_cast<uint32_t>(res.size() - 8);
+        res.replace(4, sizeof(size), reinterpret_cast<const char*>(&size), sizeof(size));
+        return res;
+    };
+    std::string truncated = make_block_record(1500);
+    uint32_t short_size = btc_utils::block_header_t::SIZE + 1 + 20;
+    truncated.replace(4, sizeof(short_size), reinterpret_cast<const char*>(&short_size), sizeof(short_size));
+    const std::vector<std::pair<std::string, std::string>> bad_records = {
+        {truncated, "read attempted past buffer limit"},
+        {with_tx_count(make_block_record(1500), from_hex_string("fd0100")), "non-canonical compact int"},
+        {with_tx_count(make_block_record(1500), from_hex_string("fe00000001")), "size is too large"},
+    };
+    for (const auto& bad: bad_records) {
+        CAPTURE(bad.second);
+        std::string data = make_block_record(1000) + bad.first + make_block_record(2000);
+        FILE* f = std::tmpfile();
+        REQUIRE(f);
+        REQUIRE(fwrite(data.data(), 1, data.size(), f) == data.size());
+        rewind(f);
+        std::vector<uint32_t> times;
+        std::vector<std::string> errors;
+        btc_utils::read_block_file_range(f, btc_utils::network_t::mainnet, 0, data.size(),
+                                         [](const btc_utils::block_header_view_t&) { return true; },
+                                         [&](std::vector<unsigned char>& block, uint64_t, uint64_t) {
+                                             times.push_back(btc_utils::block_header_view_t(block.data()).time());
+                                         },
+                                         [](uint64_t, uint64_t) {},
+                                         [&](const std::string& message) { errors.push_back(message); });
+        // the block after the bad one is found at its magic
+        CHECK(times == std::vector<uint32_t>{1000, 2000});
+        REQUIRE(errors.size() == 1);
+        CHECK(errors[0] == "Deserialize or I/O error - " + bad.second);
+    }
+}
+
+TEST_CASE("false_magic")
+{
+    // a false match of the magic with a size that reaches past the start of the next block
+    std::string second = make_block_record(2000);
+    std::string header(btc_utils::block_header_t::SIZE, '\0');
+    header.replace(0, 4, "\xff\xff\xff\xff");
+    uint32_t size = static_cast<uint32_t>(header.size() + second.size());
+    const btc_utils::start_marker_t& start = btc_utils::message_start(btc_utils::network_t::mainnet);
+    std::string fake = std::string(reinterpret_cast<const char*>(start), btc_utils::MESSAGE_START_SIZE) +
+                       std::string(reinterpret_cast<const char*>(&size), sizeof(size)) + header;
+    CHECK(!btc_utils::block_header_view_t(reinterpret_cast<const unsigned char*>(header.data())).plausible());
+
+    std::string data = make_block_record(1000) + fake + second + make_block_record(3000);
+    FILE* f = std::tmpfile();
+    REQUIRE(f);
+    REQUIRE(fwrite(data.data(), 1, data.size(), f) == data.size());
+    rewind(f);
+    std::vector<uint32_t> times;
+    size_t skipped = 0;
+    // the filter rejects the first block and the false header, the search goes on after the false magic
+    btc_utils::read_block_file_range(f, btc_utils::network_t::mainnet, 0, data.size(),
+                                     [](const btc_utils::block_header_view_t& h) { return h.time() >= 1500; },
+                                     [&](std::vector<unsigned char>& block, uint64_t, uint64_t) {
+                                         times.push_back(btc_utils::block_header_view_t(block.data()).time());
+                                     },
+                                     [&](uint64_t, uint64_t) { skipped++; },
+                                     [](const std::string&) {});
+    CHECK(times == std::vector<uint32_t>{2000, 3000});
+    CHECK(skipped == 1);
+}
+
+TEST_CASE("chain_linker")
+{
+    auto make_block = [](const btc_utils::uint256_t& prev, uint32_t nonce) {
+        btc_utils::block_t block;
+        block.version_ = 1;
+        block.prev_block_hash_ = prev;
+        block.merkle_root_.fill(0);
+        block.time_ = nonce;
+        block.bits_ = 0x1d00ffff;
+        block.nonce_ = nonce;
+        return block;
+    };
+    std::vector<btc_utils::block_t> chain;
+    for (uint32_t i = 0; i < 6; i++)
+        chain.push_back(make_block(i ? chain.back().hash() : btc_utils::uint256_t{}, i));
+    btc_utils::block_t stale = make_block(chain[1].hash(), 100);
+    btc_utils::block_t stale_child = make_block(stale.hash(), 101);
+    // the linker only reads the header of the 100 serialized bytes
+    auto serialized = [](const btc_utils::block_t& block) {
+        std::vector<unsigned char> data(100, 0);
+        btc_utils::encode_fixed(static_cast<const btc_utils::block_header_t&>(block), data.data());
+        return data;
+    };
+
+    // out of order with a stale block and its child met after the depth was reached
+    std::vector<btc_utils::uint256_t> hashes;
+    std::vector<uint32_t> heights;
+    btc_utils::chain_linker_t linker(1, 1 << 20, [&](const std::vector<unsigned char>& block, uint32_t, uint64_t pos,
+                                                     uint32_t height) {
+        btc_utils::block_header_view_t header(block.data());
+        hashes.push_back(header.hash());
+        heights.push_back(height);
+        CHECK(pos == header.decode().nonce_);
+    });
+    for (size_t i: {0u, 2u, 1u, 3u})
+        linker.add(serialized(chain[i]), 0, i);
+    CHECK(heights == std::vector<uint32_t>{0, 1, 2});
+    linker.add(serialized(stale), 0, 100);
+    linker.add(serialized(stale_child), 0, 101);
+    linker.add_header(chain[5]);
+    linker.add_header(chain[4]);
+    linker.add(serialized(chain[0]), 0, 0);
+    linker.finish();
+    // the headers link the chain without being emitted
+    CHECK(heights == std::vector<uint32_t>{0, 1, 2, 3});
+    for (size_t i = 0; i < hashes.size(); i++)
+        CHECK(hashes[i] == chain[i].hash());
+    CHECK(linker.stats().blocks == 4);
+    CHECK(linker.stats().stale == 2);
+    CHECK(linker.stats().duplicates == 1);
+    CHECK(linker.stats().unlinked == 0);
+    CHECK(linker.stats().max_delay == 4);
+
+    // a full buffer drops the blocks without a previous one, the first ones added first, then
+    // emits the best chain early
+    heights.clear();
+    btc_utils::chain_linker_t bounded(10, 250, [&](const std::vector<unsigned char>&, uint32_t, uint64_t,
+                                                   uint32_t height) {
+        heights.push_back(height);
+    });
+    for (size_t i: {5u, 4u, 3u})
+        bounded.add(serialized(chain[i]), 0, i);
+    CHECK(bounded.stats().unlinked == 3);
+    for (size_t i: {0u, 1u, 2u})
+        bounded.add(serialized(chain[i]), 0, i);
+    CHECK(heights == std::vector<uint32_t>{0});
+    CHECK(bounded.stats().early == 1);
+    bounded.finish();
+    CHECK(heights == std::vector<uint32_t>{0, 1, 2});
+    CHECK(bounded.stats().peak_blocks == 3);
+    CHECK(bounded.stats().peak_bytes == 300);
+    CHECK(bounded.height() == 3);
+}
+
+TEST_CASE("block_header_index")
+{
+    // genesis, a stale block met first at height 1, the chain on top of the other block and a block without a chain
+    const std::string genesis = make_block_record(1000);
+    const std::string stale = make_block_record(1001, record_hash(genesis));
+    const std::string first = make_block_record(1002, record_hash(genesis));
+    const std::string second = make_block_record(1003, record_hash(first));
+    btc_utils::uint256_t unknown;
+    unknown.fill(7);
+    const std::string orphan = make_block_record(1004, unknown);
+    const std::string dir = "block_header_index_test";
+    write_block_file(dir, {genesis, stale, orphan, first, second});
+
+    btc_utils::block_filter_t filter;
+    filter.from_height = 1;
+    btc_utils::block_height_map_t heights;
+    btc_utils::header_index_stats_t stats =
+        btc_utils::index_block_headers(dir, btc_utils::network_t::mainnet, filter, &heights);
+    CHECK(stats.headers == 5);
+    CHECK(stats.stale == 1);
+    CHECK(stats.orphans == 1);
+    CHECK(heights.size() == 3);
+    CHECK(heights[record_hash(genesis)] == 0);
+    CHECK(heights[record_hash(first)] == 1);
+    CHECK(heights[record_hash(second)] == 2);
+    CHECK(heights.count(record_hash(stale)) == 0);
+    CHECK(filter.blocks.size() == 2);
+    CHECK(filter.blocks.count(record_hash(stale)) == 0);
+    remove_block_files(dir);
+}
+
+TEST_CASE("c_api")
+{
+    CHECK(btc_api_version() == BTC_UTILS_C_API_VERSION);
+    CHECK(btc_reader_open("/nonexistent", nullptr) == nullptr);
+    CHECK(std::string(btc_last_error()).find("blk00000.dat") != std::string::npos);
+
+    const std::string dir = "c_api_test";
+    write_block_files(dir);
+    btc_reader_options_t options;
+    btc_reader_options_init(&options);
+    options.network = 3;
+    CHECK(btc_reader_open(dir.c_str(), &options) == nullptr);
+
+    options.network = BTC_MAINNET;
+    options.from_time = 1500;
+    btc_reader_t* reader = btc_reader_open(dir.c_str(), &options);
+    REQUIRE(reader);
+    // a batch is only short at the end
+    btc_output_record_t records[3];
+    REQUIRE(btc_reader_next(reader, records, 1) == 1);
+    REQUIRE(btc_reader_next(reader, records + 1, 2) == 1);
+    CHECK(btc_reader_next(reader, records, 3) == 0);
+    CHECK(btc_reader_errors(reader) == 2);
+    btc_reader_close(reader);
+    for (int i = 0; i < 2; i++) {
+        CHECK(std::string(records[i].address) == "1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa");
+        CHECK(records[i].file == static_cast<uint32_t>(i));
+        CHECK(records[i].vout == 0);
+        CHECK(records[i].value == 5000000000u);
+        CHECK(records[i].type == BTC_OUTPUT_P2PKH);
+    }
+    btc_utils::uint256_t txid;
+    memcpy(txid.data(), records[0].txid, txid.size());
+    CHECK(txid != btc_utils::uint256_t{});
+
+    // closed before every record is fetched
+    reader = btc_reader_open(dir.c_str(), nullptr);
+    REQUIRE(reader);
+    CHECK(btc_reader_next(reader, records, 1) == 1);
+    btc_reader_close(reader);
+    remove_block_files(dir);
+}
+
+TEST_CASE("serialize_traits")
+{
+    static_assert(btc_utils::fixed_width<btc_utils::out_point_t>::value == 36);
+    static_assert(btc_utils::fixed_width<btc_utils::tx_in_t>::value == 0);
+    static_assert(btc_utils::fixed_prefix_size_v<btc_utils::tx_in_t> == 36);
+    static_assert(btc_utils::fixed_prefix_size_v<btc_utils::tx_out_t> == 8);
+    static_assert(btc_utils::field_offset_v<btc_utils::block_header_t, 3> == 68);
+
+    btc_utils::block_header_t header;
+    header.version_ = 0x20000004;
+    header.prev_block_hash_ = btc_utils::uint256_from_hex("000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
+    header.merkle_root_ = btc_utils::uint256_from_hex("4a5e1e4baab89f3a32518a88c31bc87f618f76673e2cc77ab2127b7afdeda33b");
+    header.time_ = 1231006505;
+    header.bits_ = 0x1d00ffff;
+    header.nonce_ = 2083236893;
+    unsigned char data[btc_utils::block_header_t::SIZE];
+    btc_utils::encode_fixed(header, data);
+    CHECK(btc_utils::to_hex(std::vector<unsigned char>(data, data + 4)) == "04000020");
+
+    // members read in place, the whole header decoded back
+    btc_utils::fixed_view_t<btc_utils::block_header_t> view(data);
+    CHECK(view.get<3>() == header.time_);
+    CHECK(view.get<1>() == header.prev_block_hash_);
+    CHECK(view.decode().hash() == header.hash());
+
+    // the header view hashes the bytes in place
+    btc_utils::block_header_view_t header_view(data);
+    CHECK(header_view.hash() == header.hash());
+    CHECK(header_view.prev_block_hash() == header.prev_block_hash_);
+    CHECK(header_view.time() == header.time_);
+    CHECK(header_view.bits() == header.bits_);
+}
+
+TEST_CASE("utxo_set")
+{
+    // tiny table to go through growth and long probe chains
+    btc_utils::utxo_set_t utxos(std::string(), 16);
+    std::map<std::pair<uint32_t, uint32_t>, uint64_t> expected;
+    btc_utils::out_point_t outpoint;
+    outpoint.hash.fill(0);
+    for (uint32_t tx = 0; tx < 200; tx++)
+    {
+        outpoint.hash[0] = static_cast<unsigned char>(tx);
+        outpoint.hash[1] = static_cast<unsigned char>(tx % 3);
+        for (outpoint.n = 0; outpoint.n < 5; outpoint.n++)
+        {
+            utxos.add(outpoint, btc_utils::utxo_t{tx, tx * 10 + outpoint.n});
+            expected[{tx, outpoint.n}] = tx * 10 + outpoint.n;
+        }
+    }
+    CHECK(utxos.size() == 1000);
+    for (uint32_t tx = 0; tx < 200; tx += 2)
+    {
+        outpoint.hash[0] = static_cast<unsigned char>(tx);
+        outpoint.hash[1] = static_cast<unsigned char>(tx % 3);
+        outpoint.n = tx % 5;
+        btc_utils::utxo_t coin;
+        REQUIRE(utxos.spend(outpoint, coin));
+        CHECK(coin.address_id == tx);
+        CHECK(coin.value == tx * 10 + outpoint.n);
+        CHECK(!utxos.spend(outpoint, coin));
+        expected.erase({tx, outpoint.n});
+    }
+    CHECK(utxos.size() == expected.size());
+    uint64_t total = 0;
+    utxos.for_each([&total](const btc_utils::utxo_t& coin) { total += coin.value; });
+    uint64_t expected_total = 0;
+    for (const auto& e : expected)
+        expected_total += e.second;
+    CHECK(total == expected_total);
+
+    // txids that share the first 8 bytes, the bytes the home slot is picked by, are different outpoints
+    btc_utils::utxo_set_t shared(std::string(), 16);
+    btc_utils::out_point_t a, b, c;
+    a.hash.fill(0x11);
+    b.hash = a.hash;
+    b.hash[31] = 0x22;
+    c.hash = a.hash;
+    c.hash[8] = 0x33;
+    a.n = b.n = c.n = 0;
+    shared.add(a, btc_utils::utxo_t{1, 100});
+    shared.add(b, btc_utils::utxo_t{2, 200});
+    CHECK(shared.size() == 2);
+    btc_utils::utxo_t coin;
+    CHECK(!shared.spend(c, coin));
+    REQUIRE(shared.spend(b, coin));
+    CHECK(coin.address_id == 2);
+    CHECK(coin.value == 200);
+    REQUIRE(shared.spend(a, coin));
+    CHECK(coin.address_id == 1);
+    CHECK(coin.value == 100);
+    CHECK(shared.size() == 0);
+
+    // in chain order a spend follows the output it spends and a stale block spending it first is left out
+    const std::string genesis = make_block_record(1000);
+    const std::vector<unsigned char> coinbase_tx = btc_utils::from_hex(COINBASE_HEX);
+    const btc_utils::uint256_t coinbase_txid = btc_utils::hash_sha256d(coinbase_tx.data(), coinbase_tx.size());
+    auto spend = [&](const std::string& hash160) {
+        return "01000000" "01" + btc_utils::to_hex({coinbase_txid.begin(), coinbase_txid.end()}) + "00000000" "00" "ffffffff"
+               "01" "00f2052a01000000" "1976a914" + hash160 + "88ac" "00000000";
+    };
+    auto coinbase = [](const std::string& tag) {
+        std::string tx = COINBASE_HEX;
+        return tx.replace(tx.find("020101"), 6, "0201" + tag);
+    };
+    const std::string first = make_block_record(1001, record_hash(genesis), {coinbase("02"), spend(std::string(40, '1'))});
+    const std::string stale = make_block_record(1002, record_hash(genesis), {coinbase("03"), spend(std::string(40, '2'))});
+    const std::string second = make_block_record(1003, record_hash(first), {coinbase("04")});
+    const std::string dir = "utxo_set_test";
+    write_block_file(dir, {genesis, second, stale, first});
+
+    struct utxo_visitor_t : public btc_utils::block_visitor_t
+    {
+        btc_utils::utxo_set_t utxos;
+        std::vector<std::string> addresses;
+        size_t missing = 0;
+
+        void on_block(const btc_utils::block_view_t& view) override
+        {
+            btc_utils::utxo_t coin;
+            for (const auto& tx: view.block().txes_) {
+                for (const auto& in: tx.vin)
+                    if (in.prevout.n != 0xffffffff && !utxos.spend(in.prevout, coin))
+                        missing++;
+                btc_utils::out_point_t out{tx.txid, 0};
+                for (; out.n < tx.vout.size(); out.n++) {
+                    addresses.push_back(tx.vout[out.n].addresses(btc_utils::network_t::mainnet)[0]);
+                    utxos.add(out, btc_utils::utxo_t{static_cast<uint32_t>(addresses.size() - 1), tx.vout[out.n].nValue});
+                }
+            }
+        }
+    };
+    btc_utils::block_reader_options_t options;
+    options.network = btc_utils::network_t::mainnet;
+    options.hashes = btc_utils::TX_HASHES_TXID;
+    options.chain_order = true;
+    utxo_visitor_t visitor;
+    btc_utils::block_reader_t reader(dir, options);
+    reader.read(visitor);
+    CHECK(visitor.missing == 0);
+    CHECK(reader.chain_stats().stale == 1);
+    std::map<std::string, uint64_t> balances;
+    visitor.utxos.for_each([&](const btc_utils::utxo_t& coin) { balances[visitor.addresses[coin.address_id]] += coin.value; });
+    CHECK(balances.size() == 2);
+    CHECK(balances["1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa"] == 10000000000u);
+    btc_utils::tx_out_t paid{0, btc_utils::from_hex("76a914" + std::string(40, '1') + "88ac")};
+    CHECK(balances[paid.addresses(btc_utils::network_t::mainnet)[0]] == 5000000000u);
+    remove_block_files(dir);
+}
+
+TEST_CASE("address_stats")
+{
+    btc_utils::tx_destination_t a{btc_utils::TX_PUBKEYHASH, 0, 20, {}};
+    btc_utils::tx_destination_t b = a, c = a;
+    b.program_[0] = 1;
+    c.type_ = btc_utils::TX_SCRIPTHASH;
+    const btc_utils::address_key_t ka(a), kb(b), kc(c);
+
+    // 16 slots of 32 bytes and the keys of two addresses
+    btc_utils::address_stats_table_t table(16 * 32 + 2 * 22, 16);
+    CHECK(table.merge(ka, ka.hash(), {5, 5, 1, 10}));
+    CHECK(table.merge(kb, kb.hash(), {7, 7, 1, 1}));
+    CHECK(table.merge(ka, ka.hash(), {2, 2, 1, 5}));
+    CHECK(!table.merge(kc, kc.hash(), {1, 1, 1, 1}));
+    CHECK(table.size() == 2);
+
+    // two threads with a table each, merged through run files
+    const std::string path = "address_stats_test";
+    btc_utils::address_aggregator_t aggregator(path, 1 << 20, 2);
+    aggregator.add(0, a, 5, 10);
+    aggregator.add(0, b, 7, 1);
+    aggregator.add(1, a, 3, 5);
+    aggregator.add(1, c, 9, 2);
+    aggregator.add(1, a, 4, 1);
+    std::map<std::string, btc_utils::address_stats_t> stats;
+    uint64_t last_hash = 0;
+    bool sorted = true;
+    CHECK(aggregator.finish([&](const btc_utils::address_key_t& key, const btc_utils::address_stats_t& s) {
+        sorted &= key.hash() >= last_hash;
+        last_hash = key.hash();
+        stats[btc_utils::encode_destination(key.destination())] = s;
+    }) == 3);
+    CHECK(sorted);
+    CHECK(aggregator.runs() == 2);
+    FILE* run = fopen((path + ".run0").c_str(), "rb");
+    CHECK(!run);
+    const btc_utils::address_stats_t& sa = stats[btc_utils::encode_destination(a)];
+    CHECK(sa.first_height == 3);
+    CHECK(sa.last_height == 5);
+    CHECK(sa.outputs == 3);
+    CHECK(sa.received == 16);
+    CHECK(stats[btc_utils::encode_destination(b)].received == 1);
+    CHECK(stats[btc_utils::encode_destination(c)].first_height == 9);
+
+    // the outputs of a stale block have no height and are left out
+    const std::string genesis = make_block_record(1000);
+    std::string other_coinbase = COINBASE_HEX;
+    other_coinbase.replace(other_coinbase.find("62e907b1"), 8, "00000000");
+    const std::string stale = make_block_record(1001, record_hash(genesis), {other_coinbase});
+    const std::string first = make_block_record(1002, record_hash(genesis));
+    const std::string second = make_block_record(1003, record_hash(first));
+    const std::string dir = "address_stats_test";
+    write_block_file(dir, {genesis, stale, first, second});
+    btc_utils::block_filter_t filter;
+    btc_utils::block_height_map_t heights;
+    btc_utils::index_block_headers(dir, btc_utils::network_t::mainnet, filter, &heights);
+
+    struct stats_visitor_t : public btc_utils::block_visitor_t
+    {
+        btc_utils::address_aggregator_t& aggregator;
+        const btc_utils::block_height_map_t& heights;
+
+        stats_visitor_t(btc_utils::address_aggregator_t& a, const btc_utils::block_height_map_t& h)
+            : aggregator(a), heights(h) {}
+        void on_output(const btc_utils::block_view_t& view, const btc_utils::transaction_view_t&, uint32_t,
+                       const btc_utils::tx_out_view_t& out) override
+        {
+            auto it = heights.find(view.header().hash());
+            if (it == heights.end())
+                return;
+            for (const auto& dest: btc_utils::extract_destinations(out.script()))
+                aggregator.add(0, dest, it->second, out.value());
+        }
+    };
+    btc_utils::address_aggregator_t chain_aggregator(path, 1 << 20, 1);
+    stats_visitor_t visitor(chain_aggregator, heights);
+    btc_utils::block_reader_options_t options;
+    options.network = btc_utils::network_t::mainnet;
+    btc_utils::block_reader_t(dir, options).read(visitor);
+    stats.clear();
+    CHECK(chain_aggregator.finish([&](const btc_utils::address_key_t& key, const btc_utils::address_stats_t& s) {
+        stats[btc_utils::encode_destination(key.destination(), btc_utils::network_t::mainnet)] = s;
+    }) == 1);
+    const btc_utils::address_stats_t& coinbase = stats["1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa"];
+    CHECK(coinbase.first_height == 0);
+    CHECK(coinbase.last_height == 2);
+    CHECK(coinbase.outputs == 3);
+    CHECK(coinbase.received == 15000000000u);
+    remove_block_files(dir);
+}
+
+TEST_CASE("address_shard")
+{
+    // the same address from a P2PK and a P2PKH output, and repeated, always lands in one shard
+    std::vector<btc_utils::tx_destination_t> dests;
+    for (unsigned int i = 0; i < 300; i++) {
+        btc_utils::tx_destination_t dest{btc_utils::TX_PUBKEYHASH, 0, 20, {}};
+        dest.program_[0] = static_cast<unsigned char>(i);
+        dest.program_[1] = static_cast<unsigned char>(i >> 8);
+        dests.push_back(dest);
+        dest.type_ = i % 2 ? btc_utils::TX_PUBKEY : btc_utils::TX_WITNESS_V0_KEYHASH;
+        dests.push_back(dest);
+        dest.type_ = btc_utils::TX_WITNESS_V1_TAPROOT;
+        dest.version_ = 1;
+        dest.length_ = 32;
+        dests.push_back(dest);
+    }
+    for (unsigned int shards: {1u, 3u, 16u}) {
+        std::map<std::string, std::set<unsigned int>> placed;
+        std::vector<size_t> sizes(shards, 0);
+        for (const auto& dest: dests) {
+            unsigned int shard = btc_utils::address_shard(btc_utils::address_key_t(dest), shards);
+            REQUIRE(shard < shards);
+            sizes[shard]++;
+            placed[btc_utils::encode_destination(dest, btc_utils::network_t::mainnet)].insert(shard);
+        }
+        CHECK(placed.size() == 750);
+        for (const auto& address: placed)
+            CHECK(address.second.size() == 1);
+        for (size_t size: sizes)
+            CHECK(size > 0);
+    }
+}
+
+TEST_CASE("address_decode")
+{
+    btc_utils::tx_destination_t dest;
+    for (const char* address : {"1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa",
+                                "3J98t1WpEZ73CNmQviecrnyiWrnqRhWNLy",
+                                "bc1qw508d6qejxtdg4y5r3zarvary0c5xw7kv8f3t4",
+                                "bc1qrp33g0q5c5txsp9arysrx4k6zdkfs4nce4xj0gdcccefvpysxf3qccfmv3"})
+    {
+        REQUIRE(btc_utils::decode_destination(address, dest));
+        CHECK(btc_utils::encode_destination(dest) == address);
+    }
+    REQUIRE(btc_utils::decode_destination("3J98t1WpEZ73CNmQviecrnyiWrnqRhWNLy", dest));
+    CHECK(dest.type_ == btc_utils::TX_SCRIPTHASH);
+    // P2SH addresses take the script prefix
+    btc_utils::uint160_t script_hash;
+    std::copy(dest.program_.begin(), dest.program_.begin() + script_hash.size(), script_hash.begin());
+    CHECK(btc_utils::encode_destination(btc_utils::script_hash_tx_destination_t(script_hash)) ==
+          "3J98t1WpEZ73CNmQviecrnyiWrnqRhWNLy");
+    CHECK(!btc_utils::decode_destination("1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNb", dest));
+    CHECK(!btc_utils::decode_destination("tb1qw508d6qejxtdg4y5r3zarvary0c5xw7kxpjzsx", dest));
+}
+
+TEST_CASE("address_index")
+{
+    // the index and the runs next to it go to a directory of their own
+    const char* tmp = getenv("TMPDIR");
+    std::string dir = std::string(tmp && *tmp ? tmp : "/tmp") + "/address_index_test_XXXXXX";
+    REQUIRE(mkdtemp(&dir[0]));
+    const std::string path = dir + "/index.bin";
+    btc_utils::tx_destination_t a, b, c;
+    REQUIRE(btc_utils::decode_destination("1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa", a));
+    REQUIRE(btc_utils::decode_destination("3J98t1WpEZ73CNmQviecrnyiWrnqRhWNLy", b));
+    REQUIRE(btc_utils::decode_destination("bc1qw508d6qejxtdg4y5r3zarvary0c5xw7kv8f3t4", c));
+    {
+        btc_utils::address_index_writer_t writer(path);
+        std::vector<btc_utils::address_posting_t> run1 = {
+            {a, btc_utils::make_block_pos(0, 8)}, {b, btc_utils::make_block_pos(0, 300)},
+            {a, btc_utils::make_block_pos(0, 300)}, {a, btc_utils::make_block_pos(0, 8)}};
+        std::vector<btc_utils::address_posting_t> run2 = {{a, btc_utils::make_block_pos(1, 8)}};
+        writer.add_run(run1);
+        writer.add_run(run2);
+        CHECK(writer.finish() == 2);
+    }
+    btc_utils::address_index_t index(path);
+    CHECK(index.find(a) == std::vector<uint64_t>{8, 300, btc_utils::make_block_pos(1, 8)});
+    CHECK(index.find(b) == std::vector<uint64_t>{300});
+    CHECK(index.find(c).empty());
+    // P2PK outputs are found by the P2PKH address of the key
+    a.type_ = btc_utils::TX_PUBKEY;
+    CHECK(index.find(a).size() == 3);
+    std::remove(path.c_str());
+    // finish removed the runs
+    CHECK(rmdir(dir.c_str()) == 0);
+}
+
+TEST_CASE("columnar")
+{
+    const std::string path = "test_columnar.bin";
+    btc_utils::tx_destination_t a, b;
+    REQUIRE(btc_utils::decode_destination("1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa", a));
+    REQUIRE(btc_utils::decode_destination("bc1qrp33g0q5c5txsp9arysrx4k6zdkfs4nce4xj0gdcccefvpysxf3qccfmv3", b));
+    btc_utils::uint256_t txid = btc_utils::uint256_from_hex("4a5e1e4baab89f3a32518a88c31bc87f618f76673e2cc77ab2127b7afdeda33b");
+    for (int level : {0, 3})
+    {
+        if (level && !btc_utils::columnar_zstd_supported())
+            continue;
+        {
+            btc_utils::columnar_writer_t writer(path, level, 4);
+            for (uint32_t i = 0; i < 10; i++)
+                writer.add(btc_utils::make_block_pos(i / 4, 8 + i * 100), txid, i, i % 3 ? a : b, 5000000000ull - i);
+            writer.close();
+            CHECK(writer.rows() == 10);
+        }
+        btc_utils::columnar_reader_t reader(path);
+        REQUIRE(reader.rows() == 10);
+        REQUIRE(reader.row_groups() == 3);
+        CHECK(reader.column_names()[btc_utils::COLUMN_PROGRAM] == "program");
+        btc_utils::columnar_row_group_t group;
+        reader.read(2, group);
+        REQUIRE(group.rows == 2);
+        CHECK(group.block_pos[1] == btc_utils::make_block_pos(2, 908));
+        CHECK(group.txid[0] == txid);
+        CHECK(group.vout[1] == 9);
+        CHECK(group.value[1] == 5000000000ull - 9);
+        CHECK(btc_utils::encode_destination(group.destination(0)) == "1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa");
+        CHECK(btc_utils::encode_destination(group.destination(1)) == "bc1qrp33g0q5c5txsp9arysrx4k6zdkfs4nce4xj0gdcccefvpysxf3qccfmv3");
+
+        // only the requested columns are decoded
+        btc_utils::columnar_row_group_t values;
+        reader.read(0, values, 1u << btc_utils::COLUMN_VALUE);
+        CHECK(values.value.size() == 4);
+        CHECK(values.txid.empty());
+    }
+    std::remove(path.c_str());
+}
+
+TEST_CASE("watchlist")
+{
+    std::vector<uint64_t> hashes;
+    for (uint64_t i = 0; i < 10000; i++)
+        hashes.push_back(i * 0x9e3779b97f4a7c15ULL);
+    hashes.push_back(hashes.front());
+    btc_utils::xor_filter_t filter(hashes);
+    for (uint64_t hash : hashes)
+        REQUIRE(filter.contains(hash));
+    size_t false_positives = 0;
+    for (uint64_t i = 0; i < 100000; i++)
+        false_positives += filter.contains(i * 0x9e3779b97f4a7c15ULL + 1);
+    CHECK(false_positives < 1000);
+    CHECK(!btc_utils::xor_filter_t().contains(0));
+
+    btc_utils::tx_destination_t p2pkh, p2sh, p2wpkh;
+    REQUIRE(btc_utils::decode_destination("1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa", p2pkh));
+    REQUIRE(btc_utils::decode_destination("3J98t1WpEZ73CNmQviecrnyiWrnqRhWNLy", p2sh));
+    REQUIRE(btc_utils::decode_destination("bc1qw508d6qejxtdg4y5r3zarvary0c5xw7kv8f3t4", p2wpkh));
+    btc_utils::watchlist_t watchlist({btc_utils::address_key_t(p2pkh), btc_utils::address_key_t(p2wpkh)});
+    CHECK(watchlist.size() == 2);
+    for (const auto& dest : {p2pkh, p2wpkh}) {
+        btc_utils::address_key_t key(dest);
+        CHECK(watchlist.may_contain(key.hash()));
+        CHECK(watchlist.contains(key, key.hash()));
+    }
+    btc_utils::address_key_t key(p2sh);
+    CHECK(!watchlist.contains(key, key.hash()));
+    // P2PK outputs pay to the P2PKH address of the key
+    p2pkh.type_ = btc_utils::TX_PUBKEY;
+    CHECK(watchlist.contains(btc_utils::address_key_t(p2pkh), btc_utils::address_key_t(p2pkh).hash()));
+}
+
+TEST_CASE("address_taproot")
+{
+    std::vector<unsigned char> script = {0x51, 0x20};
+    std::vector<unsigned char> output_key = btc_utils::from_hex(
+        "79be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798");
+    script.insert(script.end(), output_key.begin(), output_key.end());
+    std::vector<btc_utils::tx_destination_t> dests = btc_utils::extract_destinations(script);
+    REQUIRE(dests.size() == 1);
+    CHECK(dests[0].type_ == btc_utils::TX_WITNESS_V1_TAPROOT);
+    CHECK(btc_utils::encode_destination(dests[0]) ==
+          "bc1p0xlxvlhemja6c4dqv22uapctqupfhlxm9h8z3k2e72q4k9hcz7vqzk5jj0");
+
+    btc_utils::tx_destination_t dest;
+    REQUIRE(btc_utils::decode_destination("bc1p0xlxvlhemja6c4dqv22uapctqupfhlxm9h8z3k2e72q4k9hcz7vqzk5jj0", dest));
+    CHECK(dest.type_ == btc_utils::TX_WITNESS_V1_TAPROOT);
+    CHECK(std::equal(output_key.begin(), output_key.end(), dest.program_.begin()));
+    REQUIRE(btc_utils::decode_destination("bc1sw50qgdz25j", dest));
+    CHECK(dest.type_ == btc_utils::TX_WITNESS_UNKNOWN);
+    CHECK(btc_utils::encode_destination(dest) == "bc1sw50qgdz25j");
+    // v1+ with a bech32 checksum and v0 with a bech32m one
+    CHECK(!btc_utils::decode_destination("bc1p0xlxvlhemja6c4dqv22uapctqupfhlxm9h8z3k2e72q4k9hcz7vqh2y7hd", dest));
+    CHECK(!btc_utils::decode_destination("bc1qw508d6qejxtdg4y5r3zarvary0c5xw7kemeawh", dest));
+}
+
+TEST_CASE("address_multisig")
+{
+    const std::string compressed = "0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798";
+    const std::string uncompressed = "0479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798"
+                                     "483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8";
+    std::vector<unsigned char> script = btc_utils::from_hex("5121" + compressed + "41" + uncompressed + "52ae");
+    std::vector<btc_utils::tx_destination_t> dests = btc_utils::extract_destinations(script);
+    REQUIRE(dests.size() == 2);
+    CHECK(dests[0].type_ == btc_utils::TX_MULTISIG);
+    CHECK(btc_utils::encode_destination(dests[0]) == "1BgGZ9tcN4rm9KBzDn7KprQz87SZ26SAMH");
+    CHECK(btc_utils::encode_destination(dests[1]) == "1EHNa6Q4Jz2uvNExL497mE43ikXhwF6kZm");
+
+    std::vector<std::vector<unsigned char>> solutions;
+    REQUIRE(btc_utils::solver(script, solutions) == btc_utils::TX_MULTISIG);
+    REQUIRE(solutions.size() == 4);
+    CHECK(solutions.front()[0] == 1);
+    CHECK(solutions.back()[0] == 2);
+
+    // wrong key count, more required keys than keys, invalid key prefix
+    for (const std::string& hex : {"5121" + compressed + "52ae", "5221" + compressed + "51ae",
+                                   "5121" + ("05" + compressed.substr(2)) + "51ae"})
+        CHECK(btc_utils::extract_destinations(btc_utils::from_hex(hex)).empty());
+}
+
+TEST_CASE("address_balances")
+{
+    const std::string compressed = "0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798";
+    const std::string uncompressed = "0479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798"
+                                     "483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8";
+    const std::string first = "76a914" + std::string(40, '1') + "88ac";
+    const std::string second = "76a914" + std::string(40, '2') + "88ac";
+    std::vector<btc_utils::transaction_t> txes(2);
+    txes[0].txid.fill(0x01);
+    txes[0].vin.resize(1);
+    txes[0].vin[0].prevout.n = 0xffffffff;
+    txes[0].vout = {{100, btc_utils::from_hex(first)},
+                    {300, btc_utils::from_hex("5121" + compressed + "41" + uncompressed + "52ae")},
+                    {0, btc_utils::from_hex("6a04deadbeef")},
+                    {50, btc_utils::from_hex(first)}};
+    txes[1].txid.fill(0x02);
+    txes[1].vin.resize(2);
+    txes[1].vin[0].prevout = {txes[0].txid, 0};
+    txes[1].vin[1].prevout = {txes[0].txid, 7};
+    txes[1].vout = {{90, btc_utils::from_hex(second)}};
+
+    btc_utils::address_balances_t balances;
+    balances.process(txes.data(), txes.data() + txes.size());
+    std::vector<std::pair<std::string, uint64_t>> lines;
+    balances.for_each([&lines](const btc_utils::address_key_t& key, uint64_t balance) {
+        lines.emplace_back(btc_utils::encode_destination(key.destination(), btc_utils::network_t::mainnet), balance);
+    });
+    btc_utils::tx_out_t paid{0, btc_utils::from_hex(first)}, change{0, btc_utils::from_hex(second)};
+    // the multisig output goes to its first key only, in the order the addresses were first paid
+    REQUIRE(lines.size() == 3);
+    CHECK(lines[0] == std::make_pair(paid.addresses(btc_utils::network_t::mainnet)[0], uint64_t(50)));
+    CHECK(lines[1] == std::make_pair(std::string("1BgGZ9tcN4rm9KBzDn7KprQz87SZ26SAMH"), uint64_t(300)));
+    CHECK(lines[2] == std::make_pair(change.addresses(btc_utils::network_t::mainnet)[0], uint64_t(90)));
+    CHECK(balances.added() == 4);
+    CHECK(balances.spent() == 1);
+    CHECK(balances.missing() == 1);
+    CHECK(balances.shared_outputs() == 1);
+    CHECK(balances.unspent() == 3);
+    CHECK(balances.addresses() == 3);
+}
+
+TEST_CASE("destination_batch")
+{
+    const std::string hash = "62e907b15cbf27d5425399ebf6f0fb50ebb88f18";
+    const std::string key = "79be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798";
+    const std::string uncompressed = "04" + key + "483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8";
+    // every template, scripts one byte off a template and scripts left to the solver
+    const std::vector<std::string> scripts = {
+        "76a914" + hash + "88ac", "a914" + hash + "87", "0014" + hash, "0020" + key, "5120" + key,
+        "2102" + key + "ac", "41" + uncompressed + "ac", "76a914" + hash + "88ad", "a914" + hash + "88",
+        "0015" + hash + "00", "5220" + key, "2105" + key + "ac", "5121" + ("02" + key) + "51ae", "6a04deadbeef",
+        "", "51"};
+    std::vector<btc_utils::transaction_t> txes(3);
+    for (size_t i = 0; i < txes.size(); i++)
+        for (size_t j = i; j < scripts.size(); j++)
+            txes[i].vout.push_back({0, btc_utils::from_hex(scripts[j])});
+
+    btc_utils::destination_batch_t batch;
+    for (size_t round = 0; round < 2; round++) {
+        batch.assign(txes.data() + round, txes.data() + txes.size());
+        size_t output = 0;
+        for (size_t i = round; i < txes.size(); i++)
+            for (const auto& out: txes[i].vout) {
+                std::vector<btc_utils::tx_destination_t> expected = btc_utils::extract_destinations(out.scriptPubKey);
+                btc_utils::destination_range_t dests = batch[output++];
+                REQUIRE(size_t(dests.end() - dests.begin()) == expected.size());
+                for (size_t k = 0; k < expected.size(); k++) {
+                    const btc_utils::tx_destination_t& dest = dests.begin()[k];
+                    CHECK(dest.type_ == expected[k].type_);
+                    CHECK(dest.version_ == expected[k].version_);
+                    REQUIRE(dest.length_ == expected[k].length_);
+                    CHECK(std::equal(dest.program_.begin(), dest.program_.begin() + dest.length_,
+                                     expected[k].program_.begin()));
+                }
+            }
+    }
+
+    std::vector<const unsigned char*> data;
+    std::vector<uint32_t> sizes;
+    for (const auto& out: txes[0].vout) {
+        data.push_back(out.scriptPubKey.data());
+        sizes.push_back(static_cast<uint32_t>(out.scriptPubKey.size()));
+    }
+    std::vector<btc_utils::txnouttype> types(data.size());
+    btc_utils::classify_scripts(data.data(), sizes.data(), data.size(), types.data());
+    CHECK(types[0] == btc_utils::TX_PUBKEYHASH);
+    CHECK(types[4] == btc_utils::TX_WITNESS_V1_TAPROOT);
+    CHECK(types[6] == btc_utils::TX_PUBKEY);
+    CHECK(types[7] == btc_utils::TX_NONSTANDARD);
+    CHECK(types[10] == btc_utils::TX_NONSTANDARD);
+}
+
+TEST_CASE("pub_key_cache")
+{
+    btc_utils::pub_key_cache_t cache(64);
+    std::vector<std::vector<unsigned char>> keys;
+    for (unsigned char i = 0; i < 100; i++) {
+        std::vector<unsigned char> key(i % 2 ? 33 : 65, i);
+        key[0] = i % 2 ? 0x02 : 0x04;
+        keys.push_back(key);
+    }
+    for (int round = 0; round < 2; round++)
+        for (const auto& key : keys) {
+            btc_utils::pub_key_t pubkey(key.begin(), key.end());
+            CHECK(cache.get_id(key.data(), key.size()) == pubkey.get_id());
+        }
+    CHECK(cache.hits() + cache.misses() == 200);
+    CHECK(cache.misses() >= 100);
+    // repeated lookups of one key hit
+    uint64_t hits = cache.hits();
+    for (int i = 0; i < 10; i++)
+        cache.get_id(keys[0].data(), keys[0].size());
+    CHECK(cache.hits() >= hits + 9);
+}
+
+TEST_CASE("address_cache")
+{
+    btc_utils::address_cache_t cache(8);
+    std::vector<btc_utils::tx_destination_t> dests;
+    for (unsigned char i = 0; i < 32; i++) {
+        btc_utils::tx_destination_t dest{};
+        dest.type_ = i % 2 ? btc_utils::TX_PUBKEYHASH : btc_utils::TX_WITNESS_V1_TAPROOT;
+        dest.version_ = i % 2 ? 0 : 1;
+        dest.length_ = i % 2 ? 20 : 32;
+        dest.program_.fill(i);
+        dests.push_back(dest);
+    }
+    // a hot destination stays cached while cold ones are evicted
+    for (int round = 0; round < 3; round++)
+        for (const auto& dest : dests) {
+            CHECK(cache.encode(dests[0]) == btc_utils::encode_destination(dests[0]));
+            CHECK(cache.encode(dest) == btc_utils::encode_destination(dest));
+        }
+    CHECK(cache.hits(btc_utils::TX_WITNESS_V1_TAPROOT) >= 3 * 32 - 1);
+    CHECK(cache.misses(btc_utils::TX_PUBKEYHASH) == 3 * 16);
+
+    btc_utils::tx_destination_t none{};
+    none.type_ = btc_utils::TX_NONSTANDARD;
+    CHECK(cache.encode(none).empty());
+}
+
+TEST_CASE("network_params")
+{
+    static_assert(btc_utils::mainnet_params_t::BECH32_HRP_STATE == btc_utils::bech32::PolyModHRP("bc"),
+                  "HRP state is a constant");
+    btc_utils::tx_destination_t dest;
+    REQUIRE(btc_utils::decode_destination("bc1qw508d6qejxtdg4y5r3zarvary0c5xw7kv8f3t4", dest));
+    char buf[btc_utils::MAX_ADDRESS_SIZE];
+    size_t len = btc_utils::encode_destination<btc_utils::testnet_params_t>(dest, buf);
+    CHECK(std::string(buf, len) == "tb1qw508d6qejxtdg4y5r3zarvary0c5xw7kxpjzsx");
+    len = btc_utils::encode_destination<btc_utils::regtest_params_t>(dest, buf);
+    CHECK(std::string(buf, len).substr(0, 5) == "bcrt1");
+
+    REQUIRE(btc_utils::decode_destination("1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa", dest));
+    len = btc_utils::encode_destination<btc_utils::mainnet_params_t>(dest, buf);
+    CHECK(std::string(buf, len) == "1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa");
+    std::string testnet = btc_utils::encode_destination(dest, btc_utils::network_t::testnet);
+    CHECK(testnet[0] == 'm');
+    len = btc_utils::encode_destination<btc_utils::testnet_params_t>(dest, buf);
+    CHECK(std::string(buf, len) == testnet);
+    btc_utils::tx_destination_t decoded;
+    CHECK_FALSE(btc_utils::decode_destination(testnet, decoded));
+    REQUIRE(btc_utils::decode_destination(testnet, decoded, btc_utils::network_t::testnet));
+    CHECK(btc_utils::address_key_t(decoded) == btc_utils::address_key_t(dest));
+    CHECK_FALSE(btc_utils::decode_destination("tb1qw508d6qejxtdg4y5r3zarvary0c5xw7kxpjzsx", decoded,
+                                              btc_utils::network_t::regtest));
+}
+
+TEST_CASE("task_scheduler")
+{
+    std::atomic<uint64_t> sum(0);
+    std::atomic<unsigned int> outside(0);
+    std::vector<std::atomic<unsigned int>> runs(4);
+    {
+        // declared first, the scheduler runs the queued tasks when it is destroyed
+        std::function<void(uint64_t, uint64_t)> split;
+        btc_utils::task_scheduler_t scheduler(4);
+        CHECK(scheduler.current_worker() == 4);
+        // every task splits into smaller ones pushed onto the queue of its worker
+        split = [&](uint64_t begin, uint64_t end) {
+            unsigned int worker = scheduler.current_worker();
+            if (worker < 4)
+                runs[worker]++;
+            else
+                outside++;
+            if (end - begin <= 8) {
+                for (uint64_t i = begin; i < end; i++)
+                    sum += i;
+                return;
+            }
+            uint64_t mid = begin + (end - begin) / 2;
+            scheduler.submit([&split, begin, mid]() { split(begin, mid); });
+            scheduler.submit([&split, mid, end]() { split(mid, end); });
+        };
+        scheduler.submit([&split]() { split(0, 10000); });
+    }
+    CHECK(sum == 10000ULL * 9999 / 2);
+    CHECK(outside == 0);
+    unsigned int total = 0;
+    for (const auto& n: runs)
+        total += n;
+    CHECK(total > 1000);
+}
+
+TEST_CASE("output_writer")
+{
+    std::string expected;
+    for (int i = 0; i < 5000; i++)
+        expected += std::to_string(i * 7919) + (i % 3 ? " " : "\n");
+    for (bool direct: {false, true}) {
+        std::string path = "output_writer_test.txt";
+        {
+            // small buffers, so the writer thread cycles through them many times
+            btc_utils::output_writer_t writer(path, 4096, 2, direct);
+            for (size_t pos = 0; pos < expected.size(); pos += 37)
+                writer.write(std::string_view(expected).substr(pos, 37));
+            writer.close();
+            CHECK(writer.bytes() == expected.size());
+        }
+        FILE* f = fopen(path.c_str(), "rb");
+        REQUIRE(f);
+        std::string written(expected.size() + 1, 0);
+        written.resize(fread(&written[0], 1, written.size(), f));
+        fclose(f);
+        remove(path.c_str());
+        CHECK(written == expected);
+    }
+    CHECK_THROWS(btc_utils::output_writer_t("/nonexistent/output_writer_test.txt"));
+}
+
+TEST_CASE("output_compression")
+{
+    std::string expected;
+    for (int i = 0; i < 5000; i++)
+        expected += std::to_string(i * 7919) + (i % 3 ? " " : "\n");
+    for (auto format: {btc_utils::OUTPUT_ZSTD, btc_utils::OUTPUT_LZ4}) {
+        std::string path = "output_compression_test";
+        if (!btc_utils::output_format_supported(format)) {
+            CHECK_THROWS(btc_utils::output_writer_t(path, 4096, 2, false, format));
+            continue;
+        }
+        size_t frames = 0;
+        {
+            btc_utils::output_writer_t writer(path, 4096, 2, false, format, 0, 2);
+            for (size_t pos = 0; pos < expected.size(); pos += 37) {
+                writer.write(std::string_view(expected).substr(pos, 37));
+                // frames ending before the buffer is full
+                if (pos % (37 * 50) == 0)
+                    writer.end_frame();
+            }
+            writer.close();
+            CHECK(writer.bytes() == expected.size());
+            frames = writer.frames();
+        }
+        std::vector<btc_utils::output_frame_t> table = btc_utils::read_output_frames(path);
+        CHECK(table.size() == frames);
+        FILE* f = fopen(path.c_str(), "rb");
+        REQUIRE(f);
+        std::string decompressed;
+        for (const auto& frame: table) {
+            CHECK(frame.raw_size <= 4096);
+            std::vector<char> data(frame.size);
+            fseeko(f, static_cast<off_t>(frame.offset), SEEK_SET);
+            REQUIRE(fread(data.data(), 1, data.size(), f) == data.size());
+            decompressed += btc_utils::decompress_output_frame(format, data.data(), frame);
+        }
+        fclose(f);
+        remove(path.c_str());
+        CHECK(decompressed == expected);
+    }
+    CHECK_THROWS(btc_utils::read_output_frames("/nonexistent/output_compression_test"));
+}
@@ -10,46 +10,27 @@
 
 namespace btc_utils {
 
-std::vector<std::string> tx_out_t::addresses() const
+std::vector<std::string> tx_out_t::addresses(network_t network) const
 {
-   std::vector<std::vector<unsigned char>> keys;
-   txnouttype out_type = solver(scriptPubKey, keys);
    std::vector<std::string> res;
+   for (const auto& dest: extract_destinations(scriptPubKey))
+       res.push_back(encode_destination(dest, network));
+   return res;
+}
 
-   if (out_type == TX_PUBKEY) {
-       pub_key_t pubkey(keys[0].begin(), keys[0].end());
-       res.push_back(encode_destination(pk_hash_tx_destination_t(pubkey.get_id())));
-   }
-   else if (out_type == TX_PUBKEYHASH)
-   {
-       uint160_t pk_hash;
-       std::copy(keys[0].begin(), keys[0].end(), pk_hash.begin());
-       res.push_back(encode_destination(pk_hash_tx_destination_t(pk_hash)));
-   }
-   else if (out_type == TX_SCRIPTHASH)
-   {
-       uint160_t script_hash;
-       std::copy(keys[0].begin(), keys[0].end(), script_hash.begin());
-       res.push_back(encode_destination(script_hash_tx_destination_t(script_hash)));
-   }
-   else if (out_type == TX_WITNESS_V0_KEYHASH)
+const char* get_read_status(read_status_t status)
+{
+   switch (status)
    {
-       uint160_t key_hash;
-       std::copy(keys[0].begin(), keys[0].end(), key_hash.begin());
-       res.push_back(encode_destination(witness_v0_key_hash_tx_destination_t(key_hash)));
-   } else if (out_type == TX_WITNESS_V0_SCRIPTHASH) {
-       uint256_t script_hash;
-       std::copy(keys[0].begin(), keys[0].end(), script_hash.begin());
-       res.push_back(encode_destination(witness_v0_script_hash_tx_destination_t(script_hash)));
-   } else if (out_type == TX_WITNESS_UNKNOWN) {
-       witness_unknown_tx_destination_t unk;
-       unk.version_ = keys[0][0];
-       std::copy(keys[1].begin(), keys[1].end(), unk.program_.begin());
-       unk.length_ = keys[1].size();
-       res.push_back(encode_destination(unk));
+   case READ_OK: return "ok";
+   case READ_END_OF_FILE: return "end of file";
+   case READ_IO_ERROR: return "read failed";
+   case READ_PAST_LIMIT: return "read attempted past buffer limit";
+   case READ_NON_CANONICAL: return "non-canonical compact int";
+   case READ_TOO_LARGE: return "size is too large";
+   case READ_INVALID: return "invalid transaction data";
    }
-
-   return res;
+   return "unknown";
 }
 
 bool transaction_t::has_witness() const
@@ -62,4 +43,133 @@ bool transaction_t::has_witness() const
    return false;
 }
 
+namespace
+{
+
+//! position after the script or witness item at pos
+size_t skip_bytes(const unsigned char* data, size_t pos)
+{
+   uint64_t size;
+   pos += decode_compact_int(data + pos, size);
+   return pos + size;
+}
+
+size_t decode_bytes(const unsigned char* data, size_t pos, std::vector<unsigned char>& bytes)
+{
+   uint64_t size;
+   pos += decode_compact_int(data + pos, size);
+   bytes.assign(data + pos, data + pos + size);
+   return pos + size;
+}
+
+}
+
+transaction_view_t::transaction_view_t(const unsigned char* data)
+   : data_(data), body_begin_(4), outputs_(0), hashed_(false)
+{
+   size_t pos = body_begin_ + decode_compact_int(data + body_begin_, inputs_);
+   bool witness = false;
+   if (inputs_ == 0) {
+      // a dummy input count, the flag follows
+      if (data[pos++] != 0) {
+         witness = true;
+         body_begin_ = pos;
+         pos += decode_compact_int(data + pos, inputs_);
+      }
+   }
+   for (uint64_t i = 0; i < inputs_; i++)
+      pos = skip_bytes(data, pos + 36) + 4;
+   if (inputs_ != 0 || witness)
+      pos += decode_compact_int(data + pos, outputs_);
+   outputs_begin_ = pos;
+   for (uint64_t n = 0; n < outputs_; n++)
+      pos = skip_bytes(data, pos + 8);
+   body_end_ = pos;
+   if (witness) {
+      for (uint64_t i = 0; i < inputs_; i++) {
+         uint64_t items;
+         pos += decode_compact_int(data + pos, items);
+         for (uint64_t j = 0; j < items; j++)
+            pos = skip_bytes(data, pos);
+      }
+   }
+   lock_begin_ = pos;
+   size_ = pos + 4;
+}
+
+uint32_t transaction_view_t::version() const
+{
+   uint32_t version;
+   decode_fixed(data_, version);
+   return version;
+}
+
+uint32_t transaction_view_t::lock_time() const
+{
+   uint32_t lock_time;
+   decode_fixed(data_ + lock_begin_, lock_time);
+   return lock_time;
+}
+
+const uint256_t& transaction_view_t::txid() const
+{
+   if (!hashed_) {
+      hash256_t& hasher = hash256_t::thread_hasher();
+      if (has_witness()) {
+         // skip the marker, flag and witness data
+         hasher.write(data_, 4);
+         hasher.write(data_ + body_begin_, body_end_ - body_begin_);
+         hasher.write(data_ + lock_begin_, 4);
+      } else {
+         hasher.write(data_, size_);
+      }
+      txid_ = hasher.finalize();
+      hashed_ = true;
+   }
+   return txid_;
+}
+
+uint256_t transaction_view_t::wtxid() const
+{
+   if (!has_witness())
+      return txid();
+   return hash256_t::thread_hasher().write(data_, size_).finalize();
+}
+
+void transaction_view_t::decode(transaction_t& tx, tx_hashes_t hashes) const
+{
+   tx.nVersion = version();
+   tx.vin.resize(inputs_);
+   uint64_t count;
+   size_t pos = body_begin_ + decode_compact_int(data_ + body_begin_, count);
+   for (auto& in: tx.vin) {
+      decode_fixed(data_ + pos, in.prevout);
+      pos = decode_bytes(data_, pos + 36, in.scriptSig);
+      decode_fixed(data_ + pos, in.nSequence);
+      pos += 4;
+      in.scriptWitness.clear();
+   }
+   tx.vout.resize(outputs_);
+   pos = outputs_begin_;
+   for (auto& out: tx.vout) {
+      decode_fixed(data_ + pos, out.nValue);
+      pos = decode_bytes(data_, pos + 8, out.scriptPubKey);
+   }
+   if (has_witness()) {
+      pos = body_end_;
+      for (auto& in: tx.vin) {
+         uint64_t items;
+         pos += decode_compact_int(data_ + pos, items);
+         in.scriptWitness.resize(items);
+         for (auto& item: in.scriptWitness)
+            pos = decode_bytes(data_, pos, item);
+      }
+   }
+   tx.nLockTime = lock_time();
+   if (hashes == TX_HASHES_NONE)
+      return;
+   tx.txid = txid();
+   tx.wtxid = hashes == TX_HASHES_ALL ? wtxid() : tx.txid;
+}
+
 }
@@ -0,0 +1,136 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <utxo_set.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace btc_utils
+{
+
+size_t utxo_set_t::home(const uint256_t& txid, uint32_t n) const
+{
+   uint64_t key;
+   memcpy(&key, txid.data(), sizeof(key));
+   return static_cast<size_t>(key + n * 0x9e3779b97f4a7c15ULL) & (capacity_ - 1);
+}
+
+utxo_set_t::utxo_set_t(const std::string& spill_path, size_t capacity)
+   : spill_path_(spill_path), slots_(nullptr), capacity_(16), size_(0)
+{
+   while (capacity_ < capacity)
+      capacity_ *= 2;
+   slots_ = allocate(capacity_);
+}
+
+utxo_set_t::~utxo_set_t()
+{
+   release(slots_, capacity_);
+}
+
+utxo_set_t::slot_t* utxo_set_t::allocate(size_t capacity) const
+{
+   size_t len = capacity * sizeof(slot_t);
+   void* mem = MAP_FAILED;
+   if (spill_path_.empty()) {
+      mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   } else {
+      int fd = open(spill_path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+      if (fd < 0)
+         throw std::runtime_error("Unable to create UTXO spill file " + spill_path_);
+      unlink(spill_path_.c_str());
+      if (ftruncate(fd, static_cast<off_t>(len)) == 0)
+         mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+   }
+   if (mem == MAP_FAILED)
+      throw std::runtime_error("Unable to allocate UTXO set");
+   slot_t* slots = static_cast<slot_t*>(mem);
+   for (size_t i = 0; i < capacity; i++)
+      slots[i].address_id = EMPTY;
+   return slots;
+}
+
+void utxo_set_t::release(slot_t* slots, size_t capacity) const
+{
+   if (slots)
+      munmap(slots, capacity * sizeof(slot_t));
+}
+
+void utxo_set_t::insert(const slot_t& slot)
+{
+   size_t i = home(slot.txid, slot.n);
+   while (slots_[i].address_id != EMPTY) {
+      if (slots_[i].txid == slot.txid && slots_[i].n == slot.n) {
+         // duplicated coinbase txids (BIP30) overwrite the older output
+         slots_[i] = slot;
+         return;
+      }
+      i = (i + 1) & (capacity_ - 1);
+   }
+   slots_[i] = slot;
+   size_++;
+}
+
+void utxo_set_t::grow()
+{
+   slot_t* old = slots_;
+   size_t old_capacity = capacity_;
+   slots_ = allocate(capacity_ * 2);
+   capacity_ *= 2;
+   size_ = 0;
+   for (size_t i = 0; i < old_capacity; i++) {
+      if (old[i].address_id != EMPTY)
+         insert(old[i]);
+   }
+   release(old, old_capacity);
+}
+
+void utxo_set_t::add(const out_point_t& outpoint, const utxo_t& coin)
+{
+   if (coin.address_id == EMPTY)
+      throw std::runtime_error("Invalid UTXO owner id");
+   if ((size_ + 1) * 4 > capacity_ * 3)
+      grow();
+   insert(slot_t{outpoint.hash, outpoint.n, coin.address_id, coin.value});
+}
+
+bool utxo_set_t::spend(const out_point_t& outpoint, utxo_t& coin)
+{
+   const uint256_t& txid = outpoint.hash;
+   size_t mask = capacity_ - 1;
+   size_t i = home(txid, outpoint.n);
+   while (slots_[i].n != outpoint.n || slots_[i].txid != txid) {
+      if (slots_[i].address_id == EMPTY)
+         return false;
+      i = (i + 1) & mask;
+   }
+   if (slots_[i].address_id == EMPTY)
+      return false;
+   coin = utxo_t{slots_[i].address_id, slots_[i].value};
+
+   // shift back the following entries of the cluster so lookups never
+   // need tombstones
+   size_t j = i;
+   while (true) {
+      j = (j + 1) & mask;
+      if (slots_[j].address_id == EMPTY)
+         break;
+      size_t k = home(slots_[j].txid, slots_[j].n);
+      // move slot j to the hole at i unless its home lies in (i, j]
+      if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+         slots_[i] = slots_[j];
+         i = j;
+      }
+   }
+   slots_[i].address_id = EMPTY;
+   size_--;
+   return true;
+}
+
+}
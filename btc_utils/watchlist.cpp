@@ -0,0 +1,212 @@
+// Copyright (c) 2020 gladcow
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <watchlist.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+namespace btc_utils
+{
+
+namespace
+{
+
+//! construction fails with a small probability, a new seed is tried then
+const int MAX_BUILD_ATTEMPTS = 64;
+
+uint64_t mix(uint64_t h)
+{
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   return h;
+}
+
+uint64_t rotl64(uint64_t h, int n)
+{
+   return (h << n) | (h >> (64 - n));
+}
+
+uint32_t reduce(uint32_t h, uint32_t n)
+{
+   return static_cast<uint32_t>((static_cast<uint64_t>(h) * n) >> 32);
+}
+
+unsigned char fingerprint(uint64_t h)
+{
+   return static_cast<unsigned char>(h ^ (h >> 32));
+}
+
+struct slots_t
+{
+   uint32_t h0, h1, h2;
+};
+
+slots_t slots(uint64_t h, uint32_t block_length)
+{
+   return {reduce(static_cast<uint32_t>(h), block_length),
+           reduce(static_cast<uint32_t>(rotl64(h, 21)), block_length) + block_length,
+           reduce(static_cast<uint32_t>(rotl64(h, 42)), block_length) + 2 * block_length};
+}
+
+} // namespace
+
+xor_filter_t::xor_filter_t(std::vector<uint64_t> hashes) : seed_(0), block_length_(0)
+{
+   std::sort(hashes.begin(), hashes.end());
+   hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+   size_t capacity = 32 + static_cast<size_t>(1.23 * static_cast<double>(hashes.size()));
+   if (capacity / 3 > std::numeric_limits<uint32_t>::max())
+      throw std::runtime_error("Too many keys for the xor filter");
+   block_length_ = static_cast<uint32_t>(capacity / 3);
+   fingerprints_.resize(3 * static_cast<size_t>(block_length_));
+
+   uint64_t seed = 0x726b2b9d438b9d4dULL;
+   for (int attempt = 0; attempt < MAX_BUILD_ATTEMPTS; attempt++) {
+      seed_ = mix(seed + static_cast<uint64_t>(attempt));
+      if (build(hashes))
+         return;
+   }
+   throw std::runtime_error("Unable to build the xor filter");
+}
+
+bool xor_filter_t::build(const std::vector<uint64_t>& hashes)
+{
+   // every slot keeps the xor of the hashes mapped to it and their number
+   size_t size = fingerprints_.size();
+   std::vector<uint64_t> xors(size, 0);
+   std::vector<uint32_t> counts(size, 0);
+   for (uint64_t key: hashes) {
+      uint64_t h = mix(key + seed_);
+      slots_t s = slots(h, block_length_);
+      xors[s.h0] ^= h; counts[s.h0]++;
+      xors[s.h1] ^= h; counts[s.h1]++;
+      xors[s.h2] ^= h; counts[s.h2]++;
+   }
+
+   // peel the slots with a single hash until nothing is left
+   std::vector<uint32_t> queue;
+   for (uint32_t i = 0; i < size; i++)
+      if (counts[i] == 1)
+         queue.push_back(i);
+   std::vector<std::pair<uint64_t, uint32_t>> stack;
+   stack.reserve(hashes.size());
+   while (!queue.empty()) {
+      uint32_t slot = queue.back();
+      queue.pop_back();
+      if (counts[slot] != 1)
+         continue;
+      uint64_t h = xors[slot];
+      stack.emplace_back(h, slot);
+      slots_t s = slots(h, block_length_);
+      for (uint32_t other: {s.h0, s.h1, s.h2}) {
+         xors[other] ^= h;
+         if (--counts[other] == 1)
+            queue.push_back(other);
+      }
+   }
+   if (stack.size() != hashes.size())
+      return false;
+
+   std::fill(fingerprints_.begin(), fingerprints_.end(), 0);
+   for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+      slots_t s = slots(it->first, block_length_);
+      fingerprints_[it->second] = fingerprint(it->first) ^ fingerprints_[s.h0] ^
+                                  fingerprints_[s.h1] ^ fingerprints_[s.h2];
+   }
+   return true;
+}
+
+bool xor_filter_t::contains(uint64_t hash) const
+{
+   if (block_length_ == 0)
+      return false;
+   uint64_t h = mix(hash + seed_);
+   slots_t s = slots(h, block_length_);
+   return fingerprint(h) == (fingerprints_[s.h0] ^ fingerprints_[s.h1] ^ fingerprints_[s.h2]);
+}
+
+void xor_filter_t::prefetch(uint64_t hash) const
+{
+   if (block_length_ == 0)
+      return;
+   uint64_t h = mix(hash + seed_);
+   slots_t s = slots(h, block_length_);
+   __builtin_prefetch(&fingerprints_[s.h0]);
+   __builtin_prefetch(&fingerprints_[s.h1]);
+   __builtin_prefetch(&fingerprints_[s.h2]);
+}
+
+watchlist_t::watchlist_t(const std::vector<address_key_t>& keys)
+{
+   std::vector<std::pair<uint64_t, const address_key_t*>> sorted;
+   sorted.reserve(keys.size());
+   for (const auto& key: keys)
+      sorted.emplace_back(key.hash(), &key);
+   std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint64_t, const address_key_t*>& a,
+                                              const std::pair<uint64_t, const address_key_t*>& b) {
+      return a.first != b.first ? a.first < b.first : *a.second < *b.second;
+   });
+   sorted.erase(std::unique(sorted.begin(), sorted.end(), [](const std::pair<uint64_t, const address_key_t*>& a,
+                                                             const std::pair<uint64_t, const address_key_t*>& b) {
+      return a.first == b.first && *a.second == *b.second;
+   }), sorted.end());
+
+   hashes_.reserve(sorted.size());
+   offsets_.reserve(sorted.size());
+   for (const auto& item: sorted) {
+      hashes_.push_back(item.first);
+      offsets_.push_back(pool_.size());
+      pool_.push_back(item.second->len_);
+      pool_.insert(pool_.end(), item.second->data_.begin(), item.second->data_.begin() + item.second->len_);
+   }
+   filter_ = xor_filter_t(hashes_);
+}
+
+watchlist_t watchlist_t::load(const std::string& path, network_t network, size_t& invalid)
+{
+   std::ifstream in(path);
+   if (!in)
+      throw std::runtime_error("Unable to open watchlist " + path);
+   std::vector<address_key_t> keys;
+   std::string line;
+   invalid = 0;
+   while (std::getline(in, line)) {
+      size_t begin = line.find_first_not_of(" \t\r");
+      if (begin == std::string::npos)
+         continue;
+      size_t end = line.find_last_not_of(" \t\r");
+      tx_destination_t dest;
+      if (decode_destination(line.substr(begin, end - begin + 1), dest, network))
+         keys.emplace_back(dest);
+      else
+         invalid++;
+   }
+   return watchlist_t(keys);
+}
+
+bool watchlist_t::contains(const address_key_t& key, uint64_t hash) const
+{
+   auto it = std::lower_bound(hashes_.begin(), hashes_.end(), hash);
+   for (; it != hashes_.end() && *it == hash; ++it) {
+      const unsigned char* p = &pool_[offsets_[static_cast<size_t>(it - hashes_.begin())]];
+      if (p[0] == key.len_ && memcmp(p + 1, key.data_.data(), key.len_) == 0)
+         return true;
+   }
+   return false;
+}
+
+size_t watchlist_t::memory_usage() const
+{
+   return filter_.memory_usage() + hashes_.size() * sizeof(uint64_t) +
+          offsets_.size() * sizeof(uint64_t) + pool_.size();
+}
+
+}